@@ -0,0 +1,239 @@
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// Pool blocks start with this header, the caller gets what follows it. It is
+// padded to 16 bytes to keep malloc()'s alignment. Blocks too large for any
+// class have ALLOC_NO_CLASS and are freed directly.
+typedef union block {
+  struct {
+    union block *next; // while on a free list
+    int size_class;
+  } h;
+  char pad[16];
+} block_t;
+
+// Four classes per power of two from 64 bytes up to 1 GB.
+#define ALLOC_MIN_BLOCK 64
+#define ALLOC_CLASSES (4 * 24)
+#define ALLOC_NO_CLASS -1
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t size;
+  size_t used;
+} chunk_t;
+
+#define CHUNK_HEADER ((sizeof(chunk_t) + 15) & ~(size_t)15)
+
+enum { ALLOC_POOL, ALLOC_ARENA };
+
+struct allocator {
+  int kind;
+  size_t system_allocs;
+
+  // pool
+  pthread_mutex_t lock;
+  block_t *free[ALLOC_CLASSES];
+  size_t budget;
+  size_t cached;
+
+  // arena: chunks in allocation order, current is the one being filled.
+  chunk_t *chunks;
+  chunk_t *current;
+  size_t chunk;
+};
+
+// Bytes a block of size class i holds, not counting the header.
+static size_t class_size(int i) {
+  size_t base = (size_t)ALLOC_MIN_BLOCK << (i / 4);
+  return base + base / 4 * (i % 4);
+}
+
+static int size_class(size_t size) {
+  for (int i = 0; i < ALLOC_CLASSES; i++) {
+    if (class_size(i) >= size) {
+      return i;
+    }
+  }
+  return ALLOC_NO_CLASS;
+}
+
+allocator_t *allocator_create_pool(size_t budget) {
+  allocator_t *allocator = calloc(1, sizeof(allocator_t));
+  if (allocator == NULL) {
+    return NULL;
+  }
+
+  allocator->kind = ALLOC_POOL;
+  allocator->budget = budget;
+  pthread_mutex_init(&allocator->lock, NULL);
+  return allocator;
+}
+
+allocator_t *allocator_create_arena(size_t chunk) {
+  allocator_t *allocator = calloc(1, sizeof(allocator_t));
+  if (allocator == NULL) {
+    return NULL;
+  }
+
+  allocator->kind = ALLOC_ARENA;
+  allocator->chunk = chunk > 0 ? chunk : ALLOC_DEFAULT_CHUNK;
+  pthread_mutex_init(&allocator->lock, NULL);
+  return allocator;
+}
+
+void allocator_free(allocator_t *allocator) {
+  if (allocator == NULL) {
+    return;
+  }
+
+  allocator_reset(allocator);
+  while (allocator->chunks) {
+    chunk_t *next = allocator->chunks->next;
+    free(allocator->chunks);
+    allocator->chunks = next;
+  }
+  pthread_mutex_destroy(&allocator->lock);
+  free(allocator);
+}
+
+static void *pool_alloc(allocator_t *allocator, size_t size) {
+  int i = size_class(size);
+  block_t *block = NULL;
+
+  if (i != ALLOC_NO_CLASS) {
+    pthread_mutex_lock(&allocator->lock);
+    block = allocator->free[i];
+    if (block != NULL) {
+      allocator->free[i] = block->h.next;
+      allocator->cached -= class_size(i);
+    } else {
+      allocator->system_allocs++;
+    }
+    pthread_mutex_unlock(&allocator->lock);
+    size = class_size(i);
+  } else {
+    pthread_mutex_lock(&allocator->lock);
+    allocator->system_allocs++;
+    pthread_mutex_unlock(&allocator->lock);
+  }
+
+  if (block == NULL) {
+    block = malloc(sizeof(block_t) + size);
+    if (block == NULL) {
+      return NULL;
+    }
+  }
+  block->h.size_class = i;
+  return block + 1;
+}
+
+static void pool_release(allocator_t *allocator, void *data) {
+  block_t *block = (block_t *)data - 1;
+  int i = block->h.size_class;
+
+  if (i != ALLOC_NO_CLASS) {
+    pthread_mutex_lock(&allocator->lock);
+    if (allocator->cached + class_size(i) <= allocator->budget) {
+      block->h.next = allocator->free[i];
+      allocator->free[i] = block;
+      allocator->cached += class_size(i);
+      block = NULL;
+    }
+    pthread_mutex_unlock(&allocator->lock);
+  }
+  free(block);
+}
+
+// Take size bytes from the current chunk, moving on to the next one (kept
+// from earlier frames or new) when it's full.
+static void *arena_alloc(allocator_t *allocator, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+
+  while (allocator->current != NULL) {
+    chunk_t *chunk = allocator->current;
+    if (chunk->size - chunk->used >= size) {
+      void *data = (char *)chunk + CHUNK_HEADER + chunk->used;
+      chunk->used += size;
+      return data;
+    }
+    if (chunk->next == NULL) {
+      break;
+    }
+    allocator->current = chunk->next;
+  }
+
+  size_t capacity = size > allocator->chunk ? size : allocator->chunk;
+  chunk_t *chunk = malloc(CHUNK_HEADER + capacity);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  allocator->system_allocs++;
+  chunk->next = NULL;
+  chunk->size = capacity;
+  chunk->used = size;
+  if (allocator->current != NULL) {
+    allocator->current->next = chunk;
+  } else {
+    allocator->chunks = chunk;
+  }
+  allocator->current = chunk;
+  return (char *)chunk + CHUNK_HEADER;
+}
+
+void *allocator_alloc(allocator_t *allocator, size_t size) {
+  if (allocator == NULL) {
+    return malloc(size);
+  }
+  if (allocator->kind == ALLOC_ARENA) {
+    return arena_alloc(allocator, size);
+  }
+  return pool_alloc(allocator, size);
+}
+
+void allocator_release(allocator_t *allocator, void *block) {
+  if (allocator == NULL) {
+    free(block);
+  } else if (block != NULL && allocator->kind == ALLOC_POOL) {
+    pool_release(allocator, block);
+  }
+}
+
+void allocator_reset(allocator_t *allocator) {
+  if (allocator == NULL) {
+    return;
+  }
+
+  if (allocator->kind == ALLOC_ARENA) {
+    for (chunk_t *chunk = allocator->chunks; chunk; chunk = chunk->next) {
+      chunk->used = 0;
+    }
+    allocator->current = allocator->chunks;
+    return;
+  }
+
+  pthread_mutex_lock(&allocator->lock);
+  for (int i = 0; i < ALLOC_CLASSES; i++) {
+    while (allocator->free[i]) {
+      block_t *next = allocator->free[i]->h.next;
+      free(allocator->free[i]);
+      allocator->free[i] = next;
+    }
+  }
+  allocator->cached = 0;
+  pthread_mutex_unlock(&allocator->lock);
+}
+
+size_t allocator_system_allocs(allocator_t *allocator) {
+  size_t allocs;
+
+  if (allocator == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&allocator->lock);
+  allocs = allocator->system_allocs;
+  pthread_mutex_unlock(&allocator->lock);
+  return allocs;
+}
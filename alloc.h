@@ -0,0 +1,49 @@
+#ifndef __ALLOC_H_
+#define __ALLOC_H_
+
+#include <stddef.h>
+
+// Where images and scratch buffers get their memory. Every function taking an
+// allocator_t* accepts NULL for plain malloc() and free(). Blocks are 16-byte
+// aligned.
+//
+// A pool keeps freed blocks on free lists by size class (four per power of
+// two, so at most 25% is wasted) and hands them out again, so rendering that
+// keeps creating and freeing images of the same sizes stops touching the heap
+// once the lists are warm. Pools are safe to share between threads.
+//
+// An arena hands out memory from a few large chunks and frees nothing until
+// allocator_reset() takes all of it back at once. A context's frame arena is
+// reset on every present. Arenas belong to one thread.
+typedef struct allocator allocator_t;
+
+// budget is how many bytes of freed blocks the pool keeps, anything past it
+// goes back to the system. Returns NULL without memory.
+allocator_t* allocator_create_pool(size_t budget);
+
+// chunk is the size of the arena's chunks, 0 picks ALLOC_DEFAULT_CHUNK.
+// Larger allocations get a chunk of their own. Returns NULL without memory.
+allocator_t* allocator_create_arena(size_t chunk);
+
+#define ALLOC_DEFAULT_CHUNK (4 << 20)
+
+// Frees the allocator and, for arenas, everything allocated from it. Blocks
+// still out of a pool must not be released afterwards.
+void allocator_free(allocator_t* allocator);
+
+// NULL without memory.
+void* allocator_alloc(allocator_t* allocator, size_t size);
+
+// Give a block back to the allocator it came from. A no-op for arenas and
+// NULL blocks.
+void allocator_release(allocator_t* allocator, void* block);
+
+// Arenas: everything allocated so far becomes invalid and the chunks are used
+// again from the start. Pools: the free lists go back to the system.
+void allocator_reset(allocator_t* allocator);
+
+// How often the allocator had to call malloc(). Stops growing once the
+// steady state is reached.
+size_t allocator_system_allocs(allocator_t* allocator);
+
+#endif
@@ -0,0 +1,521 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "capture.h"
+#include "draw.h"
+#include "font.h"
+#include "img-jpeg.h"
+#include "img-png.h"
+#include "loader.h"
+#include "raster.h"
+#include "span.h"
+#include "stats.h"
+
+// Times the drawing primitives on offscreen contexts and prints Mpix/s.
+//
+//   bench [-t threads] [-m milliseconds] [image.png|image.jpg ...]
+//
+// Every case runs for at least the given time (default 200 ms). Images on the
+// command line are decoded the same way. Run it once per span implementation
+// or thread count to compare them. Frame captures are read back as well; the
+// exit status is 1 when one didn't survive the round-trip.
+
+typedef struct {
+  int width;
+  int height;
+} resolution_t;
+
+static const resolution_t resolutions[] = {
+    {320, 240}, {1280, 720}, {1920, 1080}, {3840, 2160}};
+#define RESOLUTION_COUNT (int)(sizeof(resolutions) / sizeof(resolutions[0]))
+
+static uint64_t min_ns = 200000000;
+
+typedef struct {
+  context_t *context;
+  image_t *image;
+  image_t *dest;
+  fontmap_t *fontmap;
+  const char *path;
+  int filter;
+  loader_t *loader;
+  char **paths;
+  int path_count;
+  image_cache_t *cache;
+  capture_t *capture;
+  int format;
+  int result;
+} bench_t;
+
+// One call of the case under test, returns the pixels it touched.
+typedef long (*bench_fn)(bench_t *bench);
+
+static long bench_rect(bench_t *b) {
+  draw_rect(b->context->width / 4, b->context->height / 4,
+            b->context->width / 2, b->context->height / 2, b->context,
+            0x336699);
+  return (long)(b->context->width / 2) * (b->context->height / 2);
+}
+
+static long bench_clear(bench_t *b) {
+  clear_context(b->context);
+  return (long)b->context->width * b->context->height;
+}
+
+static long bench_array(bench_t *b) {
+  draw_image(0, 0, b->image, b->context);
+  return (long)b->image->width * b->image->height;
+}
+
+// The left square of the image turned a quarter onto the context, what a
+// panel mounted sideways costs: every pixel crosses a transpose.
+static long bench_rotate(bench_t *b) {
+  image_t view = image_view(b->image, 0, 0, b->context->height,
+                            b->context->height);
+  draw_image_rotated(0, 0, &view, CONTEXT_ROTATE_90, b->context);
+  return (long)view.width * view.height;
+}
+
+static long bench_blend(bench_t *b) {
+  draw_image_blend(0, 0, b->image, b->context);
+  return (long)b->image->width * b->image->height;
+}
+
+// Glyph cells of the built-in font are 8x8 plus one column of spacing.
+#define GLYPH_SIZE 8
+
+// Lines of text at the fontmap's scale.
+static long string_lines(bench_t *b) {
+  static char line[] = "The quick brown fox jumps over the lazy dog 0123456789";
+  int scale = b->fontmap->scale;
+  int size = GLYPH_SIZE * scale;
+  int advance = (GLYPH_SIZE + 1) * scale;
+  int chars = (int)strlen(line);
+  long pixels = 0;
+
+  for (int y = 0; y + size < b->context->height; y += size + 2 * scale) {
+    for (int x = 0; x < b->context->width; x += chars * advance) {
+      draw_string_color(x, y, line, b->fontmap, b->context, 0xFFFFFF);
+      pixels += (long)chars * advance * size;
+    }
+  }
+  return pixels;
+}
+
+static long bench_string(bench_t *b) {
+  fontmap_set_scale(b->fontmap, 1);
+  return string_lines(b);
+}
+
+// Glyphs blown up 3x, blended from cached masks. The scale stays until the
+// next draw_string run so the masks are kept between iterations.
+static long bench_string_scaled(bench_t *b) {
+  fontmap_set_scale(b->fontmap, 3);
+  return string_lines(b);
+}
+
+// An anti-aliased disc filling the middle of the context.
+static long bench_circle(bench_t *b) {
+  float r = (b->context->height < b->context->width ? b->context->height
+                                                    : b->context->width) /
+            3.0f;
+
+  fill_circle(b->context->width / 2.0f, b->context->height / 2.0f, r,
+              b->context, 0x336699, RASTER_AA);
+  return (long)(3.14159f * r * r);
+}
+
+// A line chart with a point every 4 pixels across the context, counting the
+// pixels of the 2 pixel wide line.
+static long bench_chart(bench_t *b) {
+  static float points[2 * 1024];
+  int count = b->context->width / 4 + 1;
+  float length = 0;
+
+  if (count > 1024) {
+    count = 1024;
+  }
+  for (int i = 0; i < count; i++) {
+    points[2 * i] = i * 4.0f;
+    points[2 * i + 1] =
+        b->context->height * (0.5f + 0.3f * sinf(i * 0.05f) +
+                              0.05f * sinf(i * 0.7f));
+    if (i > 0) {
+      float dx = points[2 * i] - points[2 * i - 2];
+      float dy = points[2 * i + 1] - points[2 * i - 1];
+      length += sqrtf(dx * dx + dy * dy);
+    }
+  }
+  draw_polyline(points, count, 2.0f, b->context, 0x80FF8000, RASTER_AA);
+  return (long)(length * 2);
+}
+
+static long bench_scale(bench_t *b) {
+  scale_into_pool(b->image, b->dest, b->filter, b->context->pool,
+                  b->context->stats);
+  return (long)b->dest->width * b->dest->height;
+}
+
+// A 320x180 thumbnail of b->image per frame, malloc()ed or from the frame
+// arena (when the context has allocators) and dropped on present.
+static long bench_thumbnail(bench_t *b) {
+  image_t *thumb = scale_filtered_alloc(b->image, 320, 180, b->filter,
+                                        b->context->frame);
+
+  if (thumb == NULL) {
+    return 0;
+  }
+  if (b->context->frame == NULL) {
+    image_free(thumb);
+  }
+  context_present(b->context);
+  return 320 * 180;
+}
+
+// A 4 x 4 grid of 48 x 48 icons from the source, scaled every time without a
+// cache, blitted from the cached copy with one.
+static long bench_icons(bench_t *b) {
+  for (int i = 0; i < 16; i++) {
+    int x = i % 4 * 48;
+    int y = i / 4 * 48;
+
+    if (b->cache != NULL) {
+      image_t *icon =
+          image_cache_get(b->cache, b->image, 48, 48, SCALE_BILINEAR);
+      if (icon == NULL) {
+        return 0;
+      }
+      draw_image(x, y, icon, b->context);
+    } else {
+      image_t *icon = scale_filtered(b->image, 48, 48, SCALE_BILINEAR);
+      if (icon == NULL) {
+        return 0;
+      }
+      draw_image(x, y, icon, b->context);
+      image_free(icon);
+    }
+  }
+  return 16 * 48 * 48;
+}
+
+static int is_png(const char *path) {
+  size_t len = strlen(path);
+  return len > 4 && strcmp(path + len - 4, ".png") == 0;
+}
+
+static image_t *read_file(const char *path) {
+  if (is_png(path)) {
+    return read_png_file((char *)path);
+  }
+  return read_jpeg_file((char *)path);
+}
+
+static long bench_decode(bench_t *b) {
+  image_t *image = read_file(b->path);
+
+  if (image == NULL) {
+    return 0;
+  }
+
+  long pixels = (long)image->width * image->height;
+  image_free(image);
+  return pixels;
+}
+
+// Gallery thumbnails of 320x180.
+static long bench_decode_fit(bench_t *b) {
+  image_t *image = read_jpeg_file_fit((char *)b->path, 320, 180);
+  if (image == NULL) {
+    return 0;
+  }
+
+  long pixels = (long)image->width * image->height;
+  image_free(image);
+  return pixels;
+}
+
+// Decode into the context, as a slideshow would.
+static long bench_decode_into(bench_t *b) {
+  int ret;
+
+  if (is_png(b->path)) {
+    ret = draw_png_file(0, 0, (char *)b->path, b->context);
+  } else {
+    ret = draw_jpeg_file(0, 0, (char *)b->path, b->context);
+  }
+  if (ret < 0) {
+    return 0;
+  }
+  return (long)b->context->width * b->context->height;
+}
+
+// Thumbnails of every file at once through the loader's threads.
+static long bench_loader(bench_t *b) {
+  loader_request_t *requests[b->path_count];
+  long pixels = 0;
+
+  for (int i = 0; i < b->path_count; i++) {
+    requests[i] = loader_load(b->loader, b->paths[i], 320, 180, NULL, NULL);
+  }
+  for (int i = 0; i < b->path_count; i++) {
+    if (loader_wait(b->loader, requests[i]) == LOADER_DONE) {
+      pixels += 320 * 180;
+    }
+    loader_release(b->loader, requests[i]);
+  }
+  return pixels;
+}
+
+static void capture_done(capture_t *capture, const char *path, rect_t area,
+                         int result, void *user) {
+  *(int *)user = result;
+}
+
+// One frame to b->path, waiting for the encoder so every call pays both the
+// copy and the encoding.
+static long bench_capture(bench_t *b) {
+  if (capture_frame(b->capture, b->context, b->path, b->format, 0,
+                    capture_done, &b->result) < 0) {
+    return 0;
+  }
+  capture_flush(b->capture);
+  capture_dispatch(b->capture);
+  return (long)b->context->width * b->context->height;
+}
+
+// Read back what bench_capture wrote last: PNG exactly, JPEG within a few
+// levels per channel on average.
+static int capture_check(bench_t *b) {
+  context_t *context = b->context;
+  image_t *image = b->format == CAPTURE_PNG ? read_png_file((char *)b->path)
+                                            : read_jpeg_file((char *)b->path);
+  long long error = 0;
+  int ok;
+
+  if (b->result != 0 || image == NULL) {
+    return 0;
+  }
+  ok = image->width == context->width && image->height == context->height;
+  for (int y = 0; ok && y < image->height; y++) {
+    for (int x = 0; x < image->width; x++) {
+      int a = image->data[y * image->stride + x];
+      int c = context->data[y * context->stride + x];
+      for (int shift = 0; shift < 24; shift += 8) {
+        error += abs((a >> shift & 0xFF) - (c >> shift & 0xFF));
+      }
+    }
+  }
+  if (ok && b->format == CAPTURE_PNG) {
+    ok = error == 0;
+  } else if (ok) {
+    ok = error <= 4LL * 3 * image->width * image->height;
+  }
+  image_free(image);
+  return ok;
+}
+
+static void run(const char *name, const char *size, bench_fn fn,
+                bench_t *bench) {
+  uint64_t start;
+  uint64_t elapsed;
+  long long pixels = 0;
+  long calls = 0;
+
+  // Warm up caches and lazy SIMD dispatch outside the clock.
+  fn(bench);
+
+  start = stats_now();
+  do {
+    pixels += fn(bench);
+    calls++;
+    elapsed = stats_now() - start;
+  } while (elapsed < min_ns);
+
+  printf("%-14s %-10s %8ld calls %10.1f Mpix/s %10.3f ms/call\n", name, size,
+         calls, pixels * 1000.0 / elapsed, elapsed / 1e6 / calls);
+}
+
+// A source image with every pixel different and alpha varying, so the blend
+// cases take the per-pixel path instead of the opaque shortcut.
+static image_t *make_image(int width, int height) {
+  image_t *image = image_create(width, height, NULL);
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      image->data[y * width + x] = ((x * 7 + y * 3) & 0xFF) << 24 |
+                                   (x & 0xFF) << 16 | (y & 0xFF) << 8 |
+                                   ((x ^ y) & 0xFF);
+    }
+  }
+  image_premultiply(image);
+  return image;
+}
+
+// Smooth colors, as a UI mostly shows, so JPEG keeps close to them.
+static void fill_gradient(context_t *context) {
+  for (int y = 0; y < context->height; y++) {
+    for (int x = 0; x < context->width; x++) {
+      context->data[y * context->stride + x] =
+          (x * 255 / context->width) << 16 | (y * 255 / context->height) << 8 |
+          0x80;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int threads = 1;
+  int status = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:m:")) != -1) {
+    switch (opt) {
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'm':
+      min_ns = (uint64_t)atoi(optarg) * 1000000;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t threads] [-m ms] [images...]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  printf("span: %s, threads: %d\n", span_impl_name(), threads);
+
+  fontmap_t *fontmap = fontmap_default();
+
+  for (int i = 0; i < RESOLUTION_COUNT; i++) {
+    int w = resolutions[i].width;
+    int h = resolutions[i].height;
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d", w, h);
+
+    context_t *context = context_create_offscreen(w, h);
+    if (context == NULL) {
+      fprintf(stderr, "cannot allocate %s context\n", size);
+      return 1;
+    }
+    if (context_set_threads(context, threads, 0) < 0) {
+      fprintf(stderr, "cannot start %d threads\n", threads);
+      return 1;
+    }
+
+    image_t *image = make_image(w, h);
+    image_t *source = make_image(w / 2 + 1, h / 2 + 1);
+    image_t target = {context->data, w, h, context->stride, NULL, 0};
+    bench_t bench = {context, image, &target, fontmap, NULL,
+                     SCALE_NEAREST, NULL, NULL, 0, NULL, NULL, 0, 0};
+
+    run("draw_rect", size, bench_rect, &bench);
+    run("clear_context", size, bench_clear, &bench);
+    run("draw_array", size, bench_array, &bench);
+    run("draw_blend", size, bench_blend, &bench);
+    run("rotate_90", size, bench_rotate, &bench);
+    run("draw_string", size, bench_string, &bench);
+    run("draw_string_3x", size, bench_string_scaled, &bench);
+    run("fill_circle", size, bench_circle, &bench);
+    run("draw_polyline", size, bench_chart, &bench);
+
+    // Upscale a half-size image to the whole context.
+    bench.image = source;
+    run("scale_nearest", size, bench_scale, &bench);
+    bench.filter = SCALE_BILINEAR;
+    run("scale_bilinear", size, bench_scale, &bench);
+    run("thumb_malloc", size, bench_thumbnail, &bench);
+    if (context_enable_allocators(context, 0) == 0) {
+      run("thumb_frame", size, bench_thumbnail, &bench);
+      printf("%-14s %-10s %8zu mallocs\n", "thumb_frame", size,
+             allocator_system_allocs(context->frame));
+    }
+    run("icons_scale", size, bench_icons, &bench);
+    bench.cache = image_cache_create(0, context->allocator);
+    if (bench.cache != NULL) {
+      run("icons_cached", size, bench_icons, &bench);
+      image_cache_free(bench.cache);
+      bench.cache = NULL;
+    }
+
+    // Written where the system keeps temporary files, replaced every call.
+    const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char png[256], jpeg[256];
+    snprintf(png, sizeof(png), "%s/bench-capture.png", tmp);
+    snprintf(jpeg, sizeof(jpeg), "%s/bench-capture.jpg", tmp);
+    bench.capture = capture_create(1, 0);
+    if (bench.capture != NULL) {
+      const char *names[] = {"capture_png", "capture_jpeg"};
+      const char *paths[] = {png, jpeg};
+      int formats[] = {CAPTURE_PNG, CAPTURE_JPEG};
+
+      fill_gradient(context);
+      for (int f = 0; f < 2; f++) {
+        bench.path = paths[f];
+        bench.format = formats[f];
+        run(names[f], size, bench_capture, &bench);
+        if (!capture_check(&bench)) {
+          printf("%-14s %-10s round-trip FAILED\n", names[f], size);
+          status = 1;
+        }
+        unlink(paths[f]);
+      }
+      capture_free(bench.capture);
+      bench.capture = NULL;
+      bench.path = NULL;
+    }
+
+    image_free(source);
+    image_free(image);
+    context_release(context);
+  }
+
+  for (int i = optind; i < argc; i++) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "cannot open %s\n", argv[i]);
+      continue;
+    }
+    fclose(fp);
+
+    bench_t bench = {NULL, NULL, NULL, NULL, argv[i], 0, NULL,
+                     NULL, 0,    NULL, NULL,    0, 0};
+    run("decode", argv[i], bench_decode, &bench);
+
+    if (!is_png(argv[i])) {
+      run("decode_fit", argv[i], bench_decode_fit, &bench);
+    }
+
+    // The whole file into a context of its size, without an image between.
+    image_t *image = read_file(argv[i]);
+    if (image == NULL) {
+      continue;
+    }
+    bench.context = context_create_offscreen(image->width, image->height);
+    image_free(image);
+    if (bench.context != NULL) {
+      run("decode_into", argv[i], bench_decode_into, &bench);
+      context_release(bench.context);
+    }
+  }
+
+  // Nothing cached, every round decodes again.
+  if (optind < argc) {
+    bench_t bench = {NULL, NULL, NULL, NULL, NULL, 0, NULL,
+                     NULL, 0,    NULL, NULL, 0, 0};
+    bench.loader = loader_create(threads, 0);
+    bench.paths = &argv[optind];
+    bench.path_count = argc - optind;
+    if (bench.loader != NULL) {
+      run("loader", "thumbnails", bench_loader, &bench);
+      loader_free(bench.loader);
+    }
+  }
+
+  fontmap_free(fontmap);
+  return status;
+}
@@ -0,0 +1,171 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// One scaled copy. The source is remembered as it was when scaled, a change
+// to any of it means the copy is stale.
+typedef struct cache_entry {
+  const image_t *source;
+  int *data;
+  int width;
+  int height;
+  int stride;
+  unsigned int generation;
+
+  int filter;
+  image_t *copy;
+  struct cache_entry *prev;
+  struct cache_entry *next;
+} cache_entry_t;
+
+struct image_cache {
+  allocator_t *allocator;
+  size_t budget;
+  size_t bytes;
+
+  // Most recently used first.
+  cache_entry_t *lru_head;
+  cache_entry_t *lru_tail;
+};
+
+static size_t image_bytes(const image_t *image) {
+  return sizeof(int) * image->stride * image->height;
+}
+
+image_cache_t *image_cache_create(size_t budget, allocator_t *allocator) {
+  image_cache_t *cache = calloc(1, sizeof(image_cache_t));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->allocator = allocator;
+  cache->budget = budget > 0 ? budget : IMAGE_CACHE_DEFAULT_BUDGET;
+  return cache;
+}
+
+static void lru_unlink(image_cache_t *cache, cache_entry_t *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    cache->lru_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    cache->lru_tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+static void lru_push(image_cache_t *cache, cache_entry_t *entry) {
+  entry->next = cache->lru_head;
+  if (cache->lru_head) {
+    cache->lru_head->prev = entry;
+  } else {
+    cache->lru_tail = entry;
+  }
+  cache->lru_head = entry;
+}
+
+static void entry_free(image_cache_t *cache, cache_entry_t *entry) {
+  lru_unlink(cache, entry);
+  cache->bytes -= image_bytes(entry->copy);
+  image_free(entry->copy);
+  free(entry);
+}
+
+void image_cache_free(image_cache_t *cache) {
+  if (cache == NULL) {
+    return;
+  }
+
+  while (cache->lru_head) {
+    entry_free(cache, cache->lru_head);
+  }
+  free(cache);
+}
+
+// Free from the least recently used end while over budget. The head is what
+// the caller is about to get and always stays.
+static void cache_evict(image_cache_t *cache) {
+  while (cache->bytes > cache->budget && cache->lru_tail != cache->lru_head) {
+    entry_free(cache, cache->lru_tail);
+  }
+}
+
+static cache_entry_t *cache_find(image_cache_t *cache, const image_t *image,
+                                 int w, int h, int filter) {
+  for (cache_entry_t *entry = cache->lru_head; entry; entry = entry->next) {
+    if (entry->source == image && entry->copy->width == w &&
+        entry->copy->height == h && entry->filter == filter) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static int entry_stale(const cache_entry_t *entry, const image_t *image) {
+  return entry->data != image->data || entry->width != image->width ||
+         entry->height != image->height || entry->stride != image->stride ||
+         entry->generation != image->generation;
+}
+
+image_t *image_cache_get(image_cache_t *cache, image_t *image, int w, int h,
+                         int filter) {
+  if (image->width == w && image->height == h) {
+    return image;
+  }
+
+  cache_entry_t *entry = cache_find(cache, image, w, h, filter);
+  if (entry != NULL) {
+    lru_unlink(cache, entry);
+  } else {
+    entry = malloc(sizeof(cache_entry_t));
+    image_t *copy = image_create(w, h, cache->allocator);
+    if (entry == NULL || copy == NULL) {
+      free(entry);
+      if (copy != NULL) {
+        image_free(copy);
+      }
+      return NULL;
+    }
+
+    // data is NULL, so the new entry is stale and gets scaled below.
+    memset(entry, 0, sizeof(*entry));
+    entry->source = image;
+    entry->filter = filter;
+    entry->copy = copy;
+    cache->bytes += image_bytes(copy);
+  }
+  lru_push(cache, entry);
+
+  // Scaled again in place, the copy keeps its memory.
+  if (entry_stale(entry, image)) {
+    scale_into(image, entry->copy, filter);
+    entry->data = image->data;
+    entry->width = image->width;
+    entry->height = image->height;
+    entry->stride = image->stride;
+    entry->generation = image->generation;
+  }
+
+  cache_evict(cache);
+  return entry->copy;
+}
+
+void image_cache_invalidate(image_cache_t *cache, const image_t *image) {
+  cache_entry_t *entry = cache->lru_head;
+
+  while (entry) {
+    cache_entry_t *next = entry->next;
+    if (entry->source == image) {
+      entry_free(cache, entry);
+    }
+    entry = next;
+  }
+}
+
+size_t image_cache_bytes(image_cache_t *cache) {
+  return cache->bytes;
+}
@@ -0,0 +1,46 @@
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include <stddef.h>
+
+#include "draw.h"
+
+// Scaled copies of images drawn at the same size every frame, icons and
+// thumbnails, so they are scaled once and then blitted a row at a time:
+//
+//   image_t *scaled = image_cache_get(cache, icon, 48, 48, SCALE_BILINEAR);
+//   if (scaled != NULL)
+//     draw_image_blend(x, y, scaled, context);
+//
+// Copies are keyed by the source image, the target size and the filter. When
+// the source changed since (its pixels, size or generation, see image_touch())
+// it is scaled again into the same copy. Least recently used copies are freed
+// while the cache holds more than its budget. One thread per cache.
+//
+// The scanout format doesn't matter here: contexts always draw XRGB8888 and
+// convert on present.
+typedef struct image_cache image_cache_t;
+
+// Default budget for scaled pixels.
+#define IMAGE_CACHE_DEFAULT_BUDGET (16 << 20)
+
+// budget is how many bytes of scaled images the cache may hold, 0 picks
+// IMAGE_CACHE_DEFAULT_BUDGET. Copies come from allocator, e.g.
+// context->allocator, NULL for malloc. Returns NULL without memory.
+image_cache_t* image_cache_create(size_t budget, allocator_t* allocator);
+// Also frees every cached copy.
+void image_cache_free(image_cache_t* cache);
+
+// image scaled to w x h with filter (SCALE_*), like scale_filtered. Returns
+// image itself when it already has that size. The result belongs to the cache
+// and stays valid until the next call on it; NULL without memory.
+image_t* image_cache_get(image_cache_t* cache, image_t* image, int w, int h, int filter);
+
+// Drop the copies of image, e.g. before freeing it: a new image allocated at
+// the same address could otherwise hit them.
+void image_cache_invalidate(image_cache_t* cache, const image_t* image);
+
+// Bytes of scaled pixels held.
+size_t image_cache_bytes(image_cache_t* cache);
+
+#endif
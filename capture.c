@@ -0,0 +1,394 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "img-jpeg.h"
+#include "img-png.h"
+
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_ENCODING };
+
+// One copied frame. The image is kept for the next frame of the same size.
+typedef struct capture_slot {
+  image_t *image;
+  char *path;
+  int format;
+  rect_t area;
+  capture_fn fn;
+  void *user;
+
+  // Under the lock.
+  int state;
+  struct capture_slot *queue_next;
+} capture_slot_t;
+
+// What capture_dispatch() reports, the slot itself is free again already.
+typedef struct capture_done {
+  char *path;
+  rect_t area;
+  int result;
+  capture_fn fn;
+  void *user;
+  struct capture_done *next;
+} capture_done_t;
+
+struct capture {
+  pthread_t thread;
+  int started;
+  int quality;
+
+  capture_slot_t *slots;
+  int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  capture_slot_t *queue_head;
+  capture_slot_t *queue_tail;
+  capture_done_t *done_head;
+  capture_done_t *done_tail;
+  int busy;
+  int quit;
+
+  // The worker writes a byte for every finished capture.
+  int pipe[2];
+};
+
+// Write to a temporary file next to path and rename it over path, so readers
+// never see half a frame.
+static int capture_encode(capture_t *capture, capture_slot_t *slot) {
+  size_t len = strlen(slot->path);
+  char *tmp = malloc(len + 5);
+  int result;
+
+  if (tmp == NULL) {
+    return -ENOMEM;
+  }
+  memcpy(tmp, slot->path, len);
+  memcpy(tmp + len, ".tmp", 5);
+
+  result = slot->format == CAPTURE_PNG
+               ? write_png_file(tmp, slot->image)
+               : write_jpeg_file(tmp, slot->image, capture->quality);
+  if (result == 0 && rename(tmp, slot->path) < 0) {
+    result = -errno;
+    fprintf(stderr, "capture: cannot rename %s (%d): %m\n", tmp, errno);
+  }
+  if (result != 0) {
+    unlink(tmp);
+  }
+  free(tmp);
+  return result;
+}
+
+static void *capture_worker(void *data) {
+  capture_t *capture = data;
+
+  pthread_mutex_lock(&capture->lock);
+  for (;;) {
+    while (!capture->quit && capture->queue_head == NULL) {
+      pthread_cond_wait(&capture->work, &capture->lock);
+    }
+    // Queued frames are still written on the way out.
+    if (capture->queue_head == NULL) {
+      break;
+    }
+
+    capture_slot_t *slot = capture->queue_head;
+    capture->queue_head = slot->queue_next;
+    if (capture->queue_head == NULL) {
+      capture->queue_tail = NULL;
+    }
+    slot->state = SLOT_ENCODING;
+    pthread_mutex_unlock(&capture->lock);
+
+    int result = capture_encode(capture, slot);
+
+    // Without memory for the report the callback is lost, the frame isn't.
+    capture_done_t *done = NULL;
+    if (slot->fn != NULL && (done = malloc(sizeof(capture_done_t))) != NULL) {
+      done->path = slot->path;
+      done->area = slot->area;
+      done->result = result;
+      done->fn = slot->fn;
+      done->user = slot->user;
+      done->next = NULL;
+    } else {
+      free(slot->path);
+    }
+    slot->path = NULL;
+
+    pthread_mutex_lock(&capture->lock);
+    slot->state = SLOT_FREE;
+    capture->busy--;
+    if (done != NULL) {
+      if (capture->done_tail) {
+        capture->done_tail->next = done;
+      } else {
+        capture->done_head = done;
+      }
+      capture->done_tail = done;
+    }
+    pthread_cond_broadcast(&capture->finished);
+
+    // A full pipe already wakes the loop up.
+    char byte = 0;
+    if (write(capture->pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+      fprintf(stderr, "capture: cannot signal completion (%d): %m\n", errno);
+    }
+  }
+  pthread_mutex_unlock(&capture->lock);
+
+  return NULL;
+}
+
+capture_t *capture_create(int slots, int quality) {
+  capture_t *capture = malloc(sizeof(capture_t));
+  if (capture == NULL) {
+    return NULL;
+  }
+
+  memset(capture, 0, sizeof(*capture));
+  capture->count = slots < 1 ? 2 : slots;
+  if (quality <= 0) {
+    quality = CAPTURE_DEFAULT_QUALITY;
+  }
+  capture->quality = quality > 100 ? 100 : quality;
+
+  if (pipe(capture->pipe) < 0) {
+    fprintf(stderr, "capture: cannot create pipe (%d): %m\n", errno);
+    free(capture);
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(capture->pipe[i], F_SETFL,
+          fcntl(capture->pipe[i], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(capture->pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  pthread_mutex_init(&capture->lock, NULL);
+  pthread_cond_init(&capture->work, NULL);
+  pthread_cond_init(&capture->finished, NULL);
+
+  capture->slots = calloc(capture->count, sizeof(capture_slot_t));
+  if (capture->slots == NULL) {
+    capture_free(capture);
+    return NULL;
+  }
+
+  if (pthread_create(&capture->thread, NULL, capture_worker, capture) != 0) {
+    fprintf(stderr, "capture: cannot start thread\n");
+    capture_free(capture);
+    return NULL;
+  }
+  capture->started = 1;
+
+  return capture;
+}
+
+void capture_free(capture_t *capture) {
+  if (capture == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&capture->lock);
+  capture->quit = 1;
+  pthread_cond_broadcast(&capture->work);
+  pthread_mutex_unlock(&capture->lock);
+
+  if (capture->started) {
+    pthread_join(capture->thread, NULL);
+  }
+
+  while (capture->done_head) {
+    capture_done_t *next = capture->done_head->next;
+    free(capture->done_head->path);
+    free(capture->done_head);
+    capture->done_head = next;
+  }
+  for (int i = 0; capture->slots && i < capture->count; i++) {
+    if (capture->slots[i].image) {
+      image_free(capture->slots[i].image);
+    }
+  }
+
+  pthread_cond_destroy(&capture->finished);
+  pthread_cond_destroy(&capture->work);
+  pthread_mutex_destroy(&capture->lock);
+  close(capture->pipe[0]);
+  close(capture->pipe[1]);
+  free(capture->slots);
+  free(capture);
+}
+
+// Bounding box of what changed since the last capture, the frame being drawn
+// included, trimmed to the screen. Empty when nothing did.
+static rect_t capture_damage_box(context_t *context) {
+  const damage_t *lists[2] = {&context->capture_damage, &context->damage};
+  int x0 = context->width, y0 = context->height, x1 = 0, y1 = 0;
+
+  for (int l = 0; l < 2; l++) {
+    for (int i = 0; i < lists[l]->count; i++) {
+      rect_t rect = lists[l]->rects[i];
+
+      if (rect.w <= 0 || rect.h <= 0) {
+        continue;
+      }
+      x0 = rect.x < x0 ? rect.x : x0;
+      y0 = rect.y < y0 ? rect.y : y0;
+      x1 = rect.x + rect.w > x1 ? rect.x + rect.w : x1;
+      y1 = rect.y + rect.h > y1 ? rect.y + rect.h : y1;
+    }
+  }
+
+  x0 = x0 < 0 ? 0 : x0;
+  y0 = y0 < 0 ? 0 : y0;
+  x1 = x1 > context->width ? context->width : x1;
+  y1 = y1 > context->height ? context->height : y1;
+  if (x1 <= x0 || y1 <= y0) {
+    return (rect_t){0, 0, 0, 0};
+  }
+  return (rect_t){x0, y0, x1 - x0, y1 - y0};
+}
+
+typedef struct {
+  int *dst;
+  const int *src;
+  int dst_stride;
+  int src_stride;
+  int width;
+} capture_copy_t;
+
+static void capture_band(void *arg, int y0, int y1) {
+  capture_copy_t *job = arg;
+
+  for (int row = y0; row < y1; row++) {
+    memcpy(&job->dst[job->dst_stride * row], &job->src[job->src_stride * row],
+           sizeof(int) * job->width);
+  }
+}
+
+int capture_frame(capture_t *capture, context_t *context, const char *path,
+                  int format, int flags, capture_fn fn, void *user) {
+  capture_slot_t *slot = NULL;
+  rect_t area = {0, 0, context->width, context->height};
+  int damage = (flags & CAPTURE_DAMAGE) && context->shadow != NULL;
+
+  if (path == NULL || (format != CAPTURE_PNG && format != CAPTURE_JPEG) ||
+      context->width <= 0 || context->height <= 0) {
+    return -EINVAL;
+  }
+
+  // Skip the frame rather than wait for the encoder.
+  pthread_mutex_lock(&capture->lock);
+  for (int i = 0; i < capture->count; i++) {
+    if (capture->slots[i].state == SLOT_FREE) {
+      slot = &capture->slots[i];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&capture->lock);
+  if (slot == NULL) {
+    return -EBUSY;
+  }
+
+  if (damage) {
+    area = capture_damage_box(context);
+    if (area.w == 0) {
+      return -ENODATA;
+    }
+  }
+
+  // Free slots are ours alone, the worker never looks at them.
+  if (slot->image != NULL &&
+      (slot->image->width != area.w || slot->image->height != area.h)) {
+    image_free(slot->image);
+    slot->image = NULL;
+  }
+  if (slot->image == NULL) {
+    slot->image = image_create(area.w, area.h, NULL);
+  }
+  slot->path = malloc(strlen(path) + 1);
+  if (slot->image == NULL || slot->path == NULL) {
+    free(slot->path);
+    slot->path = NULL;
+    return -ENOMEM;
+  }
+  strcpy(slot->path, path);
+
+  capture_copy_t job = {
+      slot->image->data,
+      context->data + (ptrdiff_t)area.y * context->stride + area.x,
+      slot->image->stride,
+      context->stride,
+      area.w,
+  };
+  pool_run(context->pool, capture_band, &job, area.h, area.w * area.h);
+
+  // The next capture starts from here. The frame being drawn still reaches
+  // capture_damage when it is presented: copying it twice costs a little,
+  // missing what is drawn after this call would leave recordings stale.
+  if (damage) {
+    damage_clear(&context->capture_damage);
+  }
+
+  slot->format = format;
+  slot->area = area;
+  slot->fn = fn;
+  slot->user = user;
+
+  pthread_mutex_lock(&capture->lock);
+  slot->state = SLOT_QUEUED;
+  slot->queue_next = NULL;
+  if (capture->queue_tail) {
+    capture->queue_tail->queue_next = slot;
+  } else {
+    capture->queue_head = slot;
+  }
+  capture->queue_tail = slot;
+  capture->busy++;
+  pthread_cond_signal(&capture->work);
+  pthread_mutex_unlock(&capture->lock);
+
+  return 0;
+}
+
+void capture_flush(capture_t *capture) {
+  pthread_mutex_lock(&capture->lock);
+  while (capture->busy > 0) {
+    pthread_cond_wait(&capture->finished, &capture->lock);
+  }
+  pthread_mutex_unlock(&capture->lock);
+}
+
+int capture_event_fd(capture_t *capture) { return capture->pipe[0]; }
+
+int capture_dispatch(capture_t *capture) {
+  char bytes[64];
+  int ran = 0;
+
+  while (read(capture->pipe[0], bytes, sizeof(bytes)) > 0) {
+  }
+
+  // Callbacks may capture again, what they queue is reported next time.
+  pthread_mutex_lock(&capture->lock);
+  capture_done_t *done = capture->done_head;
+  capture->done_head = capture->done_tail = NULL;
+  pthread_mutex_unlock(&capture->lock);
+
+  while (done) {
+    capture_done_t *next = done->next;
+    done->fn(capture, done->path, done->area, done->result, done->user);
+    free(done->path);
+    free(done);
+    done = next;
+    ran++;
+  }
+  return ran;
+}
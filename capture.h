@@ -0,0 +1,68 @@
+#ifndef __CAPTURE_H_
+#define __CAPTURE_H_
+
+#include "draw.h"
+
+// Snapshots of what a context shows, written as PNG or JPEG files on a
+// background thread for remote monitoring and recordings. capture_frame()
+// only copies the pixels, on the calling thread, and never waits: when every
+// slot is still being encoded the frame is skipped. Call it after drawing a
+// frame and before presenting it:
+//
+//   draw_scene(scene, context);
+//   capture_frame(capture, context, "/run/ui/screen.jpg", CAPTURE_JPEG,
+//                 CAPTURE_DAMAGE, NULL, NULL);
+//   context_present(context);
+//
+// The pixels come from context->data: the shadow in shadow mode, the back
+// buffer otherwise. Back buffers are uncached memory and slow to read, so
+// capture from shadowed contexts (context_enable_shadow) where it matters.
+// Only shadowed contexts track what changed for CAPTURE_DAMAGE, others are
+// always captured whole.
+//
+// Completion is signalled on capture_event_fd(). Hand it to loop_add_fd() and
+// call capture_dispatch() from the callback to run the capture callbacks on
+// the loop thread. Everything except the encoding happens on the thread
+// calling the capture functions, one thread per capture.
+
+enum { CAPTURE_PNG, CAPTURE_JPEG };
+
+// Only the bounding box of what changed since the previous capture of the
+// context. Nothing changed: capture_frame() returns -ENODATA.
+#define CAPTURE_DAMAGE 1
+
+// JPEG quality when capture_create() is given 0.
+#define CAPTURE_DEFAULT_QUALITY 85
+
+typedef struct capture capture_t;
+
+// area is the part of the screen in the file, result 0 or the negative errno
+// of the encoder.
+typedef void (*capture_fn)(capture_t* capture, const char* path, rect_t area, int result,
+                           void* user);
+
+// slots is how many frames may wait for or be in encoding at once, each
+// holding a copy of its pixels; < 1 picks 2. quality (1 to 100) is for JPEG,
+// 0 picks CAPTURE_DEFAULT_QUALITY. Returns NULL on failure.
+capture_t* capture_create(int slots, int quality);
+// Finishes the queued encodes first, their callbacks don't run.
+void capture_free(capture_t* capture);
+
+// Copy context's pixels and queue them for writing to path as format
+// (CAPTURE_PNG or CAPTURE_JPEG), files are replaced once complete. flags is 0
+// or CAPTURE_DAMAGE. fn, if any, is called from capture_dispatch() when the
+// file is written or failed. Returns 0, -EBUSY when all slots are busy (the
+// frame is skipped), -ENODATA, -EINVAL or -ENOMEM.
+int capture_frame(capture_t* capture, context_t* context, const char* path, int format,
+                  int flags, capture_fn fn, void* user);
+
+// Block until everything queued is written.
+void capture_flush(capture_t* capture);
+
+// Readable when captures finished.
+int capture_event_fd(capture_t* capture);
+
+// Run the callbacks of finished captures. Returns how many ran.
+int capture_dispatch(capture_t* capture);
+
+#endif
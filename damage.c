@@ -0,0 +1,63 @@
+#include "damage.h"
+
+static int rect_area(const rect_t *rect) { return rect->w * rect->h; }
+
+static rect_t rect_union(const rect_t *a, const rect_t *b) {
+  rect_t result;
+  int right = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+  int bottom = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+  result.x = a->x < b->x ? a->x : b->x;
+  result.y = a->y < b->y ? a->y : b->y;
+  result.w = right - result.x;
+  result.h = bottom - result.y;
+  return result;
+}
+
+void damage_clear(damage_t *damage) { damage->count = 0; }
+
+void damage_add(damage_t *damage, int x, int y, int w, int h) {
+  rect_t rect = {x, y, w, h};
+
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+
+  // Fold the rect into an existing one when the union doesn't cover more
+  // than the two rects would on their own. That catches containment, adjacent
+  // spans and runs of set_pixel() without growing into unrelated space.
+  for (int i = 0; i < damage->count; i++) {
+    rect_t merged = rect_union(&damage->rects[i], &rect);
+    if (rect_area(&merged) <= rect_area(&damage->rects[i]) + rect_area(&rect)) {
+      damage->rects[i] = merged;
+      return;
+    }
+  }
+
+  if (damage->count < DAMAGE_MAX_RECTS) {
+    damage->rects[damage->count++] = rect;
+    return;
+  }
+
+  // Out of slots, collapse everything into one bounding box.
+  for (int i = 1; i < damage->count; i++) {
+    damage->rects[0] = rect_union(&damage->rects[0], &damage->rects[i]);
+  }
+  damage->rects[0] = rect_union(&damage->rects[0], &rect);
+  damage->count = 1;
+}
+
+void damage_merge(damage_t *damage, const damage_t *other) {
+  for (int i = 0; i < other->count; i++) {
+    const rect_t *rect = &other->rects[i];
+    damage_add(damage, rect->x, rect->y, rect->w, rect->h);
+  }
+}
+
+int damage_area(const damage_t *damage) {
+  int area = 0;
+  for (int i = 0; i < damage->count; i++) {
+    area += rect_area(&damage->rects[i]);
+  }
+  return area;
+}
@@ -0,0 +1,24 @@
+#ifndef __DAMAGE_H_
+#define __DAMAGE_H_
+
+// Past this many rectangles a damage list collapses into its bounding box.
+#define DAMAGE_MAX_RECTS 16
+
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} rect_t;
+
+typedef struct {
+  rect_t rects[DAMAGE_MAX_RECTS];
+  int count;
+} damage_t;
+
+void damage_clear(damage_t* damage);
+void damage_add(damage_t* damage, int x, int y, int w, int h);
+void damage_merge(damage_t* damage, const damage_t* other);
+int damage_area(const damage_t* damage);
+
+#endif
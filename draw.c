@@ -52,8 +52,10 @@
  */
 
 #define _GNU_SOURCE
+#include <drm_fourcc.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -65,6 +67,9 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "format.h"
+#include "stats.h"
+
 struct drmmodeset_dev;
 static int drmmodeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
                                 struct drmmodeset_dev *dev);
@@ -72,9 +77,15 @@ static int drmmodeset_create_fb(int fd, struct drmmodeset_dev *dev);
 static int drmmodeset_setup_dev(int fd, drmModeRes *res, drmModeConnector *conn,
                                 struct drmmodeset_dev *dev);
 static int drmmodeset_open(int *out, const char *node);
-static int drmmodeset_prepare(int fd);
+static int drmmodeset_prepare(int fd, unsigned int buf_count, int format,
+                              bool clear, struct drmmodeset_dev **devs,
+                              int max_devs);
 static void drmmodeset_draw(void);
-static void drmmodeset_cleanup(int fd);
+static int drmmodeset_wait_flip(struct drmmodeset_dev *dev);
+static int drmmodeset_atomic_set_crtc(struct drmmodeset_dev *dev);
+static int drmmodeset_atomic_flip(struct drmmodeset_dev **devs, int count,
+                                  bool block);
+static void drmmodeset_cleanup(struct drmmodeset_dev *dev);
 
 /*
  * When the linux kernel detects a graphics-card on your machine, it loads the
@@ -152,50 +163,114 @@ static int drmmodeset_open(int *out, const char *node) {
  * "struct drmmodeset_dev" contains: {
  *  - @next: points to the next device in the single-linked list
  *
- *  - @width: width of our buffer object
- *  - @height: height of our buffer object
- *  - @stride: stride value of our buffer object
- *  - @size: size of the memory mapped buffer
- *  - @handle: a DRM handle to the buffer object that we can draw into
- *  - @map: pointer to the memory mapped buffer
+ *  - @width: width of our buffer objects
+ *  - @height: height of our buffer objects
+ *  - @bufs: up to DRMMODESET_MAX_BUFS buffer objects that we flip between
+ *  - @buf_count: how many entries of @bufs are in use
+ *  - @front_buf: index of the buffer that is scanned out, or that is going to
+ *                be scanned out once the pending page-flip completes
+ *  - @back_buf: index of the buffer that we draw the next frame into
+ *  - @pflip_pending: true while a page-flip is queued but not yet completed
+ *  - @clear: whether new buffers are zeroed by us, see drmmodeset_create_fb()
+ *  - @buffers_ns: how long creating the buffers took
  *
  *  - @mode: the display mode that we want to use
- *  - @fb: a framebuffer handle with our buffer object as scanout buffer
  *  - @conn: the connector ID that we want to use with this buffer
  *  - @crtc: the crtc ID that we want to use with this connector
  *  - @saved_crtc: the configuration of the crtc before we changed it. We use it
  *                 so we can restore the same mode when we exit.
+ *  - @crtc_bound: true when @crtc already drove @conn before we came
+ *  - @kept_crtc: true while @crtc still scans out what it showed before we
+ *                came, see drmmodeset_keep_crtc()
+ *  - @planes: overlay and cursor planes the application acquired on this crtc
+ *
+ *  - @atomic: true when this device is driven by atomic commits
+ *  - @mode_blob: property blob holding @mode for the crtc's MODE_ID
+ *  - @primary: id of the primary plane of @crtc, with the ids of its
+ *              properties in @primary_props
+ *  - @conn_crtc_id, @crtc_mode_id, @crtc_active: property ids of the
+ *              connector's CRTC_ID and the crtc's MODE_ID and ACTIVE
+ * }
+ *
+ * Each "struct drmmodeset_buf" describes one buffer object: {
+ *  - @stride: stride value of the buffer object
+ *  - @size: size of the memory mapped buffer
+ *  - @handle: a DRM handle to the buffer object that we can draw into
+ *  - @map: pointer to the memory mapped buffer
+ *  - @fb: a framebuffer handle with the buffer object as scanout buffer
  * }
  */
 
-struct drmmodeset_dev {
-  uint32_t width;
-  uint32_t height;
+#define DRMMODESET_MAX_BUFS 3
+
+struct drmmodeset_plane_props {
+  uint32_t fb_id;
+  uint32_t crtc_id;
+  uint32_t src_x, src_y, src_w, src_h;
+  uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+};
+
+struct drmmodeset_buf {
   uint32_t stride;
   uint32_t size;
   uint32_t handle;
   uint8_t *map;
+  uint32_t fb;
+};
+
+struct drmmodeset_dev {
+  struct drmmodeset_dev *next;
+
+  uint32_t width;
+  uint32_t height;
+  struct drmmodeset_buf bufs[DRMMODESET_MAX_BUFS];
+  unsigned int buf_count;
+  int format;
+  unsigned int front_buf;
+  unsigned int back_buf;
+  bool pflip_pending;
+  bool clear;
+  uint64_t buffers_ns;
+  unsigned int flip_sequence;
+  unsigned int vblank_misses;
 
   drmModeModeInfo mode;
-  uint32_t fb;
   uint32_t dri;
   uint32_t conn;
   uint32_t crtc;
   drmModeCrtc *saved_crtc;
+  bool crtc_bound;
+  bool kept_crtc;
+  struct context_plane *planes;
+
+  bool atomic;
+  uint32_t mode_blob;
+  uint32_t primary;
+  struct drmmodeset_plane_props primary_props;
+  uint32_t conn_crtc_id;
+  uint32_t crtc_mode_id;
+  uint32_t crtc_active;
+  uint32_t primary_rotation;
+  uint64_t rotation;
 };
 
-static struct drmmodeset_dev *drmmodeset_con = NULL;
+static struct drmmodeset_dev *drmmodeset_list = NULL;
 
 /*
  * So as next step we need to actually prepare all connectors that we find. We
  * do this in this little helper function:
  *
- * drmmodeset_prepare(fd): This helper function takes the DRM fd as argument and
- * then simply retrieves the resource-info from the device. It then iterates
+ * drmmodeset_prepare(fd, buf_count, format, clear, devs, max_devs): This
+ * helper function takes the DRM fd as argument and then simply retrieves the
+ * resource-info from the device. It then iterates
  * through all connectors and calls other helper functions to initialize this
- * connector (described later on).
+ * connector (described later on). Every connector gets @buf_count buffer
+ * objects in the PIXEL_* @format so we can draw into one while another one is
+ * scanned out, zeroed by us when @clear is set.
  * If the initialization was successful, we simply add this object as new device
- * into the global drmmodeset device list.
+ * into the global drmmodeset device list. The new devices are also stored in
+ * @devs so the caller can tell them apart from devices of other DRM fds; we stop
+ * after @max_devs of them. The return value is the number of new devices.
  *
  * The resource-structure contains a list of all connector-IDs. We use the
  * helper function drmModeGetConnector() to retrieve more information on each
@@ -206,12 +281,14 @@ static struct drmmodeset_dev *drmmodeset_con = NULL;
  * connector.
  */
 
-static int drmmodeset_prepare(int fd) {
+static int drmmodeset_prepare(int fd, unsigned int buf_count, int format,
+                              bool clear, struct drmmodeset_dev **devs,
+                              int max_devs) {
   drmModeRes *res;
   drmModeConnector *conn;
   unsigned int i;
   struct drmmodeset_dev *dev;
-  int ret;
+  int ret, count = 0;
 
   /* retrieve resources */
   res = drmModeGetResources(fd);
@@ -221,7 +298,7 @@ static int drmmodeset_prepare(int fd) {
   }
 
   /* iterate all connectors */
-  for (i = 0; i < res->count_connectors; ++i) {
+  for (i = 0; i < res->count_connectors && count < max_devs; ++i) {
     printf("conn %d\n", i);
     /* get information for each connector */
     conn = drmModeGetConnector(fd, res->connectors[i]);
@@ -236,6 +313,9 @@ static int drmmodeset_prepare(int fd) {
     memset(dev, 0, sizeof(*dev));
     dev->conn = conn->connector_id;
     dev->dri = fd;
+    dev->buf_count = buf_count;
+    dev->format = format;
+    dev->clear = clear;
 
     /* call helper function to prepare this connector */
     ret = drmmodeset_setup_dev(fd, res, conn, dev);
@@ -252,12 +332,14 @@ static int drmmodeset_prepare(int fd) {
 
     /* free connector data and link device into global list */
     drmModeFreeConnector(conn);
-    drmmodeset_con = dev;
+    dev->next = drmmodeset_list;
+    drmmodeset_list = dev;
+    devs[count++] = dev;
   }
 
   /* free resources again */
   drmModeFreeResources(res);
-  return 0;
+  return count;
 }
 
 /*
@@ -368,14 +450,17 @@ static int drmmodeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
   if (enc) {
     if (enc->crtc_id) {
       crtc = enc->crtc_id;
-      //			for (iter = drmmodeset_list; iter; iter =
-      //iter->next) { 				if (iter->crtc == crtc) { 					crtc = -1; 					break;
-      //				}
-      //			}
+      for (iter = drmmodeset_list; iter; iter = iter->next) {
+        if (iter->crtc == crtc) {
+          crtc = -1;
+          break;
+        }
+      }
 
       if (crtc >= 0) {
         drmModeFreeEncoder(enc);
         dev->crtc = crtc;
+        dev->crtc_bound = true;
         return 0;
       }
     }
@@ -403,10 +488,12 @@ static int drmmodeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
 
       /* check that no other device already uses this CRTC */
       crtc = res->crtcs[j];
-      //			for (iter = drmmodeset_list; iter; iter =
-      //iter->next) { 				if (iter->crtc == crtc) { 					crtc = -1; 					break;
-      //				}
-      //			}
+      for (iter = drmmodeset_list; iter; iter = iter->next) {
+        if (iter->crtc == crtc) {
+          crtc = -1;
+          break;
+        }
+      }
 
       /* we have found a CRTC, so save it and return */
       if (crtc >= 0) {
@@ -443,35 +530,52 @@ static int drmmodeset_find_crtc(int fd, drmModeRes *res, drmModeConnector *conn,
  * libEGL. But this is beyond the scope of this document.
  *
  * So what we do is requesting a new dumb-buffer from the driver. We specify the
- * same size as the current mode that we selected for the connector.
+ * same size as the current mode that we selected for the connector, with @bpp
+ * bits per pixel. drmModeAddFB2() then tells the driver how to read these bits
+ * through the DRM_FORMAT_* @fourcc: the primary buffers use the device's pixel
+ * format, plane buffers are ARGB8888 so the hardware can blend them over the
+ * primary plane.
  * Then we request the driver to prepare this buffer for memory mapping. After
  * that we perform the actual mmap() call. So we can now access the framebuffer
- * memory directly via the dev->map memory map.
+ * memory directly via the buf->map memory map.
+ *
+ * drmmodeset_create_fb() does this once for every buffer the device asked for
+ * in @buf_count. If any of them fails, the ones created so far are destroyed
+ * again so the device is left without buffers.
+ * The kernel hands out dumb buffers zeroed already, but our memset() is what
+ * actually faults their pages in, which takes a while for big screens. Devices
+ * without @clear skip it and rely on the application drawing every pixel of
+ * its first frame, so that frame's clear initializes the buffer instead.
  */
 
-static int drmmodeset_create_fb(int fd, struct drmmodeset_dev *dev) {
+static int drmmodeset_create_buf(int fd, uint32_t width, uint32_t height,
+                                 uint32_t fourcc, uint32_t bpp, bool clear,
+                                 struct drmmodeset_buf *buf) {
   struct drm_mode_create_dumb creq;
   struct drm_mode_destroy_dumb dreq;
   struct drm_mode_map_dumb mreq;
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
   int ret;
 
   /* create dumb buffer */
   memset(&creq, 0, sizeof(creq));
-  creq.width = dev->width;
-  creq.height = dev->height;
-  creq.bpp = 32;
+  creq.width = width;
+  creq.height = height;
+  creq.bpp = bpp;
   ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
   if (ret < 0) {
     fprintf(stderr, "cannot create dumb buffer (%d): %m\n", errno);
     return -errno;
   }
-  dev->stride = creq.pitch;
-  dev->size = creq.size;
-  dev->handle = creq.handle;
+  buf->stride = creq.pitch;
+  buf->size = creq.size;
+  buf->handle = creq.handle;
 
   /* create framebuffer object for the dumb-buffer */
-  ret = drmModeAddFB(fd, dev->width, dev->height, 24, 32, dev->stride,
-                     dev->handle, &dev->fb);
+  handles[0] = buf->handle;
+  pitches[0] = buf->stride;
+  ret = drmModeAddFB2(fd, width, height, fourcc, handles, pitches, offsets,
+                      &buf->fb, 0);
   if (ret) {
     fprintf(stderr, "cannot create framebuffer (%d): %m\n", errno);
     ret = -errno;
@@ -480,7 +584,7 @@ static int drmmodeset_create_fb(int fd, struct drmmodeset_dev *dev) {
 
   /* prepare buffer for memory mapping */
   memset(&mreq, 0, sizeof(mreq));
-  mreq.handle = dev->handle;
+  mreq.handle = buf->handle;
   ret = drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
   if (ret) {
     fprintf(stderr, "cannot map dumb buffer (%d): %m\n", errno);
@@ -489,28 +593,260 @@ static int drmmodeset_create_fb(int fd, struct drmmodeset_dev *dev) {
   }
 
   /* perform actual memory mapping */
-  dev->map =
-      mmap(0, dev->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mreq.offset);
-  if (dev->map == MAP_FAILED) {
+  buf->map =
+      mmap(0, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, mreq.offset);
+  if (buf->map == MAP_FAILED) {
     fprintf(stderr, "cannot mmap dumb buffer (%d): %m\n", errno);
     ret = -errno;
     goto err_fb;
   }
 
-  /* clear the framebuffer to 0 */
-  memset(dev->map, 0, dev->size);
+  /* clear the framebuffer to 0, this touches every page of it */
+  if (clear)
+    memset(buf->map, 0, buf->size);
 
   return 0;
 
 err_fb:
-  drmModeRmFB(fd, dev->fb);
+  drmModeRmFB(fd, buf->fb);
 err_destroy:
   memset(&dreq, 0, sizeof(dreq));
-  dreq.handle = dev->handle;
+  dreq.handle = buf->handle;
   drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
   return ret;
 }
 
+static void drmmodeset_destroy_buf(int fd, struct drmmodeset_buf *buf) {
+  struct drm_mode_destroy_dumb dreq;
+
+  /* unmap buffer */
+  munmap(buf->map, buf->size);
+
+  /* delete framebuffer */
+  drmModeRmFB(fd, buf->fb);
+
+  /* delete dumb buffer */
+  memset(&dreq, 0, sizeof(dreq));
+  dreq.handle = buf->handle;
+  drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+}
+
+static int drmmodeset_create_fb(int fd, struct drmmodeset_dev *dev) {
+  unsigned int i;
+  uint64_t start;
+  int ret;
+
+  if (dev->buf_count < 1)
+    dev->buf_count = 1;
+  if (dev->buf_count > DRMMODESET_MAX_BUFS)
+    dev->buf_count = DRMMODESET_MAX_BUFS;
+
+  start = stats_now();
+  for (i = 0; i < dev->buf_count; ++i) {
+    const pixel_format_t *format = pixel_format(dev->format);
+
+    ret = drmmodeset_create_buf(fd, dev->width, dev->height, format->fourcc,
+                                format->bpp, dev->clear, &dev->bufs[i]);
+    if (ret) {
+      while (i--)
+        drmmodeset_destroy_buf(fd, &dev->bufs[i]);
+      return ret;
+    }
+  }
+
+  /* buffer 0 is scanned out first, we draw into the next one */
+  dev->front_buf = 0;
+  dev->back_buf = dev->buf_count > 1 ? 1 : 0;
+  dev->pflip_pending = false;
+  dev->buffers_ns = stats_now() - start;
+
+  return 0;
+}
+
+/*
+ * Probing is what makes startup slow: drmModeGetConnector() has the kernel
+ * detect the monitor and read its EDID again, on every connector, which can
+ * take tens of milliseconds each. On a device that always boots with the same
+ * display that work tells us the same thing every time.
+ *
+ * So we can remember what we found in a small file: the card, and for every
+ * output its connector, crtc and mode. drmmodeset_probe_save(path, card, devs,
+ * count) writes it, to a temporary file that is renamed over the old one so a
+ * power cut never leaves half a cache. drmmodeset_probe_load(path, card,
+ * card_size, probes, max) reads it back and returns the number of outputs, or
+ * a negative error code when there is no usable cache.
+ *
+ * drmmodeset_prepare_cached(fd, buf_count, format, clear, probes, count, devs)
+ * then does what drmmodeset_prepare() does, but asks for each connector with
+ * drmModeGetConnectorCurrent(), which only returns what the kernel knows
+ * already without probing. The cache is only trusted when every connector is
+ * still connected and still offers the cached mode; otherwise nothing is kept
+ * and the caller probes as usual.
+ */
+
+#define DRMMODESET_PROBE_MAGIC 0x31505244 /* "DRP1" */
+#define DRMMODESET_PROBE_CARD 32
+
+struct drmmodeset_probe {
+  uint32_t conn;
+  uint32_t crtc;
+  drmModeModeInfo mode;
+};
+
+struct drmmodeset_probe_header {
+  uint32_t magic;
+  uint32_t count;
+  char card[DRMMODESET_PROBE_CARD];
+};
+
+static bool drmmodeset_same_mode(const drmModeModeInfo *a,
+                                 const drmModeModeInfo *b) {
+  return a->clock == b->clock && a->hdisplay == b->hdisplay &&
+         a->hsync_start == b->hsync_start && a->hsync_end == b->hsync_end &&
+         a->htotal == b->htotal && a->hskew == b->hskew &&
+         a->vdisplay == b->vdisplay && a->vsync_start == b->vsync_start &&
+         a->vsync_end == b->vsync_end && a->vtotal == b->vtotal &&
+         a->vscan == b->vscan && a->flags == b->flags;
+}
+
+static int drmmodeset_probe_load(const char *path, char *card,
+                                 size_t card_size,
+                                 struct drmmodeset_probe *probes, int max) {
+  struct drmmodeset_probe_header header;
+  FILE *fp;
+  int count;
+
+  fp = fopen(path, "rb");
+  if (!fp)
+    return -errno;
+
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != DRMMODESET_PROBE_MAGIC || header.count == 0 ||
+      header.card[DRMMODESET_PROBE_CARD - 1] != '\0') {
+    fclose(fp);
+    return -EINVAL;
+  }
+
+  count = header.count < (uint32_t)max ? (int)header.count : max;
+  if (fread(probes, sizeof(*probes), count, fp) != (size_t)count) {
+    fclose(fp);
+    return -EINVAL;
+  }
+  fclose(fp);
+
+  snprintf(card, card_size, "%s", header.card);
+  return count;
+}
+
+static void drmmodeset_probe_save(const char *path, const char *card,
+                                  struct drmmodeset_dev **devs, int count) {
+  struct drmmodeset_probe_header header;
+  struct drmmodeset_probe probe;
+  char tmp[4096];
+  FILE *fp;
+  int i, ok;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = DRMMODESET_PROBE_MAGIC;
+  header.count = count;
+  snprintf(header.card, sizeof(header.card), "%s", card);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = fopen(tmp, "wb");
+  if (!fp) {
+    fprintf(stderr, "cannot write probe cache '%s': %m\n", tmp);
+    return;
+  }
+
+  ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (i = 0; i < count && ok; ++i) {
+    memset(&probe, 0, sizeof(probe));
+    probe.conn = devs[i]->conn;
+    probe.crtc = devs[i]->crtc;
+    probe.mode = devs[i]->mode;
+    ok = fwrite(&probe, sizeof(probe), 1, fp) == 1;
+  }
+
+  if (fclose(fp) || !ok || rename(tmp, path)) {
+    fprintf(stderr, "cannot write probe cache '%s': %m\n", path);
+    unlink(tmp);
+  }
+}
+
+static int drmmodeset_prepare_cached(int fd, unsigned int buf_count, int format,
+                                     bool clear,
+                                     const struct drmmodeset_probe *probes,
+                                     int count, struct drmmodeset_dev **devs) {
+  drmModeConnector *conn;
+  drmModeEncoder *enc;
+  struct drmmodeset_dev *dev;
+  int i, j, ret = 0, n = 0;
+
+  for (i = 0; i < count && !ret; ++i) {
+    /* what the kernel knows about the connector, without probing it */
+    conn = drmModeGetConnectorCurrent(fd, probes[i].conn);
+    if (!conn) {
+      ret = errno ? -errno : -ENOENT;
+      break;
+    }
+
+    ret = -ENOENT;
+    if (conn->connection == DRM_MODE_CONNECTED) {
+      for (j = 0; j < conn->count_modes; ++j) {
+        if (drmmodeset_same_mode(&conn->modes[j], &probes[i].mode))
+          ret = 0;
+      }
+    }
+    if (ret) {
+      drmModeFreeConnector(conn);
+      break;
+    }
+
+    dev = malloc(sizeof(*dev));
+    memset(dev, 0, sizeof(*dev));
+    dev->conn = probes[i].conn;
+    dev->crtc = probes[i].crtc;
+    dev->dri = fd;
+    dev->buf_count = buf_count;
+    dev->format = format;
+    dev->clear = clear;
+    memcpy(&dev->mode, &probes[i].mode, sizeof(dev->mode));
+    dev->width = dev->mode.hdisplay;
+    dev->height = dev->mode.vdisplay;
+
+    /* same as drmmodeset_find_crtc() would have found */
+    enc = conn->encoder_id ? drmModeGetEncoder(fd, conn->encoder_id) : NULL;
+    if (enc) {
+      dev->crtc_bound = enc->crtc_id == dev->crtc;
+      drmModeFreeEncoder(enc);
+    }
+    drmModeFreeConnector(conn);
+
+    ret = drmmodeset_create_fb(fd, dev);
+    if (ret) {
+      free(dev);
+      break;
+    }
+    devs[n++] = dev;
+  }
+
+  /* all or nothing, so a stale cache never leaves an output out */
+  if (ret) {
+    while (n--) {
+      for (i = 0; i < (int)devs[n]->buf_count; ++i)
+        drmmodeset_destroy_buf(fd, &devs[n]->bufs[i]);
+      free(devs[n]);
+    }
+    return ret;
+  }
+
+  for (i = 0; i < n; ++i) {
+    devs[i]->next = drmmodeset_list;
+    drmmodeset_list = devs[i];
+  }
+  return n;
+}
+
 /*
  * Finally! We have a connector with a suitable CRTC. We know which mode we want
  * to use and we have a framebuffer of the correct size that we can write to.
@@ -641,8 +977,6 @@ static void drmmodeset_draw(void) {
   unsigned int i, j, k, off;
   struct drmmodeset_dev *iter;
 
-  iter = drmmodeset_con;
-
   srand(time(NULL));
   r = rand() % 0xff;
   g = rand() % 0xff;
@@ -654,10 +988,13 @@ static void drmmodeset_draw(void) {
     g = next_color(&g_up, g, 10);
     b = next_color(&b_up, b, 5);
 
-    for (j = 0; j < iter->height; ++j) {
-      for (k = 0; k < iter->width; ++k) {
-        off = iter->stride * j + k * 4;
-        *(uint32_t *)&iter->map[off] = (r << 16) | (g << 8) | b;
+    for (iter = drmmodeset_list; iter; iter = iter->next) {
+      for (j = 0; j < iter->height; ++j) {
+        for (k = 0; k < iter->width; ++k) {
+          off = iter->bufs[iter->front_buf].stride * j + k * 4;
+          *(uint32_t *)&iter->bufs[iter->front_buf].map[off] =
+              (r << 16) | (g << 8) | b;
+        }
       }
     }
 
@@ -666,268 +1003,2529 @@ static void drmmodeset_draw(void) {
 }
 
 /*
- * drmmodeset_cleanup(fd): This cleans up all the devices we created during
- * drmmodeset_prepare(). It resets the CRTCs to their saved states and
- * deallocates all memory. It should be pretty obvious how all of this works.
- */
-
-static void drmmodeset_cleanup(int fd) {
-  struct drmmodeset_dev *iter;
-  struct drm_mode_destroy_dumb dreq;
-
-  /* remove from global list */
-  iter = drmmodeset_con;
-
-  printf("restore\n");
-  /* restore saved CRTC configuration */
-  drmModeSetCrtc(fd, iter->saved_crtc->crtc_id, iter->saved_crtc->buffer_id,
-                 iter->saved_crtc->x, iter->saved_crtc->y, &iter->conn, 1,
-                 &iter->saved_crtc->mode);
-  drmModeFreeCrtc(iter->saved_crtc);
-
-  /* unmap buffer */
-  munmap(iter->map, iter->size);
-
-  /* delete framebuffer */
-  drmModeRmFB(fd, iter->fb);
-
-  /* delete dumb buffer */
-  memset(&dreq, 0, sizeof(dreq));
-  dreq.handle = iter->handle;
-  drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
-
-  /* free allocated memory */
-  free(iter);
-}
-
-/*
- * I hope this was a short but easy overview of the DRM modesetting API.
+ * drmmodeset_draw() above draws directly into the buffer that is being scanned
+ * out, so the monitor may refresh in the middle of a frame and show half of the
+ * old and half of the new picture (tearing). With two or more buffers we can do
+ * better: we draw into a back buffer and then ask the kernel to switch the CRTC
+ * over to it during the next vertical blank with drmModePageFlip().
  *
- * Understanding how modesetting (as described in this document) works, is
- * essential to understand all further DRM topics.
+ * drmModePageFlip() returns immediately. Passing DRM_MODE_PAGE_FLIP_EVENT asks
+ * the kernel to send us an event on the DRM fd once the flip has actually
+ * happened. We read these events with drmHandleEvent(), which calls our
+ * drmmodeset_page_flip_event() handler with the @dev we passed as user data and
+ * the crtc that flipped.
+ * Only one flip can be pending on a CRTC at a time, so before queueing the next
+ * one we must wait for the previous event.
  *
- * Any feedback is welcome. Feel free to use this code freely for your own
- * documentation or projects.
+ * drmmodeset_wait_flip(dev): Blocks until no page-flip is pending on @dev. This
+ * is what paces rendering on the display refresh rate.
  *
- *  - Hosted on http://github.com/girish2k44/drmmodeset
- *  - Written by Girish Sharma at eInfochips <girish.sharma@einfochips.com>
+ * drmmodeset_page_flip(dev, block): Queues a flip to the current back buffer
+ * and picks the next back buffer. With two buffers the only candidate is the
+ * buffer that is still on screen until the flip completes, so we wait right
+ * away. With three buffers the next back buffer is already free and we can
+ * keep rendering while the flip is in flight; we only wait when we queue the
+ * following flip.
+ * Event loops that poll the DRM fd themselves pass block = false and skip the
+ * final wait. They have to check dev->pflip_pending before drawing again.
+ *
+ * drmmodeset_handle_events(fd): Reads the pending events of a DRM fd that poll()
+ * reported readable and dispatches them to the devices they belong to.
  */
 
-#include "draw.h"
-
-#include <math.h>
-#include <stdio.h>
-#include <string.h>
-// #include <linux/input.h>
-// #include <linux/fb.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <stdlib.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <termios.h>
-// #include <linux/vt.h>
-#include <signal.h>
-#include <unistd.h>
-
-void image_free(image_t *image) {
-  free(image->data);
-  image->width = 0;
-  image->height = 0;
-  image->data = NULL;
-  free(image);
+static void drmmodeset_flip_done(struct drmmodeset_dev *dev,
+                                 unsigned int frame) {
+  /* every vblank between two flips showed the old frame again */
+  if (dev->flip_sequence != 0 && frame - dev->flip_sequence > 1)
+    dev->vblank_misses += frame - dev->flip_sequence - 1;
+  dev->flip_sequence = frame;
+  dev->pflip_pending = false;
 }
 
-// Set an individual pixel. This is SLOW for bulk operations.
-// Do as little as possible, and memcpy the result.
-void set_pixel(int x, int y, context_t *context, int color) {
-  int write_index = x + y * context->width;
-  if (write_index < context->width * context->height) {
-    context->data[x + y * context->width] = color;
-  } else {
-    printf("Attempted to set color #%x at x=%d, y=%d). (out of bounds)\n",
-           color, x, y);
-    exit(1);
-  }
-}
+static void drmmodeset_page_flip_event(int fd, unsigned int frame,
+                                       unsigned int sec, unsigned int usec,
+                                       unsigned int crtc, void *data) {
+  struct drmmodeset_dev *dev = data;
 
-// We scale and crop the image to this new rect.
-image_t *scale(image_t *image, int w, int h) {
-  int sfx = w / image->width;
-  int sfy = h / image->height;
-  int crop_x_w = image->width;
-  int crop_y_h = image->height;
-  int crop_x = 0;
-  int crop_y = 0;
-
-  if (sfx < sfy) {
-    crop_x_w = image->height * w / h;
-    crop_x = (image->width - crop_x_w) / 2;
-  } else if (sfx > sfy) {
-    crop_y_h = image->width * h / w;
-    crop_y = (image->height - crop_y_h) / 2;
-  }
-
-  image_t *new_image = malloc(sizeof(image_t));
-  new_image->data = malloc(sizeof(int) * w * h);
-  new_image->width = w;
-  new_image->height = h;
-  for (int x = 0; x < w; x++) {
-    for (int y = 0; y < h; y++) {
-      int tr_x = ((float)crop_x_w / (float)w) * x + crop_x;
-      int tr_y = ((float)crop_y_h / (float)h) * y + crop_y;
-      new_image->data[y * w + x] = image->data[tr_y * image->width + tr_x];
+  /*
+   * atomic commits spanning several crtcs carry no device, and kernels before
+   * 4.12 report crtc 0; with a device we go by that, without one we can't
+   * tell which crtc flipped and complete every flip pending on this fd
+   */
+  if (!dev && !crtc) {
+    for (dev = drmmodeset_list; dev; dev = dev->next) {
+      if (dev->dri == (uint32_t)fd && dev->pflip_pending)
+        drmmodeset_flip_done(dev, frame);
     }
+    return;
   }
 
-  return new_image;
-  /*
-
-  for(int x = 0; x < w; x++) {
-      for(int y = 0; y < h; y++) {
-          int tr_x = ((float) image->width / (float) w) * (float) x;
-          int tr_y = ((float) image->height / (float) h) * (float) y;
-          new_image->data[y * w + x] = image->data[tr_y * image->width + tr_x];
-      }
+  if (!dev || (crtc && dev->crtc != crtc)) {
+    for (dev = drmmodeset_list; dev; dev = dev->next) {
+      if (dev->dri == (uint32_t)fd && dev->crtc == crtc)
+        break;
+    }
+    if (!dev)
+      return;
   }
-*/
-}
 
-// !! This operation is potentially unsafe. Use drawImage. It's harder to mess
-// up. X and w are the size of the array.
-void draw_array(int x, int y, int w, int h, int *array, context_t *context) {
-  // Ignore draws out of bounds
-  if (x > context->width || y > context->height) {
-    return;
-  }
+  drmmodeset_flip_done(dev, frame);
+}
 
-  // Ignore draws out of bounds
-  if (x + w < 0 || y + h < 0) {
-    return;
-  }
+static int drmmodeset_handle_events(int fd) {
+  drmEventContext ev;
 
-  // Column and row correction for partial onscreen images
-  int cy = 0;
-  int cx = 0;
+  memset(&ev, 0, sizeof(ev));
+  ev.version = 3;
+  ev.page_flip_handler2 = drmmodeset_page_flip_event;
 
-  // if y is less than 0, trim that many lines off the render.
-  if (y < 0) {
-    cy = -y;
+  if (drmHandleEvent(fd, &ev)) {
+    fprintf(stderr, "cannot handle DRM events (%d): %m\n", errno);
+    return -errno;
   }
 
-  // If x is less than 0, trim that many pixels off the render line.
-  if (x < 0) {
-    cx = -x;
-  }
+  return 0;
+}
 
-  // Number of items in a line
-  int line_width = (w - cx);
+static int drmmodeset_wait_flip(struct drmmodeset_dev *dev) {
+  struct pollfd pfd;
+  int ret;
 
-  // Number of lines total.
-  // We don't subtract cy because the loop starts with cy already advanced.
-  int line_count = h;
+  while (dev->pflip_pending) {
+    pfd.fd = dev->dri;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
 
-  // If the end of the line goes offscreen, trim that many pixels off the
-  // row.
-  if (x + w > context->width) {
-    line_width -= ((x + w) - context->width);
-  }
+    ret = poll(&pfd, 1, -1);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "cannot wait for page-flip (%d): %m\n", errno);
+      return -errno;
+    }
 
-  // If the number of rows is more than the height of the context, trim
-  // them off.
-  if (y + h > context->height) {
-    line_count -= ((y + h) - context->height);
+    ret = drmmodeset_handle_events(dev->dri);
+    if (ret)
+      return ret;
   }
 
-  for (; cy < line_count; cy++) {
-    // Draw each graphics line.
-    memcpy(&context->data[context->width * y + context->width * cy + x + cx],
-           &array[cy * w] + cx, sizeof(int) * line_width);
-  }
+  return 0;
 }
 
-void draw_image(int x, int y, image_t *image, context_t *context) {
-  draw_array(x, y, image->width, image->height, image->data, context);
-}
+static int drmmodeset_page_flip(struct drmmodeset_dev *dev, bool block) {
+  int ret;
 
-void draw_rect(int x, int y, int w, int h, context_t *context, int color) {
-  // Ignore draws out of bounds
-  if (x > context->width || y > context->height) {
-    return;
-  }
+  if (dev->atomic)
+    return drmmodeset_atomic_flip(&dev, 1, block);
 
-  // Ignore draws out of bounds
-  if (x + w < 0 || y + h < 0) {
-    return;
-  }
-  // Trim offscreen pixels
-  if (x < 0) {
-    w += x;
-    x = 0;
-  }
+  /* a kept crtc shows our single buffer only from the first flip on */
+  if (dev->buf_count < 2 && !dev->kept_crtc)
+    return 0;
 
-  // Trim offscreen lines
-  if (y < 0) {
-    h += y;
-    y = 0;
-  }
+  ret = drmmodeset_wait_flip(dev);
+  if (ret)
+    return ret;
 
-  // Trim offscreen pixels
-  if (x + w > context->width) {
-    w -= ((x + w) - context->width);
+  ret = drmModePageFlip(dev->dri, dev->crtc, dev->bufs[dev->back_buf].fb,
+                        DRM_MODE_PAGE_FLIP_EVENT, dev);
+  if (ret && dev->kept_crtc) {
+    /* the driver wants a modeset for our buffers after all */
+    dev->kept_crtc = false;
+    ret = drmModeSetCrtc(dev->dri, dev->crtc, dev->bufs[dev->back_buf].fb, 0,
+                         0, &dev->conn, 1, &dev->mode);
+    if (!ret) {
+      dev->front_buf = dev->back_buf;
+      dev->back_buf = (dev->back_buf + 1) % dev->buf_count;
+      return 0;
+    }
   }
-
-  // Trim offscreen lines.
-  if (y + h > context->height) {
-    h -= ((y + h) - context->height);
+  if (ret) {
+    fprintf(stderr, "cannot flip CRTC for connector %u (%d): %m\n", dev->conn,
+            errno);
+    return -errno;
   }
 
-  // Set the first line.
-  for (int rx = x; rx < x + w; rx++) {
-    set_pixel(rx, y, context, color);
-  }
+  dev->pflip_pending = true;
+  dev->kept_crtc = false;
+  dev->front_buf = dev->back_buf;
+  dev->back_buf = (dev->back_buf + 1) % dev->buf_count;
 
-  // Repeat the first line.
-  for (int ry = 1; ry < h; ry++) {
-    memcpy(&context->data[context->width * y + context->width * ry + x],
-           &context->data[context->width * y + x], w * sizeof(int));
-  }
-}
+  if (dev->buf_count == 2 && block)
+    return drmmodeset_wait_flip(dev);
 
-void clear_context_color(context_t *context, int color) {
-  draw_rect(0, 0, context->width, context->height, context, color);
+  return 0;
 }
 
-void clear_context(context_t *context) {
-  memset(context->data, 0, context->width * context->height * sizeof(int));
-}
+/*
+ * drmmodeset_set_crtc(dev): Saves the current CRTC configuration of @dev (unless
+ * drmmodeset_keep_crtc() did already) and then programs the CRTC to scan out
+ * our front buffer with our mode. Every
+ * device has its own CRTC, so with several monitors each one gets its own mode
+ * and its own page-flips; the events carry @dev as user data so they never get
+ * mixed up even though all devices share one DRM fd.
+ */
 
-void test_pattern(context_t *context) {
-  const unsigned int pattern[8] = {0xFFFFFF, 0xFFFF00, 0x00FFFF, 0x00FF00,
-                                   0xFF00FF, 0xFF0000, 0x0000FF, 0x000000};
+static int drmmodeset_set_crtc(struct drmmodeset_dev *dev) {
+  int ret;
 
-  unsigned columnWidth = context->width / 8;
-  for (int rx = 0; rx < context->width; rx++) {
-    set_pixel(rx, 0, context, pattern[rx / columnWidth]);
-  }
+  if (!dev->saved_crtc)
+    dev->saved_crtc = drmModeGetCrtc(dev->dri, dev->crtc);
+  if (dev->atomic && drmmodeset_atomic_set_crtc(dev) == 0)
+    return 0;
 
-  // make it faster: memcpy the first row.
-  for (int y = 1; y < context->height; y++) {
-    memcpy(&context[context->width * y], context, context->width * sizeof(int));
+  ret = drmModeSetCrtc(dev->dri, dev->crtc, dev->bufs[dev->front_buf].fb, 0, 0,
+                       &dev->conn, 1, &dev->mode);
+  if (ret) {
+    fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n", dev->conn,
+            errno);
+    return -errno;
   }
-}
 
-void context_release(context_t *context) {
-  printf("fb: %d\n", drmmodeset_con->dri);
-  drmmodeset_cleanup(drmmodeset_con->dri);
-  close(context->fb_file_desc);
-  context->data = NULL;
-  context->fb_file_desc = 0;
-  free(context);
+  return 0;
 }
 
-context_t *context_create() {
+/*
+ * Besides the primary plane that scans out our framebuffer, most display
+ * controllers have a few more planes. Overlay planes scan out a second buffer
+ * on top of (or below) the primary one, at any position and usually with
+ * hardware scaling. Cursor planes do the same for small buffers, typically
+ * 64x64, without scaling. The display controller composes all of them while
+ * scanning out, so an image or a video frame on an overlay costs no CPU time
+ * at all, no matter how large it is shown.
+ *
+ * drmModeGetPlaneResources() only lists the overlay planes unless we tell the
+ * kernel that we understand the other types, too. With
+ * DRM_CLIENT_CAP_UNIVERSAL_PLANES set, every plane has a "type" property which
+ * tells us whether it is a primary, overlay or cursor plane.
+ * Each plane also has a @possible_crtcs bitmask, indexed by the position of the
+ * crtc in drmModeRes.crtcs, and a list of pixel formats it can scan out. Our
+ * images are premultiplied ARGB8888, which is also what planes blend by
+ * default.
+ *
+ * drmmodeset_plane_type(fd, plane): Returns the DRM_PLANE_TYPE_* of @plane, or
+ * -1 when the kernel doesn't tell us.
+ *
+ * drmmodeset_plane_in_use(plane): True when any of our devices acquired @plane
+ * or scans out of it as its primary plane.
+ *
+ * drmmodeset_find_plane(dev, type, format, skip): Returns the id of the first
+ * plane of @type that can be used with the crtc of @dev, supports @format and
+ * isn't in use, after skipping @skip of them. Returns 0 if there is none.
+ * A plane the kernel already shows on our crtc comes first: primary planes
+ * usually list every crtc as possible, but only the bound one is really ours.
+ *
+ * Once acquired, a plane is shown with drmModeSetPlane(). It takes the crtc
+ * rectangle in pixels and the source rectangle in 16.16 fixed point; when the
+ * sizes differ, the hardware scales. Passing a framebuffer of 0 disables the
+ * plane again. Legacy drmModeSetPlane() is not tied to our page-flips, so the
+ * plane may change one frame before or after the primary plane does.
+ */
+
+struct context_plane {
+  struct context_plane *next;
+  struct drmmodeset_dev *dev;
+  uint32_t id;
+  int type;
+
+  struct drmmodeset_buf buf;
+  uint32_t width;
+  uint32_t height;
+  bool has_buf;
+  /* imported framebuffer scanned out instead of buf */
+  struct context_fb *fb;
+
+  int src_x, src_y, src_w, src_h;
+  int crtc_x, crtc_y, crtc_w, crtc_h;
+  bool visible;
+
+  /* atomic only: property ids, and whether the state changed since the last
+   * commit */
+  struct drmmodeset_plane_props props;
+  bool dirty;
+};
+
+/*
+ * Framebuffers imported from dma-bufs. After drmModeAddFB2() the framebuffer
+ * holds its own reference on the buffer objects, so we close the GEM handles
+ * drmPrimeFDToHandle() gave us right away and only keep the fb id around.
+ */
+struct context_fb {
+  struct drmmodeset_dev *dev;
+  uint32_t id;
+  uint32_t width;
+  uint32_t height;
+};
+
+/* What the plane scans out, 0 for nothing. */
+static uint32_t drmmodeset_plane_fb(const struct context_plane *plane) {
+  if (plane->fb)
+    return plane->fb->id;
+  return plane->has_buf ? plane->buf.fb : 0;
+}
+
+static int drmmodeset_plane_type(int fd, uint32_t plane) {
+  drmModeObjectProperties *props;
+  drmModePropertyRes *prop;
+  unsigned int i;
+  int type = -1;
+
+  props = drmModeObjectGetProperties(fd, plane, DRM_MODE_OBJECT_PLANE);
+  if (!props)
+    return -1;
+
+  for (i = 0; i < props->count_props && type < 0; ++i) {
+    prop = drmModeGetProperty(fd, props->props[i]);
+    if (!prop)
+      continue;
+    if (strcmp(prop->name, "type") == 0)
+      type = (int)props->prop_values[i];
+    drmModeFreeProperty(prop);
+  }
+
+  drmModeFreeObjectProperties(props);
+  return type;
+}
+
+static bool drmmodeset_plane_in_use(uint32_t plane) {
+  struct drmmodeset_dev *iter;
+  struct context_plane *p;
+
+  for (iter = drmmodeset_list; iter; iter = iter->next) {
+    if (iter->primary == plane)
+      return true;
+    for (p = iter->planes; p; p = p->next) {
+      if (p->id == plane)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+static int drmmodeset_crtc_index(int fd, uint32_t crtc) {
+  drmModeRes *res;
+  int i, index = -1;
+
+  res = drmModeGetResources(fd);
+  if (!res)
+    return -1;
+
+  for (i = 0; i < res->count_crtcs; ++i) {
+    if (res->crtcs[i] == crtc) {
+      index = i;
+      break;
+    }
+  }
+
+  drmModeFreeResources(res);
+  return index;
+}
+
+static uint32_t drmmodeset_find_plane(struct drmmodeset_dev *dev, int type,
+                                      uint32_t format, int skip) {
+  drmModePlaneRes *pres;
+  drmModePlane *plane;
+  unsigned int i, j;
+  uint32_t bound = 0, nth = 0, before = 0;
+  int index, count = 0;
+
+  drmSetClientCap(dev->dri, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
+  index = drmmodeset_crtc_index(dev->dri, dev->crtc);
+  if (index < 0)
+    return 0;
+
+  pres = drmModeGetPlaneResources(dev->dri);
+  if (!pres) {
+    fprintf(stderr, "cannot retrieve plane resources (%d): %m\n", errno);
+    return 0;
+  }
+
+  /* the bound plane counts as the first one, so of the others we need the
+   * one at @skip without it and the one before that with it */
+  for (i = 0; i < pres->count_planes; ++i) {
+    plane = drmModeGetPlane(dev->dri, pres->planes[i]);
+    if (!plane)
+      continue;
+
+    if ((plane->possible_crtcs & (1u << index)) &&
+        drmmodeset_plane_type(dev->dri, plane->plane_id) == type &&
+        !drmmodeset_plane_in_use(plane->plane_id)) {
+      for (j = 0; j < plane->count_formats; ++j) {
+        if (plane->formats[j] != format)
+          continue;
+        if (!bound && plane->crtc_id == dev->crtc) {
+          bound = plane->plane_id;
+        } else {
+          if (count == skip - 1)
+            before = plane->plane_id;
+          if (count == skip)
+            nth = plane->plane_id;
+          ++count;
+        }
+        break;
+      }
+    }
+
+    drmModeFreePlane(plane);
+  }
+
+  drmModeFreePlaneResources(pres);
+  if (!bound)
+    return nth;
+  return skip == 0 ? bound : before;
+}
+
+static int drmmodeset_plane_update(struct context_plane *plane) {
+  struct drmmodeset_dev *dev = plane->dev;
+  int ret;
+
+  /* goes out with the next commit, in the same vblank as the frame */
+  if (dev->atomic) {
+    plane->dirty = true;
+    return 0;
+  }
+
+  if (!plane->visible || !drmmodeset_plane_fb(plane))
+    ret = drmModeSetPlane(dev->dri, plane->id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                          0);
+  else
+    ret = drmModeSetPlane(dev->dri, plane->id, dev->crtc,
+                          drmmodeset_plane_fb(plane), 0,
+                          plane->crtc_x, plane->crtc_y, plane->crtc_w,
+                          plane->crtc_h, (uint32_t)plane->src_x << 16,
+                          (uint32_t)plane->src_y << 16,
+                          (uint32_t)plane->src_w << 16,
+                          (uint32_t)plane->src_h << 16);
+  if (ret) {
+    fprintf(stderr, "cannot set plane %u (%d): %m\n", plane->id, errno);
+    return -errno;
+  }
+
+  return 0;
+}
+
+/*
+ * Legacy drmModeSetCrtc(), drmModePageFlip() and drmModeSetPlane() each change
+ * one thing at a time and some of them block until the next vblank. Atomic
+ * modesetting replaces all of them with one call: we collect property changes
+ * of any number of connectors, crtcs and planes in a drmModeAtomicReq and the
+ * kernel applies all of them in the same vblank, or none of them.
+ * Every object exposes its state as properties. The connector's CRTC_ID routes
+ * it to a crtc, the crtc's MODE_ID (a property blob holding a drmModeModeInfo)
+ * and ACTIVE set the mode, and every plane has FB_ID, CRTC_ID and the source
+ * and crtc rectangles that drmModeSetPlane() used to take as arguments.
+ *
+ * A commit can be flagged DRM_MODE_ATOMIC_TEST_ONLY, which only asks the
+ * driver whether it would accept it, DRM_MODE_ATOMIC_ALLOW_MODESET, which is
+ * needed for anything that changes the mode, and DRM_MODE_ATOMIC_NONBLOCK,
+ * which returns at once and sends a page-flip event per crtc once the commit
+ * hit the screen, just like drmModePageFlip() does.
+ * Drivers only offer atomic to clients that set DRM_CLIENT_CAP_ATOMIC. If that
+ * fails, or a device can't find the properties it needs, or its first commit
+ * is rejected, we keep using the legacy calls for that device.
+ *
+ * drmmodeset_prop_id(fd, obj, type, name): Looks up the id of the property
+ * @name of object @obj. Property ids never change, so we only do this once.
+ *
+ * drmmodeset_atomic_init(dev): Finds the primary plane of the crtc of @dev,
+ * the property ids we need and creates the mode blob. Sets @dev->atomic on
+ * success.
+ *
+ * drmmodeset_atomic_set_crtc(dev): Performs the modeset of @dev as one atomic
+ * commit, after testing it. On failure @dev falls back to legacy modesetting.
+ *
+ * drmmodeset_atomic_flip(devs, count, block): Commits the back buffers and
+ * changed planes of @count devices sharing a DRM fd in one non-blocking
+ * commit. Waits like drmmodeset_page_flip() does when @block is set. Devices
+ * with a single buffer only commit when one of their planes changed.
+ */
+
+static uint32_t drmmodeset_prop_id(int fd, uint32_t obj, uint32_t type,
+                                   const char *name) {
+  drmModeObjectProperties *props;
+  drmModePropertyRes *prop;
+  unsigned int i;
+  uint32_t id = 0;
+
+  props = drmModeObjectGetProperties(fd, obj, type);
+  if (!props)
+    return 0;
+
+  for (i = 0; i < props->count_props && !id; ++i) {
+    prop = drmModeGetProperty(fd, props->props[i]);
+    if (!prop)
+      continue;
+    if (strcmp(prop->name, name) == 0)
+      id = prop->prop_id;
+    drmModeFreeProperty(prop);
+  }
+
+  drmModeFreeObjectProperties(props);
+  return id;
+}
+
+static int drmmodeset_plane_props(int fd, uint32_t plane,
+                                  struct drmmodeset_plane_props *p) {
+  p->fb_id = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "FB_ID");
+  p->crtc_id = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+  p->src_x = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_X");
+  p->src_y = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+  p->src_w = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_W");
+  p->src_h = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "SRC_H");
+  p->crtc_x = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+  p->crtc_y = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+  p->crtc_w = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+  p->crtc_h = drmmodeset_prop_id(fd, plane, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+
+  if (!p->fb_id || !p->crtc_id || !p->src_x || !p->src_y || !p->src_w ||
+      !p->src_h || !p->crtc_x || !p->crtc_y || !p->crtc_w || !p->crtc_h)
+    return -ENOENT;
+
+  return 0;
+}
+
+static int drmmodeset_atomic_init(struct drmmodeset_dev *dev) {
+  int fd = dev->dri;
+
+  /* the primary plane has to scan out our framebuffers, preferably the one
+   * already showing our crtc; other devices' primaries are in use */
+  dev->primary = drmmodeset_find_plane(dev, DRM_PLANE_TYPE_PRIMARY,
+                                       pixel_format(dev->format)->fourcc, 0);
+  if (!dev->primary || drmmodeset_plane_props(fd, dev->primary,
+                                              &dev->primary_props))
+    return -ENOENT;
+
+  dev->conn_crtc_id =
+      drmmodeset_prop_id(fd, dev->conn, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+  dev->crtc_mode_id =
+      drmmodeset_prop_id(fd, dev->crtc, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+  dev->crtc_active =
+      drmmodeset_prop_id(fd, dev->crtc, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+  if (!dev->conn_crtc_id || !dev->crtc_mode_id || !dev->crtc_active)
+    return -ENOENT;
+
+  if (drmModeCreatePropertyBlob(fd, &dev->mode, sizeof(dev->mode),
+                                &dev->mode_blob)) {
+    fprintf(stderr, "cannot create mode blob (%d): %m\n", errno);
+    return -errno;
+  }
+
+  dev->atomic = true;
+  return 0;
+}
+
+/* a plane with @fb 0 is turned off */
+static void drmmodeset_atomic_add_plane(drmModeAtomicReq *req, uint32_t plane,
+                                        const struct drmmodeset_plane_props *p,
+                                        uint32_t crtc, uint32_t fb,
+                                        const int src[4], const int dst[4]) {
+  drmModeAtomicAddProperty(req, plane, p->fb_id, fb);
+  drmModeAtomicAddProperty(req, plane, p->crtc_id, fb ? crtc : 0);
+  if (!fb)
+    return;
+
+  drmModeAtomicAddProperty(req, plane, p->src_x, (uint64_t)src[0] << 16);
+  drmModeAtomicAddProperty(req, plane, p->src_y, (uint64_t)src[1] << 16);
+  drmModeAtomicAddProperty(req, plane, p->src_w, (uint64_t)src[2] << 16);
+  drmModeAtomicAddProperty(req, plane, p->src_h, (uint64_t)src[3] << 16);
+  drmModeAtomicAddProperty(req, plane, p->crtc_x, (uint64_t)(int64_t)dst[0]);
+  drmModeAtomicAddProperty(req, plane, p->crtc_y, (uint64_t)(int64_t)dst[1]);
+  drmModeAtomicAddProperty(req, plane, p->crtc_w, dst[2]);
+  drmModeAtomicAddProperty(req, plane, p->crtc_h, dst[3]);
+}
+
+/* the primary plane scanning out @fb plus every plane that changed */
+static bool drmmodeset_atomic_add_dev(drmModeAtomicReq *req,
+                                      struct drmmodeset_dev *dev, uint32_t fb) {
+  struct context_plane *plane;
+  int full[4] = {0, 0, (int)dev->width, (int)dev->height};
+  bool changed = false;
+
+  if (fb) {
+    drmmodeset_atomic_add_plane(req, dev->primary, &dev->primary_props,
+                                dev->crtc, fb, full, full);
+    changed = true;
+  }
+
+  for (plane = dev->planes; plane; plane = plane->next) {
+    int src[4] = {plane->src_x, plane->src_y, plane->src_w, plane->src_h};
+    int dst[4] = {plane->crtc_x, plane->crtc_y, plane->crtc_w, plane->crtc_h};
+
+    if (!plane->dirty)
+      continue;
+    drmmodeset_atomic_add_plane(req, plane->id, &plane->props, dev->crtc,
+                                plane->visible ? drmmodeset_plane_fb(plane) : 0,
+                                src, dst);
+    changed = true;
+  }
+
+  return changed;
+}
+
+static void drmmodeset_atomic_clean(struct drmmodeset_dev *dev) {
+  struct context_plane *plane;
+
+  for (plane = dev->planes; plane; plane = plane->next)
+    plane->dirty = false;
+}
+
+static int drmmodeset_atomic_set_crtc(struct drmmodeset_dev *dev) {
+  drmModeAtomicReq *req;
+  uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+  int ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+
+  drmModeAtomicAddProperty(req, dev->conn, dev->conn_crtc_id, dev->crtc);
+  drmModeAtomicAddProperty(req, dev->crtc, dev->crtc_mode_id, dev->mode_blob);
+  drmModeAtomicAddProperty(req, dev->crtc, dev->crtc_active, 1);
+  drmmodeset_atomic_add_dev(req, dev, dev->bufs[dev->front_buf].fb);
+
+  ret = drmModeAtomicCommit(dev->dri, req, flags | DRM_MODE_ATOMIC_TEST_ONLY,
+                            NULL);
+  if (!ret)
+    ret = drmModeAtomicCommit(dev->dri, req, flags, NULL);
+  drmModeAtomicFree(req);
+
+  if (ret) {
+    fprintf(stderr,
+            "atomic modeset failed for connector %u (%d): %m, using legacy\n",
+            dev->conn, errno);
+    dev->atomic = false;
+    return -errno;
+  }
+
+  drmmodeset_atomic_clean(dev);
+  return 0;
+}
+
+/*
+ * drmmodeset_keep_crtc(dev): A full modeset blanks the screen for a few frames
+ * while the display resynchronizes. When the bootloader, a splash screen or
+ * the previous instance of the application left @crtc driving our connector
+ * in exactly our mode, there is no need for one: we leave the crtc as it is,
+ * so it keeps showing what it showed, and the first page-flip puts up our
+ * first frame. Atomic drivers are asked with a TEST_ONLY commit whether they
+ * can flip to our buffers without a modeset; legacy drivers fall back to
+ * drmModeSetCrtc() when that first flip fails.
+ * Returns 0 when the crtc was kept, a negative error code when it needs a
+ * modeset. Either way @saved_crtc holds the configuration to restore on exit.
+ */
+
+static int drmmodeset_keep_crtc(struct drmmodeset_dev *dev) {
+  drmModeCrtc *crtc;
+  drmModeAtomicReq *req;
+  int ret;
+
+  if (!dev->saved_crtc)
+    dev->saved_crtc = drmModeGetCrtc(dev->dri, dev->crtc);
+  crtc = dev->saved_crtc;
+
+  if (!dev->crtc_bound || !crtc || !crtc->mode_valid || !crtc->buffer_id ||
+      crtc->x || crtc->y || !drmmodeset_same_mode(&crtc->mode, &dev->mode))
+    return -EINVAL;
+
+  if (dev->atomic) {
+    req = drmModeAtomicAlloc();
+    if (!req)
+      return -ENOMEM;
+
+    drmmodeset_atomic_add_dev(req, dev, dev->bufs[dev->back_buf].fb);
+    ret = drmModeAtomicCommit(dev->dri, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+    drmModeAtomicFree(req);
+    if (ret)
+      return -errno;
+  }
+
+  fprintf(stderr, "keeping mode of crtc %u for connector %u\n", dev->crtc,
+          dev->conn);
+  dev->kept_crtc = true;
+  return 0;
+}
+
+static int drmmodeset_atomic_flip(struct drmmodeset_dev **devs, int count,
+                                  bool block) {
+  drmModeAtomicReq *req;
+  bool queued[count];
+  bool any = false;
+  int i, ret;
+
+  for (i = 0; i < count; ++i) {
+    ret = drmmodeset_wait_flip(devs[i]);
+    if (ret)
+      return ret;
+  }
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+
+  for (i = 0; i < count; ++i) {
+    struct drmmodeset_dev *dev = devs[i];
+    uint32_t fb = dev->buf_count > 1 || dev->kept_crtc
+                      ? dev->bufs[dev->back_buf].fb
+                      : 0;
+
+    queued[i] = drmmodeset_atomic_add_dev(req, dev, fb);
+    any |= queued[i];
+  }
+
+  if (!any) {
+    drmModeAtomicFree(req);
+    return 0;
+  }
+
+  /* with several crtcs the event handler finds the device by crtc id */
+  ret = drmModeAtomicCommit(devs[0]->dri, req,
+                            DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+                            count == 1 ? devs[0] : NULL);
+  drmModeAtomicFree(req);
+  if (ret) {
+    fprintf(stderr, "cannot commit atomic page-flip (%d): %m\n", errno);
+    return -errno;
+  }
+
+  for (i = 0; i < count; ++i) {
+    struct drmmodeset_dev *dev = devs[i];
+
+    if (!queued[i])
+      continue;
+
+    dev->pflip_pending = true;
+    dev->kept_crtc = false;
+    drmmodeset_atomic_clean(dev);
+    if (dev->buf_count > 1) {
+      dev->front_buf = dev->back_buf;
+      dev->back_buf = (dev->back_buf + 1) % dev->buf_count;
+    }
+  }
+
+  for (i = 0; i < count && block; ++i) {
+    if (devs[i]->buf_count == 2) {
+      ret = drmmodeset_wait_flip(devs[i]);
+      if (ret)
+        return ret;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * drmmodeset_set_rotation(dev, rotation): Turns the scanout of the primary plane
+ * by @rotation, a DRM_MODE_ROTATE_* | DRM_MODE_REFLECT_* mask, through the
+ * plane's "rotation" property. The display controller then reads the buffer in
+ * that order by itself and rotating costs us nothing. Only atomic drivers get
+ * asked, and a TEST_ONLY commit tells whether they can do it with our buffers;
+ * the property stays set for every following commit.
+ */
+
+static int drmmodeset_set_rotation(struct drmmodeset_dev *dev,
+                                   uint64_t rotation) {
+  drmModeAtomicReq *req;
+  int full[4] = {0, 0, (int)dev->width, (int)dev->height};
+  int ret;
+
+  if (!dev->atomic)
+    return -EOPNOTSUPP;
+  if (!dev->primary_rotation)
+    dev->primary_rotation = drmmodeset_prop_id(
+        dev->dri, dev->primary, DRM_MODE_OBJECT_PLANE, "rotation");
+  if (!dev->primary_rotation)
+    return -EOPNOTSUPP;
+
+  ret = drmmodeset_wait_flip(dev);
+  if (ret)
+    return ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+
+  drmmodeset_atomic_add_plane(req, dev->primary, &dev->primary_props,
+                              dev->crtc, dev->bufs[dev->front_buf].fb, full,
+                              full);
+  drmModeAtomicAddProperty(req, dev->primary, dev->primary_rotation, rotation);
+
+  ret = drmModeAtomicCommit(dev->dri, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+  if (!ret)
+    ret = drmModeAtomicCommit(dev->dri, req, 0, NULL);
+  drmModeAtomicFree(req);
+  if (ret)
+    return -errno;
+
+  dev->rotation = rotation;
+  return 0;
+}
+
+/*
+ * drmmodeset_page_flip_all(devs, count, block, results): Presents several
+ * devices at once. Atomic devices on one DRM fd share a single commit, so all
+ * outputs switch in the same vblank and share its result. Otherwise every
+ * device flips on its own, without waiting in between, and we wait for all of
+ * them afterwards. @results receives the result of every device, the first
+ * error is returned.
+ */
+
+static int drmmodeset_page_flip_all(struct drmmodeset_dev **devs, int count,
+                                    bool block, int *results) {
+  bool shared = true;
+  int i, ret = 0, err;
+
+  for (i = 0; i < count; ++i) {
+    if (!devs[i]->atomic || devs[i]->dri != devs[0]->dri)
+      shared = false;
+  }
+  if (shared && count > 0) {
+    ret = drmmodeset_atomic_flip(devs, count, block);
+    for (i = 0; i < count; ++i)
+      results[i] = ret;
+    return ret;
+  }
+
+  for (i = 0; i < count; ++i)
+    results[i] = drmmodeset_page_flip(devs[i], false);
+  for (i = 0; i < count && block; ++i) {
+    if (devs[i]->buf_count == 2 && !results[i])
+      results[i] = drmmodeset_wait_flip(devs[i]);
+  }
+
+  for (i = 0; i < count; ++i) {
+    err = results[i];
+    if (err && !ret)
+      ret = err;
+  }
+  return ret;
+}
+
+/*
+ * drmmodeset_atomic_commit_plane(plane): Commits the state of @plane on its own
+ * and blocks until it is on screen. Atomic plane changes usually wait for the
+ * next frame's commit; before a framebuffer the plane scanned out goes away
+ * they can't, or the kernel turns the plane off until then.
+ */
+
+static int drmmodeset_atomic_commit_plane(struct context_plane *plane) {
+  drmModeAtomicReq *req;
+  int src[4] = {plane->src_x, plane->src_y, plane->src_w, plane->src_h};
+  int dst[4] = {plane->crtc_x, plane->crtc_y, plane->crtc_w, plane->crtc_h};
+  int none[4] = {0, 0, 0, 0};
+  uint32_t fb = plane->visible ? drmmodeset_plane_fb(plane) : 0;
+  int ret;
+
+  ret = drmmodeset_wait_flip(plane->dev);
+  if (ret)
+    return ret;
+
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return -ENOMEM;
+
+  drmmodeset_atomic_add_plane(req, plane->id, &plane->props,
+                              fb ? plane->dev->crtc : 0, fb, fb ? src : none,
+                              fb ? dst : none);
+  ret = drmModeAtomicCommit(plane->dev->dri, req, 0, NULL);
+  drmModeAtomicFree(req);
+  if (ret) {
+    fprintf(stderr, "cannot commit plane %u (%d): %m\n", plane->id, errno);
+    return -errno;
+  }
+
+  plane->dirty = false;
+  return 0;
+}
+
+static void drmmodeset_plane_free(struct context_plane *plane) {
+  struct context_plane **link;
+
+  plane->visible = false;
+  if (plane->dev->atomic)
+    drmmodeset_atomic_commit_plane(plane);
+  else
+    drmmodeset_plane_update(plane);
+  if (plane->has_buf)
+    drmmodeset_destroy_buf(plane->dev->dri, &plane->buf);
+
+  for (link = &plane->dev->planes; *link; link = &(*link)->next) {
+    if (*link == plane) {
+      *link = plane->next;
+      break;
+    }
+  }
+  free(plane);
+}
+
+/*
+ * drmmodeset_cleanup(dev): This cleans up a device we created during
+ * drmmodeset_prepare(). It resets the CRTC to its saved state, deallocates all
+ * memory and removes the device from the global list. It should be pretty
+ * obvious how all of this works.
+ * A page-flip that is still pending references one of our framebuffers, so we
+ * wait for it before removing anything. Once the last device of a DRM fd is
+ * gone we close the fd, too.
+ */
+
+static void drmmodeset_cleanup(struct drmmodeset_dev *dev) {
+  struct drmmodeset_dev **link, *iter;
+  int fd = dev->dri;
+  unsigned int i;
+
+  /* remove from global list */
+  for (link = &drmmodeset_list; *link; link = &(*link)->next) {
+    if (*link == dev) {
+      *link = dev->next;
+      break;
+    }
+  }
+
+  /* wait for pending page-flips */
+  drmmodeset_wait_flip(dev);
+
+  /* turn off and free the planes the application didn't release */
+  while (dev->planes)
+    drmmodeset_plane_free(dev->planes);
+
+  /* whoever comes next expects an unrotated screen */
+  if (dev->rotation && dev->rotation != DRM_MODE_ROTATE_0)
+    drmmodeset_set_rotation(dev, DRM_MODE_ROTATE_0);
+
+  printf("restore\n");
+  /* restore saved CRTC configuration */
+  if (dev->saved_crtc) {
+    drmModeSetCrtc(fd, dev->saved_crtc->crtc_id, dev->saved_crtc->buffer_id,
+                   dev->saved_crtc->x, dev->saved_crtc->y, &dev->conn, 1,
+                   &dev->saved_crtc->mode);
+    drmModeFreeCrtc(dev->saved_crtc);
+  }
+
+  /* unmap buffers, delete framebuffers and dumb buffers */
+  for (i = 0; i < dev->buf_count; ++i)
+    drmmodeset_destroy_buf(fd, &dev->bufs[i]);
+
+  if (dev->mode_blob)
+    drmModeDestroyPropertyBlob(fd, dev->mode_blob);
+
+  /* free allocated memory */
+  free(dev);
+
+  /* close the fd with its last device */
+  for (iter = drmmodeset_list; iter; iter = iter->next) {
+    if (iter->dri == fd)
+      return;
+  }
+  close(fd);
+}
+
+/*
+ * I hope this was a short but easy overview of the DRM modesetting API.
+ *
+ * Understanding how modesetting (as described in this document) works, is
+ * essential to understand all further DRM topics.
+ *
+ * Any feedback is welcome. Feel free to use this code freely for your own
+ * documentation or projects.
+ *
+ *  - Hosted on http://github.com/girish2k44/drmmodeset
+ *  - Written by Girish Sharma at eInfochips <girish.sharma@einfochips.com>
+ */
+
+#include "draw.h"
+#include "pool.h"
+#include "span.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+// #include <linux/input.h>
+// #include <linux/fb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <termios.h>
+// #include <linux/vt.h>
+#include <signal.h>
+#include <unistd.h>
+
+image_t *image_create(int w, int h, allocator_t *allocator) {
+  size_t pixels = w > 0 && h > 0 ? (size_t)w * h : 1;
+
+  // Pixels are indexed with int (y * stride + x), decoded files may be larger.
+  if (pixels > INT_MAX || pixels > SIZE_MAX / sizeof(int)) {
+    return NULL;
+  }
+
+  image_t *image = allocator_alloc(allocator, sizeof(image_t));
+  if (image == NULL) {
+    return NULL;
+  }
+
+  image->data = allocator_alloc(allocator, sizeof(int) * pixels);
+  if (image->data == NULL) {
+    allocator_release(allocator, image);
+    return NULL;
+  }
+  image->width = w;
+  image->height = h;
+  image->stride = w;
+  image->allocator = allocator;
+  image->generation = 0;
+  return image;
+}
+
+void image_touch(image_t *image) {
+  image->generation++;
+}
+
+void image_free(image_t *image) {
+  allocator_t *allocator = image->allocator;
+
+  allocator_release(allocator, image->data);
+  image->width = 0;
+  image->height = 0;
+  image->stride = 0;
+  image->data = NULL;
+  allocator_release(allocator, image);
+}
+
+image_t image_view(image_t *image, int x, int y, int w, int h) {
+  image_t view;
+
+  // Keep the view inside the parent.
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > image->width) {
+    w = image->width - x;
+  }
+  if (y + h > image->height) {
+    h = image->height - y;
+  }
+  if (w < 0 || h < 0) {
+    w = 0;
+    h = 0;
+  }
+
+  view.data = &image->data[y * image->stride + x];
+  view.width = w;
+  view.height = h;
+  view.stride = image->stride;
+  view.allocator = NULL;
+  view.generation = image->generation;
+  return view;
+}
+
+// Set an individual pixel. This is SLOW for bulk operations.
+// Do as little as possible, and memcpy the result.
+void set_pixel(int x, int y, context_t *context, int color) {
+  // Check x and y separately, with padded rows x + y * stride can land in the
+  // padding and still look in bounds.
+  rect_t clip = context->clip;
+
+  if (x >= clip.x && x < clip.x + clip.w && y >= clip.y &&
+      y < clip.y + clip.h) {
+    context->data[x + y * context->stride] = color;
+    context_damage(context, x, y, 1, 1);
+  } else if (context->stats != NULL) {
+    context->stats->clipped_pixels++;
+  }
+}
+
+// Source window and 16.16 steps for scaling a crop of image onto dest. The
+// crop keeps dest's aspect ratio and is centered, like the original scale().
+// Positions are 64-bit, 16.16 in an int overflows past 32767 source pixels.
+typedef struct {
+  const image_t *src;
+  image_t *dest;
+  int filter;
+  int crop_x;
+  int crop_y;
+  int crop_w;
+  int crop_h;
+  long long step_x;
+  long long step_y;
+} scale_job_t;
+
+static void scale_job_init(scale_job_t *job, image_t *image, image_t *dest,
+                           int filter) {
+  job->src = image;
+  job->dest = dest;
+  job->filter = filter;
+  job->crop_x = 0;
+  job->crop_y = 0;
+  job->crop_w = image->width;
+  job->crop_h = image->height;
+
+  // Compare aspect ratios by cross-multiplying; integer ratios of the sizes
+  // collapse to 0 as soon as we downscale.
+  long long wide = (long long)image->width * dest->height;
+  long long tall = (long long)image->height * dest->width;
+  if (wide > tall) {
+    job->crop_w = tall / dest->height > 0 ? tall / dest->height : 1;
+    job->crop_x = (image->width - job->crop_w) / 2;
+  } else if (wide < tall) {
+    job->crop_h = wide / dest->width > 0 ? wide / dest->width : 1;
+    job->crop_y = (image->height - job->crop_h) / 2;
+  }
+
+  job->step_x = ((long long)job->crop_w << 16) / dest->width;
+  job->step_y = ((long long)job->crop_h << 16) / dest->height;
+}
+
+// Blend two pixels, weight is the share of b out of 256.
+static inline uint32_t lerp_pixel(uint32_t a, uint32_t b, uint32_t weight) {
+  uint32_t rb = ((a & 0x00FF00FF) * (256 - weight) +
+                 (b & 0x00FF00FF) * weight) >> 8;
+  uint32_t ag = (((a >> 8) & 0x00FF00FF) * (256 - weight) +
+                 ((b >> 8) & 0x00FF00FF) * weight) >> 8;
+  return (rb & 0x00FF00FF) | ((ag & 0x00FF00FF) << 8);
+}
+
+static void scale_rows_nearest(const scale_job_t *job, int y0, int y1) {
+  const image_t *src = job->src;
+  image_t *dest = job->dest;
+  int prev_row = -1;
+  // span_scale_nearest() positions are ints, how many pixels fit in one call.
+  // Upscales past 65536x step by 0 and never leave the first pixel.
+  long long room =
+      job->step_x ? (INT_MAX - 0xFFFF) / job->step_x : dest->width;
+
+  for (int y = y0; y < y1; y++) {
+    // Sample at pixel centers.
+    int sy = (int)((y * job->step_y + job->step_y / 2) >> 16);
+    int *out = &dest->data[y * dest->stride];
+
+    // Upscaling repeats source rows, copy the one we just made.
+    if (sy == prev_row) {
+      memcpy(out, out - dest->stride, dest->width * sizeof(int));
+      continue;
+    }
+    prev_row = sy;
+
+    const int *in =
+        &src->data[(job->crop_y + sy) * src->stride + job->crop_x];
+    long long sx = job->step_x / 2;
+    int x = 0;
+    // Rebase in for every call so the fraction starts below one pixel.
+    while (x < dest->width) {
+      int count = dest->width - x < room ? dest->width - x : (int)room;
+      if (count < 1) {
+        out[x++] = in[sx >> 16];
+        sx += job->step_x;
+        continue;
+      }
+      span_scale_nearest(out + x, in + (sx >> 16), count, (int)(sx & 0xFFFF),
+                         (int)job->step_x);
+      sx += count * job->step_x;
+      x += count;
+    }
+  }
+}
+
+static void scale_rows_bilinear(const scale_job_t *job, int y0, int y1) {
+  const image_t *src = job->src;
+  image_t *dest = job->dest;
+  int max_x = job->crop_w - 1;
+  int max_y = job->crop_h - 1;
+
+  for (int y = y0; y < y1; y++) {
+    // Centers line up when we sample half a pixel back.
+    long long sy = y * job->step_y + job->step_y / 2 - 0x8000;
+    if (sy < 0) {
+      sy = 0;
+    }
+    int ty = (int)(sy >> 16);
+    int wy = (sy >> 8) & 0xFF;
+    int by = ty < max_y ? ty + 1 : max_y;
+
+    const uint32_t *top = (const uint32_t *)&src->data[(job->crop_y + ty) *
+                                                           src->stride +
+                                                       job->crop_x];
+    const uint32_t *bottom = (const uint32_t *)&src->data[(job->crop_y + by) *
+                                                              src->stride +
+                                                          job->crop_x];
+    uint32_t *out = (uint32_t *)&dest->data[y * dest->stride];
+    long long sx = job->step_x / 2 - 0x8000;
+
+    for (int x = 0; x < dest->width; x++, sx += job->step_x) {
+      long long cx = sx < 0 ? 0 : sx;
+      int lx = (int)(cx >> 16);
+      int rx = lx < max_x ? lx + 1 : max_x;
+      int wx = (cx >> 8) & 0xFF;
+
+      uint32_t upper = lerp_pixel(top[lx], top[rx], wx);
+      uint32_t lower = lerp_pixel(bottom[lx], bottom[rx], wx);
+      out[x] = lerp_pixel(upper, lower, wy);
+    }
+  }
+}
+
+static void scale_band(void *arg, int y0, int y1) {
+  scale_job_t *job = arg;
+
+  if (job->filter == SCALE_BILINEAR) {
+    scale_rows_bilinear(job, y0, y1);
+  } else {
+    scale_rows_nearest(job, y0, y1);
+  }
+}
+
+void scale_into_pool(image_t *image, image_t *dest, int filter,
+                     worker_pool_t *pool, stats_t *stats) {
+  scale_job_t job;
+  uint64_t start = stats_begin(stats);
+
+  if (image->width > 0 && image->height > 0 && dest->width > 0 &&
+      dest->height > 0) {
+    scale_job_init(&job, image, dest, filter);
+    pool_run(pool, scale_band, &job, dest->height, dest->width * dest->height);
+    image_touch(dest);
+  }
+
+  stats_end(stats, STATS_SCALE, start);
+}
+
+// Without a context nothing is timed: these also run on loader threads.
+void scale_into(image_t *image, image_t *dest, int filter) {
+  scale_into_pool(image, dest, filter, NULL, NULL);
+}
+
+image_t *scale_filtered_alloc(image_t *image, int w, int h, int filter,
+                              allocator_t *allocator) {
+  image_t *new_image = image_create(w, h, allocator);
+
+  if (new_image != NULL) {
+    scale_into(image, new_image, filter);
+  }
+  return new_image;
+}
+
+image_t *scale_filtered(image_t *image, int w, int h, int filter) {
+  return scale_filtered_alloc(image, w, h, filter, NULL);
+}
+
+// We scale and crop the image to this new rect.
+image_t *scale(image_t *image, int w, int h) {
+  return scale_filtered(image, w, h, SCALE_NEAREST);
+}
+
+// !! This operation is potentially unsafe. Use drawImage. It's harder to mess
+// up. X and w are the size of the array.
+void draw_array(int x, int y, int w, int h, int *array, context_t *context) {
+  draw_array_stride(x, y, w, h, w, array, context);
+}
+
+// How blit_array combines source rows with the context.
+enum { BLIT_COPY, BLIT_BLEND, BLIT_BLEND_ALPHA };
+
+// One clipped blit, rows relative to the first visible one.
+typedef struct {
+  int *dst;
+  int dst_stride;
+  const int *src;
+  int src_stride;
+  int width;
+  int mode;
+  int alpha;
+} blit_job_t;
+
+static void blit_band(void *arg, int y0, int y1) {
+  blit_job_t *job = arg;
+
+  for (int row = y0; row < y1; row++) {
+    // Draw each graphics line.
+    int *dst = &job->dst[job->dst_stride * row];
+    const int *src = &job->src[job->src_stride * row];
+
+    switch (job->mode) {
+    case BLIT_COPY:
+      memcpy(dst, src, sizeof(int) * job->width);
+      break;
+    case BLIT_BLEND:
+      span_blend(dst, src, job->width);
+      break;
+    case BLIT_BLEND_ALPHA:
+      span_blend_alpha(dst, src, job->width, job->alpha);
+      break;
+    }
+  }
+}
+
+// Shared clipping for the draw_array family. Each visible row is copied or
+// composited depending on mode, alpha is only used by BLIT_BLEND_ALPHA.
+static void blit_clipped(int x, int y, int w, int h, int stride,
+                         const int *array, context_t *context, int mode,
+                         int alpha) {
+  rect_t rect = {x, y, w, h};
+
+  if (!context_clip_rect(context, &rect)) {
+    return;
+  }
+
+  // Column and row correction for partial onscreen images
+  int cx = rect.x - x;
+  int cy = rect.y - y;
+
+  context_damage(context, rect.x, rect.y, rect.w, rect.h);
+
+  blit_job_t job = {&context->data[context->stride * rect.y + rect.x],
+                    context->stride,
+                    &array[cy * stride] + cx,
+                    stride,
+                    rect.w,
+                    mode,
+                    alpha};
+  pool_run(context->pool, blit_band, &job, rect.h, rect.w * rect.h);
+}
+
+static void blit_array(int x, int y, int w, int h, int stride, const int *array,
+                       context_t *context, int mode, int alpha) {
+  uint64_t start = stats_begin(context->stats);
+  blit_clipped(x, y, w, h, stride, array, context, mode, alpha);
+  stats_end(context->stats, STATS_DRAW_ARRAY, start);
+}
+
+// Like draw_array, but rows of the array are `stride` ints apart.
+void draw_array_stride(int x, int y, int w, int h, int stride, int *array,
+                       context_t *context) {
+  blit_array(x, y, w, h, stride, array, context, BLIT_COPY, 255);
+}
+
+void draw_image(int x, int y, image_t *image, context_t *context) {
+  draw_array_stride(x, y, image->width, image->height, image->stride,
+                    image->data, context);
+}
+
+void draw_array_blend(int x, int y, int w, int h, int stride, int *array,
+                      context_t *context) {
+  blit_array(x, y, w, h, stride, array, context, BLIT_BLEND, 255);
+}
+
+void draw_image_blend(int x, int y, image_t *image, context_t *context) {
+  draw_array_blend(x, y, image->width, image->height, image->stride,
+                   image->data, context);
+}
+
+void draw_image_blend_alpha(int x, int y, image_t *image, int alpha,
+                            context_t *context) {
+  blit_array(x, y, image->width, image->height, image->stride, image->data,
+             context, BLIT_BLEND_ALPHA, alpha);
+}
+
+// Where pixel u, v of a w x h source turned by rotation comes from.
+static void rotate_source(int rotation, int w, int h, int u, int v, int *x,
+                          int *y) {
+  int dw = rotation & CONTEXT_ROTATE_90 ? h : w;
+  int dh = rotation & CONTEXT_ROTATE_90 ? w : h;
+
+  if (rotation & CONTEXT_REFLECT_X) {
+    u = dw - 1 - u;
+  }
+  if (rotation & CONTEXT_REFLECT_Y) {
+    v = dh - 1 - v;
+  }
+
+  switch (rotation & 3) {
+  case CONTEXT_ROTATE_0:
+    *x = u;
+    *y = v;
+    break;
+  case CONTEXT_ROTATE_90:
+    *x = w - 1 - v;
+    *y = u;
+    break;
+  case CONTEXT_ROTATE_180:
+    *x = w - 1 - u;
+    *y = h - 1 - v;
+    break;
+  case CONTEXT_ROTATE_270:
+    *x = v;
+    *y = h - 1 - u;
+    break;
+  }
+}
+
+// The other way round: where source pixel x, y ends up.
+static void rotate_dest(int rotation, int w, int h, int x, int y, int *u,
+                        int *v) {
+  int dw = rotation & CONTEXT_ROTATE_90 ? h : w;
+  int dh = rotation & CONTEXT_ROTATE_90 ? w : h;
+
+  switch (rotation & 3) {
+  case CONTEXT_ROTATE_0:
+    *u = x;
+    *v = y;
+    break;
+  case CONTEXT_ROTATE_90:
+    *u = y;
+    *v = w - 1 - x;
+    break;
+  case CONTEXT_ROTATE_180:
+    *u = w - 1 - x;
+    *v = h - 1 - y;
+    break;
+  case CONTEXT_ROTATE_270:
+    *u = h - 1 - y;
+    *v = x;
+    break;
+  }
+
+  if (rotation & CONTEXT_REFLECT_X) {
+    *u = dw - 1 - *u;
+  }
+  if (rotation & CONTEXT_REFLECT_Y) {
+    *v = dh - 1 - *v;
+  }
+}
+
+// Tiles are this many pixels square: a tile and the source it reads from fit
+// in L1 together.
+#define ROTATE_TILE 32
+
+// Rows of a turned rect. src is the pixel landing on the rect's top left,
+// step_u and step_v how far the source moves for one pixel right or down in
+// the rect. Without pack, dst holds XRGB8888 ints; with it the tiles are
+// converted on the way out.
+typedef struct {
+  uint8_t *dst;
+  int dst_stride; // in bytes
+  int bytes;
+  pixel_pack_fn pack;
+  const int *src;
+  int step_u;
+  int step_v;
+  int width;
+} rotate_job_t;
+
+static void rotate_job_init(rotate_job_t *job, int rotation, const int *src,
+                            int src_stride, int w, int h, int u, int v) {
+  int x0, y0, x1, y1, x2, y2;
+
+  // The mapping is affine, neighbours give the steps even past the edges.
+  rotate_source(rotation, w, h, u, v, &x0, &y0);
+  rotate_source(rotation, w, h, u + 1, v, &x1, &y1);
+  rotate_source(rotation, w, h, u, v + 1, &x2, &y2);
+  job->src = src + y0 * src_stride + x0;
+  job->step_u = (x1 - x0) + (y1 - y0) * src_stride;
+  job->step_v = (x2 - x0) + (y2 - y0) * src_stride;
+}
+
+// out[r * out_stride + c] = src[c * step_u + r * step_v]. One of the steps is
+// +-1: either rows are copied (flipped) or the tile is transposed with rows
+// walked up or down.
+static void rotate_tile(int *out, int out_stride, const int *src, int step_u,
+                        int step_v, int w, int h) {
+  if (step_u == 1) {
+    for (int r = 0; r < h; r++) {
+      memcpy(out + r * out_stride, src + r * step_v, sizeof(int) * w);
+    }
+  } else if (step_u == -1) {
+    for (int r = 0; r < h; r++) {
+      span_reverse(out + r * out_stride, src + r * step_v - (w - 1), w);
+    }
+  } else if (step_v == 1) {
+    span_transpose(out, out_stride, src, step_u, w, h);
+  } else {
+    span_transpose(out + (h - 1) * out_stride, -out_stride, src - (h - 1),
+                   step_u, w, h);
+  }
+}
+
+static void rotate_band(void *arg, int y0, int y1) {
+  rotate_job_t *job = arg;
+  int tile[ROTATE_TILE * ROTATE_TILE];
+
+  for (int v = y0; v < y1; v += ROTATE_TILE) {
+    int th = y1 - v < ROTATE_TILE ? y1 - v : ROTATE_TILE;
+
+    for (int u = 0; u < job->width; u += ROTATE_TILE) {
+      int tw = job->width - u < ROTATE_TILE ? job->width - u : ROTATE_TILE;
+      const int *src = job->src + u * job->step_u + v * job->step_v;
+      uint8_t *dst = job->dst + v * job->dst_stride + u * job->bytes;
+
+      if (job->pack == NULL) {
+        rotate_tile((int *)dst, job->dst_stride / (int)sizeof(int), src,
+                    job->step_u, job->step_v, tw, th);
+        continue;
+      }
+
+      rotate_tile(tile, ROTATE_TILE, src, job->step_u, job->step_v, tw, th);
+      for (int r = 0; r < th; r++) {
+        job->pack(dst + r * job->dst_stride, tile + r * ROTATE_TILE, tw);
+      }
+    }
+  }
+}
+
+void draw_array_rotated(int x, int y, int w, int h, int stride, int *array,
+                        int rotation, context_t *context) {
+  uint64_t start = stats_begin(context->stats);
+  int dw = rotation & CONTEXT_ROTATE_90 ? h : w;
+  int dh = rotation & CONTEXT_ROTATE_90 ? w : h;
+  rect_t rect = {x, y, dw, dh};
+
+  if (context_clip_rect(context, &rect)) {
+    rotate_job_t job = {
+        (uint8_t *)&context->data[context->stride * rect.y + rect.x],
+        context->stride * (int)sizeof(int),
+        sizeof(int),
+        NULL,
+        NULL,
+        0,
+        0,
+        rect.w};
+
+    rotate_job_init(&job, rotation, array, stride, w, h, rect.x - x,
+                    rect.y - y);
+    context_damage(context, rect.x, rect.y, rect.w, rect.h);
+    pool_run(context->pool, rotate_band, &job, rect.h, rect.w * rect.h);
+  }
+  stats_end(context->stats, STATS_DRAW_ARRAY, start);
+}
+
+void draw_image_rotated(int x, int y, image_t *image, int rotation,
+                        context_t *context) {
+  draw_array_rotated(x, y, image->width, image->height, image->stride,
+                     image->data, rotation, context);
+}
+
+void image_premultiply(image_t *image) {
+  for (int y = 0; y < image->height; y++) {
+    span_premultiply(&image->data[y * image->stride], image->width);
+  }
+  image_touch(image);
+}
+
+// A clipped solid fill, rows relative to the top of the rect.
+typedef struct {
+  int *dst;
+  int stride;
+  int width;
+  int color;
+  int full_rows;
+} fill_job_t;
+
+static void fill_band(void *arg, int y0, int y1) {
+  fill_job_t *job = arg;
+
+  // Whole rows are one contiguous span, padding included.
+  if (job->full_rows) {
+    span_fill(&job->dst[job->stride * y0], job->color,
+              job->stride * (y1 - y0 - 1) + job->width);
+    return;
+  }
+
+  // Fill every line from registers. Copying the first line down would read
+  // back from the framebuffer, which is uncached.
+  for (int row = y0; row < y1; row++) {
+    span_fill(&job->dst[job->stride * row], job->color, job->width);
+  }
+}
+
+static void fill_rect(int x, int y, int w, int h, context_t *context,
+                      int color) {
+  rect_t rect = {x, y, w, h};
+
+  if (!context_clip_rect(context, &rect)) {
+    return;
+  }
+
+  context_damage(context, rect.x, rect.y, rect.w, rect.h);
+
+  // Sub-contexts share rows with their parent, the padding isn't theirs.
+  fill_job_t job = {&context->data[context->stride * rect.y + rect.x],
+                    context->stride, rect.w, color,
+                    rect.x == 0 && rect.w == context->width &&
+                        context->parent == NULL};
+  pool_run(context->pool, fill_band, &job, rect.h, rect.w * rect.h);
+}
+
+void draw_rect(int x, int y, int w, int h, context_t *context, int color) {
+  uint64_t start = stats_begin(context->stats);
+  fill_rect(x, y, w, h, context, color);
+  stats_end(context->stats, STATS_DRAW_RECT, start);
+}
+
+void clear_context_color(context_t *context, int color) {
+  draw_rect(0, 0, context->width, context->height, context, color);
+}
+
+static void clear_band(void *arg, int y0, int y1) {
+  context_t *context = arg;
+  memset(&context->data[context->stride * y0], 0,
+         context->stride * (y1 - y0) * sizeof(int));
+}
+
+void clear_context(context_t *context) {
+  rect_t clip = context->clip;
+  uint64_t start = stats_begin(context->stats);
+
+  // Only a clip covering the whole context can memset entire rows.
+  if (clip.x == 0 && clip.y == 0 && clip.w == context->width &&
+      clip.h == context->height && context->parent == NULL) {
+    pool_run(context->pool, clear_band, context, context->height,
+             context->width * context->height);
+    context_damage(context, 0, 0, context->width, context->height);
+  } else {
+    fill_rect(clip.x, clip.y, clip.w, clip.h, context, 0);
+  }
+  stats_end(context->stats, STATS_CLEAR, start);
+}
+
+void test_pattern(context_t *context) {
+  const unsigned int pattern[8] = {0xFFFFFF, 0xFFFF00, 0x00FFFF, 0x00FF00,
+                                   0xFF00FF, 0xFF0000, 0x0000FF, 0x000000};
+
+  rect_t rect = {0, 0, context->width, context->height};
+
+  if (!context_clip_rect(context, &rect)) {
+    return;
+  }
+
+  int columnWidth = context->width / 8;
+  for (int y = rect.y; y < rect.y + rect.h; y++) {
+    int *row = &context->data[context->stride * y];
+    for (int column = 0; column < 8; column++) {
+      // The last column takes up the remainder.
+      int x0 = column * columnWidth;
+      int x1 = column == 7 ? context->width : x0 + columnWidth;
+      if (x0 < rect.x) {
+        x0 = rect.x;
+      }
+      if (x1 > rect.x + rect.w) {
+        x1 = rect.x + rect.w;
+      }
+      if (x0 < x1) {
+        span_fill(row + x0, pattern[column], x1 - x0);
+      }
+    }
+  }
+  context_damage(context, rect.x, rect.y, rect.w, rect.h);
+}
+
+int context_set_threads(context_t *context, int threads, int threshold) {
+  pool_free(context->pool);
+  context->pool = NULL;
+
+  if (threads > 1) {
+    context->pool = pool_create(threads, threshold);
+    if (context->pool == NULL) {
+      return -ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+void context_set_clip(context_t *context, int x, int y, int w, int h) {
+  rect_t clip = {x, y, w, h};
+
+  context_reset_clip(context);
+  if (!context_clip_rect(context, &clip)) {
+    clip.w = 0;
+    clip.h = 0;
+  }
+  context->clip = clip;
+}
+
+void context_reset_clip(context_t *context) {
+  context->clip = context->clip_limit;
+}
+
+// The clip of a fresh context: all of it, nothing pushed.
+static void context_init_clip(context_t *context) {
+  context->clip_limit = (rect_t){0, 0, context->width, context->height};
+  context->clip_depth = 0;
+  context_reset_clip(context);
+}
+
+int context_push_clip(context_t *context, int x, int y, int w, int h) {
+  rect_t clip = {x, y, w, h};
+
+  if (context->clip_depth == CONTEXT_CLIP_DEPTH) {
+    return -ENOSPC;
+  }
+
+  rect_t *saved = &context->clip_stack[2 * context->clip_depth++];
+  saved[0] = context->clip;
+  saved[1] = context->clip_limit;
+
+  if (!context_clip_rect(context, &clip)) {
+    clip.w = 0;
+    clip.h = 0;
+  }
+  context->clip = clip;
+  context->clip_limit = clip;
+  return 0;
+}
+
+void context_pop_clip(context_t *context) {
+  if (context->clip_depth == 0) {
+    return;
+  }
+
+  rect_t *saved = &context->clip_stack[2 * --context->clip_depth];
+  context->clip = saved[0];
+  context->clip_limit = saved[1];
+}
+
+int context_clip_rect(const context_t *context, rect_t *rect) {
+  const rect_t *clip = &context->clip;
+  int x0 = rect->x > clip->x ? rect->x : clip->x;
+  int y0 = rect->y > clip->y ? rect->y : clip->y;
+  int x1 = rect->x + rect->w < clip->x + clip->w ? rect->x + rect->w
+                                                 : clip->x + clip->w;
+  int y1 = rect->y + rect->h < clip->y + clip->h ? rect->y + rect->h
+                                                 : clip->y + clip->h;
+
+  if (x0 >= x1 || y0 >= y1) {
+    return 0;
+  }
+
+  *rect = (rect_t){x0, y0, x1 - x0, y1 - y0};
+  return 1;
+}
+
+context_t context_sub(context_t *parent, int x, int y, int w, int h) {
+  context_t sub = *parent;
+  rect_t area = {x, y, w, h};
+
+  // What the parent lets us draw, in our coordinates.
+  if (!context_clip_rect(parent, &area)) {
+    area = (rect_t){x, y, 0, 0};
+  }
+  area.x -= x;
+  area.y -= y;
+
+  // Only ever dereferenced inside the clip, which lies within the parent.
+  sub.data = parent->data + (ptrdiff_t)y * parent->stride + x;
+  sub.width = w > 0 ? w : 0;
+  sub.height = h > 0 ? h : 0;
+  sub.clip = area;
+  sub.clip_limit = area;
+  sub.clip_depth = 0;
+  sub.parent = parent;
+  sub.origin_x = x;
+  sub.origin_y = y;
+
+  // Nothing to present or flip.
+  sub.dev = NULL;
+  sub.memory = NULL;
+  sub.fb_file_desc = -1;
+  damage_clear(&sub.damage);
+  return sub;
+}
+
+void context_sub_end(context_t *sub) {
+  damage_t *damage = &sub->damage;
+
+  for (int i = 0; i < damage->count; i++) {
+    rect_t rect = damage->rects[i];
+    damage_add(&sub->parent->damage, rect.x + sub->origin_x,
+               rect.y + sub->origin_y, rect.w, rect.h);
+  }
+  damage_clear(damage);
+}
+
+void context_damage(context_t *context, int x, int y, int w, int h) {
+  if (context->stats != NULL) {
+    context->stats->bytes_frame += (uint64_t)w * h * sizeof(int);
+  }
+  if (context->shadow != NULL) {
+    damage_add(&context->damage, x, y, w, h);
+  }
+}
+
+int context_enable_stats(context_t *context) {
+  if (context->stats == NULL) {
+    context->stats = malloc(sizeof(stats_t));
+    if (context->stats == NULL) {
+      return -ENOMEM;
+    }
+    stats_reset(context->stats);
+  }
+  return 0;
+}
+
+const stats_t *context_get_stats(context_t *context) { return context->stats; }
+
+int context_enable_allocators(context_t *context, size_t budget) {
+  if (context->allocator == NULL) {
+    context->allocator = allocator_create_pool(
+        budget > 0 ? budget : CONTEXT_DEFAULT_POOL_BUDGET);
+  }
+  if (context->frame == NULL) {
+    context->frame = allocator_create_arena(0);
+  }
+  return context->allocator != NULL && context->frame != NULL ? 0 : -ENOMEM;
+}
+
+void context_reset_stats(context_t *context) {
+  if (context->stats != NULL) {
+    stats_reset(context->stats);
+  }
+}
+
+int context_enable_shadow(context_t *context) {
+  // Offscreen contexts draw into cached memory already.
+  if (context->shadow != NULL || context->dev == NULL) {
+    return 0;
+  }
+
+  context->shadow = malloc(sizeof(int) * context->width * context->height);
+  if (context->shadow == NULL) {
+    return -ENOMEM;
+  }
+
+  // Start from whatever is in the back buffer. This is the only time we read
+  // back from a scanout buffer. The shadow itself is tightly packed.
+  struct drmmodeset_buf *buf = &context->dev->bufs[context->dev->back_buf];
+  const pixel_format_t *format = pixel_format(context->format);
+  for (int y = 0; y < context->height; y++) {
+    format->unpack(&context->shadow[context->width * y],
+                   buf->map + buf->stride * y, context->width);
+  }
+  context->data = context->shadow;
+  context->stride = context->width;
+
+  // Every buffer may differ from the shadow, so the first presents copy it all.
+  // So does the first capture.
+  damage_clear(&context->damage);
+  for (int i = 0; i < CONTEXT_MAX_BUFFERS; i++) {
+    damage_clear(&context->buffer_damage[i]);
+    damage_add(&context->buffer_damage[i], 0, 0, context->width,
+               context->height);
+  }
+  damage_clear(&context->capture_damage);
+  damage_add(&context->capture_damage, 0, 0, context->width, context->height);
+
+  return 0;
+}
+
+// Black out the shadow and have the next presents copy all of it.
+static void context_clear_shadow(context_t *context) {
+  memset(context->shadow, 0, sizeof(int) * context->width * context->height);
+  damage_clear(&context->damage);
+  for (int i = 0; i < CONTEXT_MAX_BUFFERS; i++) {
+    damage_clear(&context->buffer_damage[i]);
+    damage_add(&context->buffer_damage[i], 0, 0, context->width,
+               context->height);
+  }
+  damage_clear(&context->capture_damage);
+  damage_add(&context->capture_damage, 0, 0, context->width, context->height);
+}
+
+int context_set_rotation(context_t *context, int rotation) {
+  struct drmmodeset_dev *dev = context->dev;
+  int ret;
+
+  if (dev == NULL || (rotation & ~(3 | CONTEXT_REFLECT_X | CONTEXT_REFLECT_Y))) {
+    return -EINVAL;
+  }
+
+  // Back to the screen's own orientation first. The display undoes its
+  // rotation, a shadow turned in software gets the screen's size again.
+  if (dev->rotation != 0 && dev->rotation != DRM_MODE_ROTATE_0) {
+    drmmodeset_set_rotation(dev, DRM_MODE_ROTATE_0);
+  }
+  if (context->rotate_shadow) {
+    context->width = dev->width;
+    context->height = dev->height;
+    context->stride = context->width;
+    context->rotate_shadow = 0;
+    context_clear_shadow(context);
+  }
+  context->rotation = rotation;
+  context_init_clip(context);
+  if (rotation == CONTEXT_ROTATE_0) {
+    return 0;
+  }
+
+  // The display keeps the buffer's size, so it can't take 90 and 270 degrees.
+  if (!(rotation & CONTEXT_ROTATE_90)) {
+    uint64_t drm = DRM_MODE_ROTATE_0 << (rotation & 3);
+
+    if (rotation & CONTEXT_REFLECT_X) {
+      drm |= DRM_MODE_REFLECT_X;
+    }
+    if (rotation & CONTEXT_REFLECT_Y) {
+      drm |= DRM_MODE_REFLECT_Y;
+    }
+    if (drmmodeset_set_rotation(dev, drm) == 0) {
+      return 0;
+    }
+  }
+
+  ret = context_enable_shadow(context);
+  if (ret) {
+    context->rotation = CONTEXT_ROTATE_0;
+    return ret;
+  }
+
+  // The shadow holds the drawing, tightly packed, and is turned on present.
+  context->rotate_shadow = 1;
+  context->width = rotation & CONTEXT_ROTATE_90 ? dev->height : dev->width;
+  context->height = rotation & CONTEXT_ROTATE_90 ? dev->width : dev->height;
+  context->stride = context->width;
+  context_init_clip(context);
+  context_clear_shadow(context);
+  return 0;
+}
+
+// Rows of the shadow converted into the framebuffer's format.
+typedef struct {
+  uint8_t *dst;
+  int dst_stride; // in bytes
+  const int *src;
+  int src_stride;
+  int width;
+  pixel_pack_fn pack;
+} pack_job_t;
+
+static void pack_band(void *arg, int y0, int y1) {
+  pack_job_t *job = arg;
+
+  for (int row = y0; row < y1; row++) {
+    job->pack(job->dst + job->dst_stride * row,
+              job->src + job->src_stride * row, job->width);
+  }
+}
+
+// Turn rect of the shadow onto the screen, where it may land anywhere.
+static void context_flush_rotated(context_t *context,
+                                  struct drmmodeset_buf *buf, rect_t rect) {
+  const pixel_format_t *format = pixel_format(context->format);
+  int bytes = format->bpp / 8;
+  int u0, v0, u1, v1;
+
+  rotate_dest(context->rotation, context->width, context->height, rect.x,
+              rect.y, &u0, &v0);
+  rotate_dest(context->rotation, context->width, context->height,
+              rect.x + rect.w - 1, rect.y + rect.h - 1, &u1, &v1);
+
+  rect_t screen = {u0 < u1 ? u0 : u1, v0 < v1 ? v0 : v1,
+                   (u0 < u1 ? u1 - u0 : u0 - u1) + 1,
+                   (v0 < v1 ? v1 - v0 : v0 - v1) + 1};
+  rotate_job_t job = {buf->map + buf->stride * screen.y + bytes * screen.x,
+                      buf->stride,
+                      bytes,
+                      format->pack,
+                      NULL,
+                      0,
+                      0,
+                      screen.w};
+
+  rotate_job_init(&job, context->rotation, context->shadow, context->stride,
+                  context->width, context->height, screen.x, screen.y);
+  pool_run(context->pool, rotate_band, &job, screen.h, screen.w * screen.h);
+}
+
+// Copy the parts of the shadow buffer that changed since the back buffer was
+// last written into it, converting them to the framebuffer's format. This
+// frame's damage is owed to every buffer; the back buffer additionally owes
+// whatever changed while the others were on screen.
+static void context_flush_shadow(context_t *context,
+                                 struct drmmodeset_dev *dev) {
+  struct drmmodeset_buf *buf = &dev->bufs[dev->back_buf];
+  damage_t *damage = &context->buffer_damage[dev->back_buf];
+  const pixel_format_t *format = pixel_format(context->format);
+  int bytes = format->bpp / 8;
+
+  for (unsigned int i = 0; i < dev->buf_count; i++) {
+    damage_merge(&context->buffer_damage[i], &context->damage);
+  }
+  damage_merge(&context->capture_damage, &context->damage);
+  damage_clear(&context->damage);
+
+  if (context->stats != NULL) {
+    context->stats->bytes_scanout = 0;
+  }
+
+  for (int i = 0; i < damage->count; i++) {
+    rect_t rect = damage->rects[i];
+
+    // Trim the rect to the screen, callers may report anything.
+    if (rect.x < 0) {
+      rect.w += rect.x;
+      rect.x = 0;
+    }
+    if (rect.y < 0) {
+      rect.h += rect.y;
+      rect.y = 0;
+    }
+    if (rect.x + rect.w > context->width) {
+      rect.w = context->width - rect.x;
+    }
+    if (rect.y + rect.h > context->height) {
+      rect.h = context->height - rect.y;
+    }
+    if (rect.w <= 0 || rect.h <= 0) {
+      continue;
+    }
+
+    if (context->rotate_shadow) {
+      context_flush_rotated(context, buf, rect);
+    } else {
+      pack_job_t job = {buf->map + buf->stride * rect.y + bytes * rect.x,
+                        buf->stride,
+                        &context->shadow[context->stride * rect.y + rect.x],
+                        context->stride,
+                        rect.w,
+                        format->pack};
+      pool_run(context->pool, pack_band, &job, rect.h, rect.w * rect.h);
+    }
+
+    if (context->stats != NULL) {
+      context->stats->bytes_scanout += (uint64_t)rect.w * rect.h * bytes;
+    }
+  }
+  damage_clear(damage);
+}
+
+void context_release(context_t *context) {
+  if (context->dev != NULL) {
+    printf("fb: %d\n", context->fb_file_desc);
+    drmmodeset_cleanup(context->dev);
+  }
+  free(context->memory);
+  context->memory = NULL;
+  pool_free(context->pool);
+  context->pool = NULL;
+  free(context->stats);
+  context->stats = NULL;
+  free(context->shadow);
+  context->shadow = NULL;
+  allocator_free(context->allocator);
+  context->allocator = NULL;
+  allocator_free(context->frame);
+  context->frame = NULL;
+  context->data = NULL;
+  context->dev = NULL;
+  context->fb_file_desc = 0;
+  free(context);
+}
+
+context_t *context_create() { return context_create_buffered(1); }
+
+// Everything before and after the flip of one context.
+static void context_present_begin(context_t *context) {
+  if (context->shadow != NULL) {
+    // With two buffers the back one stays on screen until the last flip is
+    // done, flushing into it earlier would tear. A failed wait shows up again
+    // when we flip.
+    if (context->dev->buf_count == 2) {
+      drmmodeset_wait_flip(context->dev);
+    }
+    context_flush_shadow(context, context->dev);
+  }
+}
+
+static void context_present_end(context_t *context, int flipped) {
+  struct drmmodeset_dev *dev = context->dev;
+
+  // In shadow mode we keep drawing into the shadow, the flip only changes
+  // which buffer the next flush lands in.
+  if (dev != NULL && flipped && context->shadow == NULL) {
+    context->data = (int *)dev->bufs[dev->back_buf].map;
+    context->stride = dev->bufs[dev->back_buf].stride / sizeof(int);
+  }
+
+  if (context->stats != NULL) {
+    if (dev != NULL) {
+      context->stats->vblank_misses += dev->vblank_misses;
+    }
+    stats_frame(context->stats, stats_now());
+  }
+  if (dev != NULL) {
+    dev->vblank_misses = 0;
+  }
+
+  // The frame is out, its scratch images can go.
+  allocator_reset(context->frame);
+}
+
+static int *context_present_block(context_t *context, bool block) {
+  // Offscreen frames are done as soon as they are drawn.
+  if (context->dev == NULL) {
+    context_present_end(context, 0);
+    return context->data;
+  }
+
+  context_present_begin(context);
+  context_present_end(context,
+                      drmmodeset_page_flip(context->dev, block) == 0);
+  return context->data;
+}
+
+int context_present_all(context_t **contexts, int count) {
+  struct drmmodeset_dev *devs[count > 0 ? count : 1];
+  int results[count > 0 ? count : 1];
+  int n = 0, ret;
+
+  for (int i = 0; i < count; i++) {
+    context_present_begin(contexts[i]);
+    if (contexts[i]->dev != NULL) {
+      devs[n++] = contexts[i]->dev;
+    }
+  }
+
+  ret = drmmodeset_page_flip_all(devs, n, true, results);
+
+  // Every output by how its own flip went, devs are in contexts' order.
+  n = 0;
+  for (int i = 0; i < count; i++) {
+    int flipped = 0;
+    if (contexts[i]->dev != NULL) {
+      flipped = results[n++] == 0;
+    }
+    context_present_end(contexts[i], flipped);
+  }
+  return ret;
+}
+
+int *context_present(context_t *context) {
+  return context_present_block(context, true);
+}
+
+int *context_present_async(context_t *context) {
+  return context_present_block(context, false);
+}
+
+int context_event_fd(context_t *context) {
+  return context->dev != NULL ? context->dev->dri : -1;
+}
+
+int context_flip_pending(context_t *context) {
+  return context->dev != NULL && context->dev->pflip_pending;
+}
+
+int context_dispatch(context_t *context) {
+  if (context->dev == NULL) {
+    return 0;
+  }
+  return drmmodeset_handle_events(context->dev->dri);
+}
+
+// Plane types of context_plane_acquire, in DRM_PLANE_TYPE_* terms.
+static int context_plane_drm_type(int type) {
+  return type == CONTEXT_PLANE_CURSOR ? DRM_PLANE_TYPE_CURSOR
+                                      : DRM_PLANE_TYPE_OVERLAY;
+}
+
+int context_plane_count(context_t *context, int type) {
+  int count = 0;
+
+  if (context->dev == NULL) {
+    return 0;
+  }
+  while (drmmodeset_find_plane(context->dev, context_plane_drm_type(type),
+                               DRM_FORMAT_ARGB8888, count) != 0) {
+    count++;
+  }
+  return count;
+}
+
+context_plane_t *context_plane_acquire(context_t *context, int type) {
+  return context_plane_acquire_format(context, type, DRM_FORMAT_ARGB8888);
+}
+
+context_plane_t *context_plane_acquire_format(context_t *context, int type,
+                                              uint32_t fourcc) {
+  if (context->dev == NULL) {
+    return NULL;
+  }
+
+  uint32_t id = drmmodeset_find_plane(
+      context->dev, context_plane_drm_type(type), fourcc, 0);
+  if (id == 0) {
+    return NULL;
+  }
+
+  context_plane_t *plane = malloc(sizeof(context_plane_t));
+  if (plane == NULL) {
+    return NULL;
+  }
+  memset(plane, 0, sizeof(*plane));
+  if (context->dev->atomic &&
+      drmmodeset_plane_props(context->dev->dri, id, &plane->props)) {
+    free(plane);
+    return NULL;
+  }
+  plane->dev = context->dev;
+  plane->id = id;
+  plane->type = type;
+  plane->next = context->dev->planes;
+  context->dev->planes = plane;
+  return plane;
+}
+
+void context_plane_release(context_plane_t *plane) {
+  if (plane != NULL) {
+    drmmodeset_plane_free(plane);
+  }
+}
+
+image_t context_plane_buffer(context_plane_t *plane, int width, int height) {
+  image_t image = {NULL, 0, 0, 0, NULL, 0};
+
+  if (width <= 0 || height <= 0) {
+    return image;
+  }
+
+  if (!plane->has_buf || plane->width != (uint32_t)width ||
+      plane->height != (uint32_t)height) {
+    struct drmmodeset_buf buf;
+
+    if (drmmodeset_create_buf(plane->dev->dri, width, height,
+                              DRM_FORMAT_ARGB8888, 32, true, &buf)) {
+      return image;
+    }
+
+    // Scan out the new buffer before the old one goes away. Atomic planes
+    // would only change with the next frame's commit, while the old buffer
+    // is still on screen, so they commit right away.
+    struct drmmodeset_buf old = plane->buf;
+    bool had_buf = plane->has_buf;
+    plane->buf = buf;
+    plane->width = width;
+    plane->height = height;
+    plane->has_buf = true;
+    // Back from an imported framebuffer, set_fb freed our own buffer. Only
+    // now that we have a new one can we let go of it.
+    plane->fb = NULL;
+    plane->src_x = 0;
+    plane->src_y = 0;
+    plane->src_w = width;
+    plane->src_h = height;
+    if (plane->visible) {
+      drmmodeset_plane_update(plane);
+    }
+    if (plane->dev->atomic && plane->dirty) {
+      drmmodeset_atomic_commit_plane(plane);
+    }
+    if (had_buf) {
+      drmmodeset_destroy_buf(plane->dev->dri, &old);
+    }
+  }
+
+  image.data = (int *)plane->buf.map;
+  image.width = plane->width;
+  image.height = plane->height;
+  image.stride = plane->buf.stride / sizeof(int);
+  return image;
+}
+
+int context_plane_set_image(context_plane_t *plane, image_t *image) {
+  image_t buf = context_plane_buffer(plane, image->width, image->height);
+
+  if (buf.data == NULL) {
+    return -ENOMEM;
+  }
+  for (int y = 0; y < image->height; y++) {
+    memcpy(&buf.data[y * buf.stride], &image->data[y * image->stride],
+           sizeof(int) * image->width);
+  }
+  return 0;
+}
+
+int context_plane_set_source(context_plane_t *plane, int x, int y, int w,
+                             int h) {
+  if (!drmmodeset_plane_fb(plane) || x < 0 || y < 0 || w <= 0 || h <= 0 ||
+      x + w > (int)plane->width || y + h > (int)plane->height) {
+    return -EINVAL;
+  }
+
+  plane->src_x = x;
+  plane->src_y = y;
+  plane->src_w = w;
+  plane->src_h = h;
+  return plane->visible ? drmmodeset_plane_update(plane) : 0;
+}
+
+int context_plane_show(context_plane_t *plane, int x, int y, int w, int h) {
+  if (!drmmodeset_plane_fb(plane) || w <= 0 || h <= 0) {
+    return -EINVAL;
+  }
+
+  plane->crtc_x = x;
+  plane->crtc_y = y;
+  plane->crtc_w = w;
+  plane->crtc_h = h;
+  plane->visible = true;
+  return drmmodeset_plane_update(plane);
+}
+
+int context_plane_hide(context_plane_t *plane) {
+  if (!plane->visible) {
+    return 0;
+  }
+
+  plane->visible = false;
+  return drmmodeset_plane_update(plane);
+}
+
+context_fb_t *context_fb_import(context_t *context,
+                                const context_dmabuf_t *dmabuf) {
+  uint32_t handles[4] = {0, 0, 0, 0};
+  uint32_t pitches[4] = {0, 0, 0, 0};
+  uint32_t offsets[4] = {0, 0, 0, 0};
+  uint64_t modifiers[4] = {0, 0, 0, 0};
+  context_fb_t *fb;
+  int fd, ret = 0;
+
+  if (context->dev == NULL || dmabuf->planes < 1 ||
+      dmabuf->planes > CONTEXT_DMABUF_MAX_PLANES || dmabuf->width <= 0 ||
+      dmabuf->height <= 0) {
+    return NULL;
+  }
+
+  fb = malloc(sizeof(*fb));
+  if (fb == NULL) {
+    return NULL;
+  }
+  fd = context->dev->dri;
+
+  // One GEM handle per plane. Planes sharing an fd get the same handle back.
+  for (int i = 0; i < dmabuf->planes; i++) {
+    if (drmPrimeFDToHandle(fd, dmabuf->fd[i], &handles[i])) {
+      fprintf(stderr, "cannot import dma-buf %d (%d): %m\n", dmabuf->fd[i],
+              errno);
+      ret = -errno;
+      break;
+    }
+    pitches[i] = dmabuf->pitch[i];
+    offsets[i] = dmabuf->offset[i];
+    modifiers[i] = dmabuf->modifier;
+  }
+
+  if (ret == 0) {
+    if (dmabuf->modifier != DRM_FORMAT_MOD_LINEAR)
+      ret = drmModeAddFB2WithModifiers(fd, dmabuf->width, dmabuf->height,
+                                       dmabuf->fourcc, handles, pitches,
+                                       offsets, modifiers, &fb->id,
+                                       DRM_MODE_FB_MODIFIERS);
+    else
+      ret = drmModeAddFB2(fd, dmabuf->width, dmabuf->height, dmabuf->fourcc,
+                          handles, pitches, offsets, &fb->id, 0);
+    if (ret)
+      fprintf(stderr, "cannot create framebuffer from dma-buf (%d): %m\n",
+              errno);
+  }
+
+  // The framebuffer keeps the buffers alive, the handles can go.
+  for (int i = 0; i < dmabuf->planes; i++) {
+    bool seen = handles[i] == 0;
+    for (int j = 0; j < i && !seen; j++) {
+      seen = handles[j] == handles[i];
+    }
+    if (!seen) {
+      drmCloseBufferHandle(fd, handles[i]);
+    }
+  }
+
+  if (ret) {
+    free(fb);
+    return NULL;
+  }
+
+  fb->dev = context->dev;
+  fb->width = dmabuf->width;
+  fb->height = dmabuf->height;
+  return fb;
+}
+
+void context_fb_release(context_fb_t *fb) {
+  if (fb == NULL) {
+    return;
+  }
+
+  // Nothing may scan out a framebuffer that is gone.
+  for (struct context_plane *plane = fb->dev->planes; plane;
+       plane = plane->next) {
+    if (plane->fb != fb) {
+      continue;
+    }
+    plane->visible = false;
+    if (plane->dev->atomic)
+      drmmodeset_atomic_commit_plane(plane);
+    else
+      drmmodeset_plane_update(plane);
+    plane->fb = NULL;
+  }
+
+  drmModeRmFB(fb->dev->dri, fb->id);
+  free(fb);
+}
+
+int context_plane_set_fb(context_plane_t *plane, context_fb_t *fb) {
+  if (fb == NULL || fb->dev != plane->dev) {
+    return -EINVAL;
+  }
+
+  // Scan out fb before the own buffer goes away. On atomic devices that
+  // takes a commit of its own, the next frame's comes too late.
+  plane->fb = fb;
+  plane->width = fb->width;
+  plane->height = fb->height;
+  plane->src_x = 0;
+  plane->src_y = 0;
+  plane->src_w = fb->width;
+  plane->src_h = fb->height;
+  int ret = plane->visible ? drmmodeset_plane_update(plane) : 0;
+  if (ret == 0 && plane->dev->atomic && plane->dirty && plane->has_buf) {
+    ret = drmmodeset_atomic_commit_plane(plane);
+  }
+
+  if (plane->has_buf) {
+    drmmodeset_destroy_buf(plane->dev->dri, &plane->buf);
+    plane->has_buf = false;
+  }
+  return ret;
+}
+
+static int context_export_buf(int fd, struct drmmodeset_buf *buf, int width,
+                              int height, uint32_t fourcc,
+                              context_dmabuf_t *dmabuf) {
+  int prime;
+
+  if (drmPrimeHandleToFD(fd, buf->handle, DRM_CLOEXEC | DRM_RDWR, &prime)) {
+    fprintf(stderr, "cannot export dumb buffer (%d): %m\n", errno);
+    return -errno;
+  }
+
+  memset(dmabuf, 0, sizeof(*dmabuf));
+  dmabuf->width = width;
+  dmabuf->height = height;
+  dmabuf->fourcc = fourcc;
+  dmabuf->modifier = DRM_FORMAT_MOD_LINEAR;
+  dmabuf->planes = 1;
+  dmabuf->fd[0] = prime;
+  dmabuf->pitch[0] = buf->stride;
+  for (int i = 1; i < CONTEXT_DMABUF_MAX_PLANES; i++) {
+    dmabuf->fd[i] = -1;
+  }
+  return 0;
+}
+
+int context_export_dmabuf(context_t *context, int buffer,
+                          context_dmabuf_t *dmabuf) {
+  if (context->dev == NULL || buffer < 0 ||
+      buffer >= (int)context->dev->buf_count) {
+    return -EINVAL;
+  }
+
+  // The buffer keeps the mode's size, the context's may be rotated.
+  return context_export_buf(context->dev->dri, &context->dev->bufs[buffer],
+                            context->dev->width, context->dev->height,
+                            pixel_format(context->format)->fourcc, dmabuf);
+}
+
+int context_plane_export_dmabuf(context_plane_t *plane,
+                                context_dmabuf_t *dmabuf) {
+  if (!plane->has_buf || plane->fb != NULL) {
+    return -EINVAL;
+  }
+
+  return context_export_buf(plane->dev->dri, &plane->buf, plane->width,
+                            plane->height, DRM_FORMAT_ARGB8888, dmabuf);
+}
+
+context_t *context_create_buffered(int buffers) {
+  return context_create_format(buffers, PIXEL_XRGB8888);
+}
+
+context_t *context_create_format(int buffers, int format) {
+  context_t *context = NULL;
+
+  if (context_create_outputs_format(&context, 1, buffers, format) != 1)
+    return NULL;
+
+  return context;
+}
+
+context_t *context_create_offscreen(int width, int height) {
+  if (width <= 0 || height <= 0) {
+    return NULL;
+  }
+
+  context_t *context = malloc(sizeof(context_t));
+  if (context == NULL) {
+    return NULL;
+  }
+  memset(context, 0, sizeof(*context));
+
+  context->memory = calloc((size_t)width * height, sizeof(int));
+  if (context->memory == NULL) {
+    free(context);
+    return NULL;
+  }
+
+  context->data = context->memory;
+  context->width = width;
+  context->height = height;
+  context->stride = width;
+  context->buffer_count = 1;
+  context->fb_file_desc = -1;
+  context->fb_name = "offscreen";
+  context_init_clip(context);
+  return context;
+}
+
+// Wrap a prepared device in a context. The mode is already set. Returns NULL
+// without memory.
+static context_t *context_from_dev(struct drmmodeset_dev *dev,
+                                   const char *card) {
+  context_t *context = malloc(sizeof(context_t));
+  if (context == NULL) {
+    return NULL;
+  }
+  memset(context, 0, sizeof(*context));
+  context->data = (int *)dev->bufs[dev->back_buf].map;
+  context->width = dev->width;
+  context->height = dev->height;
+  context->stride = dev->bufs[dev->back_buf].stride / sizeof(int);
+  context->buffer_count = dev->buf_count;
+  context->fb_file_desc = dev->dri;
+  context->fb_name = card;
+  context->dev = dev;
+  context->connector = dev->conn;
+  context->refresh = dev->mode.vrefresh;
+  context->format = dev->format;
+  context_init_clip(context);
+
+  // We only draw 32-bit pixels, other formats need a shadow to convert from.
+  if (context->format != PIXEL_XRGB8888 && context_enable_shadow(context)) {
+    free(context);
+    return NULL;
+  }
+  return context;
+}
+
+int context_create_outputs(context_t **contexts, int max, int buffers) {
+  return context_create_outputs_format(contexts, max, buffers,
+                                       PIXEL_XRGB8888);
+}
+
+int context_create_outputs_format(context_t **contexts, int max, int buffers,
+                                  int format) {
+  return context_create_outputs_flags(contexts, max, buffers, format, 0);
+}
+
+static double startup_ms(uint64_t ns) { return ns / 1e6; }
+
+int context_create_outputs_flags(context_t **contexts, int max, int buffers,
+                                 int format, int flags) {
   //     char *FB_NAME = "/dev/fb0";
   //     void* mapped_ptr = NULL;
   //     struct fb_fix_screeninfo fb_fixinfo;
@@ -976,59 +3574,134 @@ context_t *context_create() {
   //     context->fb_file_desc = fb_file_desc;
   //     context->fb_name = FB_NAME;
   //    return context;
-  int ret, fd;
+  struct drmmodeset_dev *devs[max > 0 ? max : 1];
+  struct drmmodeset_probe probes[max > 0 ? max : 1];
+  context_startup_t startup = {0};
+  char cached_card[DRMMODESET_PROBE_CARD];
+  int ret, fd, count, i, n = 0, cached = 0;
+  uint64_t start, now;
   const char *card;
-  struct drmmodeset_dev *iter;
+  bool atomic;
 
-  /* check which DRM device to open */
+  if (max <= 0)
+    return 0;
+  if (pixel_format(format) == NULL)
+    return -EINVAL;
+  start = stats_now();
+
+  /* check which DRM device to open, the cache knows which one worked */
   card = "/dev/dri/card0";
+  if (flags & CONTEXT_START_PROBE_CACHE) {
+    cached = drmmodeset_probe_load(CONTEXT_PROBE_CACHE_PATH, cached_card,
+                                   sizeof(cached_card), probes, max);
+    if (cached > 0)
+      card = cached_card;
+  }
 
+retry:
   fprintf(stderr, "using card '%s'\n", card);
 
   /* open the DRM device */
   ret = drmmodeset_open(&fd, card);
+  if (ret && cached > 0) {
+    cached = 0;
+    card = "/dev/dri/card0";
+    ret = drmmodeset_open(&fd, card);
+  }
   if (ret) {
     card = "/dev/dri/card1"; // fallback
     ret = drmmodeset_open(&fd, card);
     if (ret)
       goto out_return;
   }
-
-  /* prepare all connectors and CRTCs */
-  ret = drmmodeset_prepare(fd);
-  if (ret) {
+  now = stats_now();
+  startup.open_ns = now - start;
+
+  /* prefer atomic commits when the driver offers them */
+  atomic = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+
+  /* prepare all connectors and CRTCs, from the cache when it still holds */
+  count = -ENOENT;
+  if (cached > 0) {
+    count = drmmodeset_prepare_cached(fd, buffers, format,
+                                      !(flags & CONTEXT_START_NO_CLEAR), probes,
+                                      cached, devs);
+    startup.cached = count > 0;
+  }
+  if (count <= 0)
+    count = drmmodeset_prepare(fd, buffers, format,
+                               !(flags & CONTEXT_START_NO_CLEAR), devs, max);
+  ret = count;
+  if (count <= 0) {
     close(fd);
+    ret = count ? count : -ENOENT;
     goto out_return;
   }
+  for (i = 0; i < count; ++i)
+    startup.buffers_ns += devs[i]->buffers_ns;
+  startup.probe_ns = stats_now() - now - startup.buffers_ns;
+  now = stats_now();
 
   /* perform actual modesetting on each found connector+CRTC */
-  drmmodeset_con->saved_crtc = drmModeGetCrtc(fd, drmmodeset_con->crtc);
-  ret = drmModeSetCrtc(fd, drmmodeset_con->crtc, drmmodeset_con->fb, 0, 0,
-                       &drmmodeset_con->conn, 1, &drmmodeset_con->mode);
-  if (ret)
-    fprintf(stderr, "cannot set CRTC for connector %u (%d): %m\n",
-            drmmodeset_con->conn, errno);
+  for (i = 0; i < count; ++i) {
+    if (atomic)
+      drmmodeset_atomic_init(devs[i]);
+    if ((!(flags & CONTEXT_START_KEEP_MODE) || drmmodeset_keep_crtc(devs[i])) &&
+        drmmodeset_set_crtc(devs[i])) {
+      drmmodeset_cleanup(devs[i]);
+      continue;
+    }
+    contexts[n] = context_from_dev(devs[i], card);
+    if (contexts[n] == NULL) {
+      drmmodeset_cleanup(devs[i]);
+      continue;
+    }
+    devs[n++] = devs[i];
+  }
 
-  // 	/* draw some colors for 5seconds */
-  // 	drmmodeset_draw();
-  //
-  // 	/* cleanup everything */
-  // 	drmmodeset_cleanup(fd);
+  /*
+   * A cached output that doesn't start any more would be left out of every
+   * later start, since the cache still matches. Drop the cache and probe
+   * again; releasing the last output closes the fd, so we reopen the card.
+   */
+  if (startup.cached && n < count) {
+    fprintf(stderr, "cached outputs failed, probing again\n");
+    unlink(CONTEXT_PROBE_CACHE_PATH);
+    for (i = 0; i < n; ++i)
+      context_release(contexts[i]);
+    memset(&startup, 0, sizeof(startup));
+    n = 0;
+    cached = 0;
+    goto retry;
+  }
 
-  ret = 0;
+  ret = n ? 0 : -ENODEV;
+  if (n == 0)
+    goto out_return;
+
+  /* remember what we found for the next start */
+  if ((flags & CONTEXT_START_PROBE_CACHE) && !startup.cached)
+    drmmodeset_probe_save(CONTEXT_PROBE_CACHE_PATH, card, devs, n);
+
+  startup.modeset_ns = stats_now() - now;
+  startup.total_ns = stats_now() - start;
+  fprintf(stderr,
+          "startup: open %.2f ms, probe %.2f ms%s, buffers %.2f ms, modeset "
+          "%.2f ms, total %.2f ms\n",
+          startup_ms(startup.open_ns), startup_ms(startup.probe_ns),
+          startup.cached ? " (cached)" : "", startup_ms(startup.buffers_ns),
+          startup_ms(startup.modeset_ns), startup_ms(startup.total_ns));
+  for (i = 0; i < n; ++i) {
+    contexts[i]->startup = startup;
+    contexts[i]->startup.kept_mode = devs[i]->kept_crtc;
+  }
 
 out_return:
   if (ret) {
     errno = -ret;
     fprintf(stderr, "drmmodeset failed with error %d: %m\n", errno);
-    return NULL;
+    return ret;
   }
 
-  context_t *context = malloc(sizeof(context_t));
-  context->data = (int *)drmmodeset_con->map;
-  context->width = drmmodeset_con->width;
-  context->height = drmmodeset_con->height;
-  context->fb_file_desc = drmmodeset_con->fb;
-  context->fb_name = card;
-  return context;
+  return n;
 }
@@ -1,25 +1,177 @@
 #ifndef __DRAW_H_
 #define __DRAW_H_
 
+#include "alloc.h"
+#include "damage.h"
+#include "format.h"
+#include "pool.h"
+#include "stats.h"
+
+// Pixels of row y start at data + y * stride. stride is counted in pixels and
+// may be larger than width, for padded rows or views into a larger image.
+// allocator is where image_free() returns the image to, NULL for malloc.
+// generation grows whenever the library changes the pixels, see image_touch().
 typedef struct {
   int* data;
   int width;
   int height;
+  int stride;
+  allocator_t* allocator;
+  unsigned int generation;
 } image_t;
 
+// Most buffers a context can flip between (triple buffering).
+#define CONTEXT_MAX_BUFFERS 3
+
+// How many clips context_push_clip() can stack.
+#define CONTEXT_CLIP_DEPTH 16
+
+struct drmmodeset_dev;
+
+// How long context creation took, in ns per phase: opening the card, finding
+// connectors, modes and CRTCs, creating and mapping the framebuffers, and
+// setting the modes. cached and kept_mode tell whether the probe came from the
+// cache and whether this output's mode was kept, see CONTEXT_START_*. All 0
+// for offscreen contexts.
 typedef struct {
+  uint64_t open_ns;
+  uint64_t probe_ns;
+  uint64_t buffers_ns;
+  uint64_t modeset_ns;
+  uint64_t total_ns;
+  int cached;
+  int kept_mode;
+} context_startup_t;
+
+typedef struct context {
   int * data;
   int width;
   int height;
+  int stride;
+  int buffer_count;
   const char * fb_name;
-  int fb_file_desc;
+  int fb_file_desc; // DRM fd, shared by all outputs of a card, -1 offscreen
+
+  // The output this context scans out to and its refresh rate in Hz. dev is
+  // NULL for offscreen contexts, which draw into memory instead.
+  struct drmmodeset_dev * dev;
+  int * memory;
+  unsigned int connector;
+  int refresh;
+
+  // PIXEL_* of the framebuffers. data always holds XRGB8888, contexts in
+  // other formats draw into the shadow and convert on present.
+  int format;
+
+  context_startup_t startup;
+
+  // How the screen shows what is drawn, see context_set_rotation().
+  // rotate_shadow is set when the CPU turns the shadow on present because the
+  // display can't.
+  int rotation;
+  int rotate_shadow;
+
+  // Shadow mode (see context_enable_shadow): data points at this heap buffer
+  // and the damage lists track what still has to reach each framebuffer.
+  int * shadow;
+  damage_t damage;
+  damage_t buffer_damage[CONTEXT_MAX_BUFFERS];
+
+  // Everything that reached the framebuffers since the last capture_frame()
+  // (see capture.h), in shadow mode.
+  damage_t capture_damage;
+
+  // Worker threads for large primitives, NULL when single-threaded.
+  worker_pool_t * pool;
+
+  // Primitives only touch pixels inside this rect, see context_set_clip().
+  // clip_limit is as far as context_set_clip() can widen it: the context, the
+  // part of the parent's clip a sub-context covers, or the clip pushed last.
+  // clip_stack holds the clip and clip_limit of every context_push_clip().
+  rect_t clip;
+  rect_t clip_limit;
+  rect_t clip_stack[2 * CONTEXT_CLIP_DEPTH];
+  int clip_depth;
+
+  // Sub-contexts (see context_sub) draw into parent's pixels, with their 0, 0
+  // at origin_x, origin_y of it. NULL for contexts of their own.
+  struct context * parent;
+  int origin_x;
+  int origin_y;
+
+  // Counters, NULL until context_enable_stats().
+  stats_t * stats;
+
+  // Memory for images, NULL (malloc) until context_enable_allocators().
+  // allocator is a pool for images kept across frames, frame an arena for
+  // images that only live until the next context_present().
+  allocator_t * allocator;
+  allocator_t * frame;
 } context_t;
 
+// A w x h image with uninitialized pixels from allocator, NULL for malloc.
+// Returns NULL without memory or past INT_MAX pixels.
+image_t * image_create(int w, int h, allocator_t * allocator);
 void image_free(image_t * image);
+
+// Report pixels changed by writing to image->data directly, so caches made
+// from the image (see cache.h) stop handing out the old ones. Writing through
+// a view only updates the view's generation.
+void image_touch(image_t * image);
+
+// A w x h window into image sharing its pixels, clipped to the image. Views
+// own nothing, never image_free() them.
+image_t image_view(image_t * image, int x, int y, int w, int h);
 void set_pixel(int x, int y, context_t * context, int color);
+// Resampling filters for scale_filtered and scale_into.
+#define SCALE_NEAREST 0
+#define SCALE_BILINEAR 1
+
+// All scalers crop the source to the target's aspect ratio (centered) and
+// stretch that crop over the whole target.
 image_t * scale(image_t*image, int w, int h);
+image_t * scale_filtered(image_t * image, int w, int h, int filter);
+// Same, the result comes from allocator. NULL without memory.
+image_t * scale_filtered_alloc(image_t * image, int w, int h, int filter, allocator_t * allocator);
+
+// Scale into an existing image, dest's width, height and stride pick the
+// target, nothing is allocated.
+void scale_into(image_t * image, image_t * dest, int filter);
+// Same, split into bands over pool (e.g. context->pool, NULL runs inline) and
+// timed in stats (context->stats, NULL for none). Only this one is timed, the
+// other scalers have no context to charge.
+void scale_into_pool(image_t * image, image_t * dest, int filter, worker_pool_t * pool,
+                     stats_t * stats);
 void draw_array(int x, int y, int w, int h, int* array, context_t* context);
+void draw_array_stride(int x, int y, int w, int h, int stride, int* array, context_t* context);
 void draw_image(int x, int y, image_t * image, context_t* context);
+
+// Rotations and flips: the picture is turned counter-clockwise by 0, 90, 180
+// or 270 degrees, then optionally mirrored left to right (REFLECT_X) and top
+// to bottom (REFLECT_Y). The values match the order of DRM_MODE_ROTATE_*.
+#define CONTEXT_ROTATE_0 0
+#define CONTEXT_ROTATE_90 1
+#define CONTEXT_ROTATE_180 2
+#define CONTEXT_ROTATE_270 3
+#define CONTEXT_REFLECT_X 4
+#define CONTEXT_REFLECT_Y 8
+
+// Copy the array or image turned by rotation, its top left corner at x, y.
+// 90 and 270 degrees swap width and height. Copied in cache-sized tiles, each
+// transposed in SIMD registers.
+void draw_array_rotated(int x, int y, int w, int h, int stride, int* array, int rotation,
+                        context_t* context);
+void draw_image_rotated(int x, int y, image_t * image, int rotation, context_t* context);
+
+// Alpha-blended blits. Sources are premultiplied ARGB8888 (what read_png_file
+// returns, see image_premultiply for other images) composited over the
+// context. draw_image_blend_alpha fades the whole image by alpha (0-255).
+void draw_array_blend(int x, int y, int w, int h, int stride, int* array, context_t* context);
+void draw_image_blend(int x, int y, image_t * image, context_t* context);
+void draw_image_blend_alpha(int x, int y, image_t * image, int alpha, context_t* context);
+
+// Convert straight ARGB8888 pixels to premultiplied in place.
+void image_premultiply(image_t * image);
 void draw_rect(int x, int y, int w, int h, context_t* context, int color);
 void clear_context_color(context_t* context, int color);
 void clear_context(context_t* context);
@@ -28,4 +180,222 @@ void test_pattern(context_t* context);
 void context_release(context_t * context);
 context_t * context_create();
 
+// Create a context that renders into one of `buffers` (1 to
+// CONTEXT_MAX_BUFFERS) framebuffers while another one is scanned out.
+context_t * context_create_buffered(int buffers);
+
+// Same in a PIXEL_* format, NULL when the driver can't scan it out.
+context_t * context_create_format(int buffers, int format);
+
+// Create one context per connected output, up to max, each with its own mode,
+// CRTC and page-flip state. Returns how many were stored in contexts or a
+// negative errno. Release every context on its own; the DRM fd is closed with
+// the last one.
+int context_create_outputs(context_t ** contexts, int max, int buffers);
+int context_create_outputs_format(context_t ** contexts, int max, int buffers, int format);
+
+// Startup shortcuts for devices that boot straight into the UI, for
+// context_create_outputs_flags():
+// KEEP_MODE leaves a CRTC alone that already drives the output in the mode we
+// picked (left by the bootloader, a splash or our last run): no modeset and no
+// blank frames, whatever it shows stays up until the first context_present().
+// PROBE_CACHE reuses the card, connectors, CRTCs and modes found last time
+// from CONTEXT_PROBE_CACHE_PATH instead of probing every connector, as long as
+// they still match what the kernel reports; found outputs are written back.
+// Only the cached connectors are looked at: a monitor connected since is not
+// found until the cache goes stale or is deleted. When a cached output fails
+// to start, the cache is deleted and every connector probed.
+// NO_CLEAR skips zeroing the framebuffers: draw every pixel of each buffer
+// (e.g. clear_context) before presenting it.
+#define CONTEXT_START_KEEP_MODE 1
+#define CONTEXT_START_PROBE_CACHE 2
+#define CONTEXT_START_NO_CLEAR 4
+#define CONTEXT_START_FAST (CONTEXT_START_KEEP_MODE | CONTEXT_START_PROBE_CACHE | CONTEXT_START_NO_CLEAR)
+
+#ifndef CONTEXT_PROBE_CACHE_PATH
+#define CONTEXT_PROBE_CACHE_PATH "/var/cache/drmgraphics-probe"
+#endif
+
+// context_create_outputs_format with CONTEXT_START_* flags. Each context's
+// startup field has the time spent per phase, also logged to stderr.
+int context_create_outputs_flags(context_t ** contexts, int max, int buffers, int format,
+                                 int flags);
+
+// Overlay and cursor planes scan out their own buffer on top of the context,
+// composed by the display controller at no CPU cost. Overlays can usually
+// scale, cursors are small (often 64x64) and can't. Offscreen contexts have
+// no planes.
+#define CONTEXT_PLANE_OVERLAY 0
+#define CONTEXT_PLANE_CURSOR 1
+
+typedef struct context_plane context_plane_t;
+
+// How many planes of type are still free for this context's output.
+int context_plane_count(context_t * context, int type);
+
+// Claim a free plane of type, NULL if there is none. Planes start hidden and
+// are released with their context if the caller doesn't do it first.
+context_plane_t * context_plane_acquire(context_t * context, int type);
+// Same for a plane that can scan out a DRM_FORMAT_* fourcc, e.g. NV12 video.
+context_plane_t * context_plane_acquire_format(context_t * context, int type, uint32_t fourcc);
+void context_plane_release(context_plane_t * plane);
+
+// The plane's width x height ARGB buffer, reallocated when the size changes.
+// Write premultiplied pixels (e.g. video frames) straight into it; a shown
+// plane picks them up on the next scanout, so changes may tear. Never free
+// the result. data is NULL on failure.
+image_t context_plane_buffer(context_plane_t * plane, int width, int height);
+
+// Copy image into the plane buffer, resizing it to the image.
+int context_plane_set_image(context_plane_t * plane, image_t * image);
+
+// Scan out x, y, w, h of the buffer (default: all of it).
+int context_plane_set_source(context_plane_t * plane, int x, int y, int w, int h);
+
+// Show the source at x, y on screen, scaled to w x h. May be partly offscreen
+// if the driver allows it. Returns 0 or a negative errno. With atomic
+// modesetting, plane changes take effect with the next context_present(), in
+// the same vblank as the frame; otherwise they apply at once.
+int context_plane_show(context_plane_t * plane, int x, int y, int w, int h);
+int context_plane_hide(context_plane_t * plane);
+
+// A buffer shared through dma-buf fds, one per plane of the format (NV12 has
+// two, which may be the same fd at different offsets). modifier 0 is
+// DRM_FORMAT_MOD_LINEAR.
+#define CONTEXT_DMABUF_MAX_PLANES 4
+
+typedef struct {
+  int width;
+  int height;
+  uint32_t fourcc;
+  uint64_t modifier;
+  int planes;
+  int fd[CONTEXT_DMABUF_MAX_PLANES];
+  uint32_t offset[CONTEXT_DMABUF_MAX_PLANES];
+  uint32_t pitch[CONTEXT_DMABUF_MAX_PLANES];
+} context_dmabuf_t;
+
+// A framebuffer made from somebody else's dma-bufs (V4L2, a video decoder,
+// the GPU). The pixels are never touched by the CPU: show it on a plane and
+// the display reads them where they are. The fds stay the caller's and may be
+// closed right after importing.
+typedef struct context_fb context_fb_t;
+
+// NULL when the driver refuses the buffer.
+context_fb_t * context_fb_import(context_t * context, const context_dmabuf_t * dmabuf);
+// Hides any plane still showing fb. Release fbs before their context.
+void context_fb_release(context_fb_t * fb);
+
+// Scan out fb instead of the plane's own buffer, which is freed; the source
+// rect becomes all of fb. context_plane_buffer() switches back.
+int context_plane_set_fb(context_plane_t * plane, context_fb_t * fb);
+
+// Export framebuffer buffer (0 to buffer_count - 1) of the context or the
+// plane's own buffer as a dma-buf, so another process or device can render
+// into it. The caller owns and closes the fd. Shadowed contexts overwrite the
+// damaged parts of their buffers on present. Returns 0 or a negative errno.
+int context_export_dmabuf(context_t * context, int buffer, context_dmabuf_t * dmabuf);
+int context_plane_export_dmabuf(context_plane_t * plane, context_dmabuf_t * dmabuf);
+
+// A width x height context in plain memory that never touches DRM, for
+// benchmarks, tests and rendering into files. Presenting it returns at once.
+context_t * context_create_offscreen(int width, int height);
+
+// Queue the frame drawn into context->data for display on the next vblank and
+// return the buffer to draw the next frame into (also stored in context->data).
+// With two buffers this blocks until the flip happened, which paces the caller
+// on the display refresh rate. With three it only blocks when the previous flip
+// is still pending. Single-buffered contexts render on screen and return at
+// once.
+int * context_present(context_t * context);
+
+// Present several contexts, e.g. every output from context_create_outputs(),
+// in one go. On drivers with atomic modesetting all outputs of a card switch
+// in the same vblank, together with their plane changes. Returns 0 or a
+// negative errno.
+int context_present_all(context_t ** contexts, int count);
+
+// For event loops: context_present() without waiting for the flip. Don't draw
+// into the returned buffer while context_flip_pending() is set; poll
+// context_event_fd() for POLLIN and call context_dispatch() to read the flip
+// event. The fd is -1 and nothing is ever pending for offscreen contexts.
+int * context_present_async(context_t * context);
+int context_event_fd(context_t * context);
+int context_flip_pending(context_t * context);
+int context_dispatch(context_t * context);
+
+// Draw into cached heap memory instead of the write-combined scanout buffer.
+// Primitives record what they touch and context_present() only copies those
+// rectangles out. context->data stays pointed at the shadow from here on.
+// Returns 0 or -ENOMEM.
+int context_enable_shadow(context_t * context);
+
+// Show everything drawn into the context turned by rotation (CONTEXT_ROTATE_*
+// | CONTEXT_REFLECT_*), e.g. on a panel mounted in portrait. Afterwards width
+// and height are the drawing's: 90 and 270 degrees swap them, and the clip is
+// reset. The display controller does the work when it can (usually 180 degrees
+// and the flips); otherwise the context switches to shadow mode and the
+// damaged parts are turned in cache-sized tiles on present. Draw the whole
+// frame again afterwards. Planes keep their screen coordinates. Returns 0, -EINVAL for
+// offscreen contexts and unknown values, or -ENOMEM.
+int context_set_rotation(context_t * context, int rotation);
+
+// Split clear_context, draw_rect, the draw_array family and the shadow copy in
+// context_present over `threads` threads (counting the caller) in horizontal
+// bands. Primitives under `threshold` pixels (<= 0 means the default) stay on
+// the calling thread. Every primitive waits for its bands before returning, so
+// context_present() and anything after it always see finished pixels and the
+// pool is idle while a page-flip is pending. threads <= 1 stops the workers.
+// Call from the render thread only. Returns 0 or -ENOMEM.
+int context_set_threads(context_t * context, int threads, int threshold);
+
+// Give the context a pool keeping up to budget bytes of freed images (0 picks
+// CONTEXT_DEFAULT_POOL_BUDGET) and a frame arena. Pass context->allocator or
+// context->frame to the *_alloc functions and per-frame thumbnails, scratch
+// images and decodes stop allocating once the first frames warmed them up.
+// Both are freed with the context. Returns 0 or -ENOMEM.
+#define CONTEXT_DEFAULT_POOL_BUDGET (16 << 20)
+int context_enable_allocators(context_t * context, size_t budget);
+
+// Report pixels changed behind the library's back, e.g. by writing to
+// context->data directly. A no-op unless shadow mode is enabled.
+void context_damage(context_t * context, int x, int y, int w, int h);
+
+// Limit every primitive to the part of x, y, w, h inside the context and the
+// last pushed clip, until the next context_set_clip() or context_reset_clip().
+void context_set_clip(context_t * context, int x, int y, int w, int h);
+void context_reset_clip(context_t * context);
+
+// Narrow the clip to its intersection with x, y, w, h until the matching
+// context_pop_clip(), which brings back the clip from before. set and reset
+// stay inside the pushed rect meanwhile. Returns 0, or -ENOSPC with the clip
+// unchanged past CONTEXT_CLIP_DEPTH pushes (don't pop then).
+int context_push_clip(context_t * context, int x, int y, int w, int h);
+void context_pop_clip(context_t * context);
+
+// Trim rect to the current clip. Returns 0 when nothing of it is left. Every
+// primitive clips once through this, never per pixel.
+int context_clip_rect(const context_t * context, rect_t * rect);
+
+// A w x h context whose 0, 0 lies at x, y of parent, sharing its pixels,
+// pool, stats and allocators. Give it to a widget to draw itself in its own
+// coordinates: it can't touch anything outside the rect or the parent's clip
+// at the time of the call. Sub-contexts own nothing and are never presented
+// or released; context_sub_end() hands what they drew to the parent's damage.
+//
+// Sub-contexts covering disjoint rects may draw on different threads at the
+// same time if each has its pool and stats set to NULL and leaves the frame
+// arena alone, those belong to the parent's thread.
+context_t context_sub(context_t * parent, int x, int y, int w, int h);
+void context_sub_end(context_t * sub);
+
+// Start collecting frame times, vblank misses, bytes written and per-primitive
+// call counts and times. Costs two clock reads per primitive call. Scaling only
+// shows up when timed through scale_into_pool(). Returns 0 or -ENOMEM.
+int context_enable_stats(context_t * context);
+
+// The counters so far, NULL when stats are off. Valid until context_release.
+const stats_t * context_get_stats(context_t * context);
+void context_reset_stats(context_t * context);
+
 #endif
@@ -1,5 +1,6 @@
 #include "font.h"
 #include "draw.h"
+#include "span.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -694,23 +695,102 @@ const int NIL_CHAR[8][8] ={{X,0,0,X,0,X,0,X},
                           {X,X,X,X,0,X,X,X}};
 
 void fontmap_free(fontmap_t* fontmap) {
+  if(fontmap == NULL) return;
+  for(int i = 0; i < fontmap->size; i++) free(fontmap->map[i].mask);
+  if(fontmap->pages != NULL) {
+    for(int i = 0; i < FONT_PAGES; i++) free(fontmap->pages[i]);
+    free(fontmap->pages);
+  }
+  free(fontmap->atlas);
   free(fontmap->map);
   free(fontmap);
 }
 
+// An empty font of size glyphs, max_width x max_height each, nothing mapped.
+static fontmap_t * fontmap_create(int size, int max_width, int max_height) {
+  fontmap_t * fontmap = calloc(1, sizeof(fontmap_t));
+  if(fontmap == NULL) return NULL;
+
+  fontmap->size = size;
+  fontmap->max_width = max_width;
+  fontmap->max_height = max_height;
+  fontmap->row_bytes = (max_width + 7) / 8;
+  fontmap->scale = 1;
+  fontmap->map = calloc(size, sizeof(glyph_t));
+  fontmap->atlas = calloc((size_t)size * max_height, fontmap->row_bytes);
+  fontmap->pages = calloc(FONT_PAGES, sizeof(int *));
+  if(fontmap->map == NULL || fontmap->atlas == NULL || fontmap->pages == NULL) {
+    fontmap_free(fontmap);
+    return NULL;
+  }
+
+  for(int i = 0; i < size; i++) {
+    glyph_t * glyph = &fontmap->map[i];
+    glyph->width = max_width;
+    glyph->height = max_height;
+    glyph->bits = &fontmap->atlas[(size_t)i * max_height * fontmap->row_bytes];
+  }
+  return fontmap;
+}
+
+// Map code point c to glyph index. Returns -1 without memory.
+static int fontmap_map(fontmap_t * fontmap, uint32_t c, int index) {
+  if(c >= 0x110000) return 0;
+
+  int ** page = &fontmap->pages[c / FONT_PAGE_SIZE];
+  if(*page == NULL) {
+    *page = malloc(FONT_PAGE_SIZE * sizeof(int));
+    if(*page == NULL) return -1;
+    for(int i = 0; i < FONT_PAGE_SIZE; i++) (*page)[i] = -1;
+  }
+  (*page)[c % FONT_PAGE_SIZE] = index;
+  return 0;
+}
+
+static int fontmap_lookup(const fontmap_t * fontmap, uint32_t c) {
+  const int * page = c < 0x110000 ? fontmap->pages[c / FONT_PAGE_SIZE] : NULL;
+  int index = page != NULL ? page[c % FONT_PAGE_SIZE] : -1;
+  return index >= 0 ? index : fontmap->fallback;
+}
+
+// U+FFFD, else '?', else glyph 0.
+static void fontmap_pick_fallback(fontmap_t * fontmap) {
+  fontmap->fallback = 0;
+  fontmap->fallback = fontmap_lookup(fontmap, '?');
+  fontmap->fallback = fontmap_lookup(fontmap, 0xFFFD);
+}
+
+// Pack every glyph's int array into 1-bit rows in the atlas.
+static void fontmap_build_atlas(fontmap_t * fontmap) {
+  for(int i = 0; i < fontmap->size; i++) {
+    glyph_t * glyph = &fontmap->map[i];
+    unsigned char * rows = (unsigned char *) glyph->bits;
+
+    for(int y = 0; y < glyph->height; y++) {
+      unsigned char bits = 0;
+      for(int x = 0; x < glyph->width; x++) {
+        if(glyph->data[y * glyph->width + x]) {
+          bits |= 0x80 >> x;
+        }
+      }
+      rows[y] = bits;
+    }
+  }
+}
+
 fontmap_t * fontmap_default() {
-  fontmap_t * result = malloc(sizeof(fontmap_t));
-  glyph_t * map = malloc(128 * sizeof(glyph_t));
-  result->size = 128;
-  result->map = map;
+  fontmap_t * result = fontmap_create(128, FONT_SIZE, FONT_SIZE);
+  if(result == NULL) return NULL;
+  glyph_t * map = result->map;
+  result->spacing = 1;
 
   int i;
   for(i = 0; i < 128; i++) {
-    map[i].width = FONT_SIZE;
-    map[i].height = FONT_SIZE;
-    map[i].baseline_offset = 0;
-    map[i].centerline_offset = 0;
     map[i].data = (int*) &NIL_CHAR;
+    if(fontmap_map(result, i, i)) {
+      fontmap_free(result);
+      return NULL;
+    }
   }
 
   // Uppercase
@@ -749,19 +829,485 @@ fontmap_t * fontmap_default() {
   map[125].data = (int*) &RCURLYB;
   map[126].data = (int*) &TILDE;
 
+  fontmap_build_atlas(result);
+
+  // Unknown code points stay blank, the NIL glyph in slot 0.
+  result->fallback = 0;
+
   return result;
 }
 
+static uint32_t read_le32(const unsigned char * p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Next code point of a UTF-8 string, advancing it. Broken sequences give
+// U+FFFD and skip what was read of them.
+static uint32_t utf8_next(const char ** string) {
+  const unsigned char * s = (const unsigned char *) *string;
+  uint32_t c = s[0];
+  int n = c < 0x80 ? 0 : c < 0xC0 ? -1 : c < 0xE0 ? 1 : c < 0xF0 ? 2 : c < 0xF8 ? 3 : -1;
+
+  if(n <= 0) {
+    *string += 1;
+    return n == 0 ? c : 0xFFFD;
+  }
+
+  c &= 0x3F >> n;
+  for(int i = 1; i <= n; i++) {
+    // Stops at the terminator as well.
+    if((s[i] & 0xC0) != 0x80) {
+      *string += i;
+      return 0xFFFD;
+    }
+    c = c << 6 | (s[i] & 0x3F);
+  }
+  *string += n + 1;
+  return c;
+}
+
+// The PSF2 Unicode table: per glyph, UTF-8 code points up to 0xFF. 0xFE starts
+// sequences (a base and combining marks) for the same glyph, which we skip.
+static int psf2_map(fontmap_t * fontmap, const unsigned char * table, size_t size) {
+  size_t pos = 0;
+
+  for(int glyph = 0; glyph < fontmap->size && pos < size; glyph++) {
+    while(pos < size && table[pos] != 0xFF) {
+      if(table[pos] == 0xFE) {
+        while(pos < size && table[pos] != 0xFF) pos++;
+        break;
+      }
+
+      // Copy the code point out, the table isn't terminated.
+      char utf8[5] = {0};
+      for(int i = 0; i < 4 && pos + i < size && table[pos + i] < 0xFE; i++) {
+        utf8[i] = table[pos + i];
+        if(i > 0 && (table[pos + i] & 0xC0) != 0x80) {
+          utf8[i] = 0;
+          break;
+        }
+      }
+      const char * p = utf8;
+      uint32_t c = utf8_next(&p);
+      pos += p - utf8;
+      if(fontmap_map(fontmap, c, glyph)) return -1;
+    }
+    pos++;
+  }
+  return 0;
+}
+
+// The PSF1 table: 16-bit code points per glyph, 0xFFFF ends a glyph, 0xFFFE
+// starts sequences.
+static int psf1_map(fontmap_t * fontmap, const unsigned char * table, size_t size) {
+  size_t pos = 0;
+
+  for(int glyph = 0; glyph < fontmap->size && pos + 1 < size; glyph++) {
+    int sequences = 0;
+    for(; pos + 1 < size; pos += 2) {
+      uint32_t c = table[pos] | table[pos + 1] << 8;
+      if(c == 0xFFFF) break;
+      if(c == 0xFFFE) sequences = 1;
+      if(!sequences && fontmap_map(fontmap, c, glyph)) return -1;
+    }
+    pos += 2;
+  }
+  return 0;
+}
+
+#define PSF1_MAGIC 0x0436
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF2_MAGIC 0x864AB572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+
+fontmap_t * fontmap_load_psf(const char * path) {
+  FILE * fp = fopen(path, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "cannot open font %s\n", path);
+    return NULL;
+  }
+
+  // Console fonts are a few KB, read them whole.
+  unsigned char * file = NULL;
+  size_t size = 0, capacity = 0;
+  for(;;) {
+    if(size == capacity) {
+      capacity = capacity ? capacity * 2 : 16384;
+      unsigned char * grown = realloc(file, capacity);
+      if(grown == NULL) break;
+      file = grown;
+    }
+    size_t n = fread(file + size, 1, capacity - size, fp);
+    if(n == 0) break;
+    size += n;
+  }
+  fclose(fp);
+
+  uint32_t count = 0, width = 0, height = 0, glyph_bytes = 0, header = 0;
+  int table = 0, psf2 = 0;
+  if(size >= 32 && read_le32(file) == PSF2_MAGIC) {
+    psf2 = 1;
+    header = read_le32(file + 8);
+    table = read_le32(file + 12) & PSF2_HAS_UNICODE_TABLE;
+    count = read_le32(file + 16);
+    glyph_bytes = read_le32(file + 20);
+    height = read_le32(file + 24);
+    width = read_le32(file + 28);
+  } else if(size >= 4 && (file[0] | file[1] << 8) == PSF1_MAGIC) {
+    header = 4;
+    count = file[2] & PSF1_MODE512 ? 512 : 256;
+    table = file[2] & PSF1_MODEHASTAB;
+    glyph_bytes = height = file[3];
+    width = 8;
+  }
+
+  // Anything that doesn't fit the file or is absurdly large isn't a font.
+  int valid = count > 0 && count <= 65536 && width > 0 && width <= 64 &&
+              height > 0 && height <= 128 && glyph_bytes == height * ((width + 7) / 8) &&
+              header <= size && (size - header) / glyph_bytes >= count;
+  fontmap_t * fontmap = valid ? fontmap_create(count, width, height) : NULL;
+  if(fontmap == NULL) {
+    if(!valid) fprintf(stderr, "%s is not a PSF font\n", path);
+    free(file);
+    return NULL;
+  }
+
+  // Same bit order as our atlas: rows of whole bytes, leftmost pixel first.
+  memcpy(fontmap->atlas, file + header, (size_t)count * glyph_bytes);
+
+  const unsigned char * unicode = file + header + (size_t)count * glyph_bytes;
+  size_t unicode_size = size - header - (size_t)count * glyph_bytes;
+  int ret = 0;
+  if(!table) {
+    for(uint32_t i = 0; i < count && !ret; i++) ret = fontmap_map(fontmap, i, i);
+  } else if(psf2) {
+    ret = psf2_map(fontmap, unicode, unicode_size);
+  } else {
+    ret = psf1_map(fontmap, unicode, unicode_size);
+  }
+  free(file);
+  if(ret) {
+    fontmap_free(fontmap);
+    return NULL;
+  }
+
+  fontmap_pick_fallback(fontmap);
+  return fontmap;
+}
+
+static void fontmap_drop_masks(fontmap_t * fontmap) {
+  for(int i = 0; i < fontmap->size; i++) {
+    free(fontmap->map[i].mask);
+    fontmap->map[i].mask = NULL;
+  }
+  fontmap->mask_bytes = 0;
+}
+
+void fontmap_set_scale(fontmap_t * fontmap, int scale) {
+  if(scale < 1) scale = 1;
+  if(scale != fontmap->scale) {
+    fontmap_drop_masks(fontmap);
+    fontmap->scale = scale;
+  }
+}
+
+static size_t glyph_mask_bytes(const fontmap_t * fontmap, const glyph_t * glyph) {
+  return (size_t)glyph->width * glyph->height * fontmap->scale * fontmap->scale;
+}
+
+// Expand glyph's bits into a coverage byte per pixel at the fontmap's scale.
+// NULL without memory.
+static const unsigned char * glyph_mask(fontmap_t * fontmap, glyph_t * glyph) {
+  if(glyph->mask != NULL) return glyph->mask;
+
+  int scale = fontmap->scale;
+  int width = glyph->width * scale;
+  size_t bytes = glyph_mask_bytes(fontmap, glyph);
+  unsigned char * mask = malloc(bytes);
+  if(mask == NULL) return NULL;
+
+  for(int y = 0; y < glyph->height; y++) {
+    const unsigned char * bits = &glyph->bits[y * fontmap->row_bytes];
+    unsigned char * row = &mask[(size_t)y * scale * width];
+
+    for(int x = 0; x < glyph->width; x++) {
+      memset(row + x * scale, bits[x / 8] & (0x80 >> (x % 8)) ? 255 : 0, scale);
+    }
+    for(int r = 1; r < scale; r++) memcpy(row + r * width, row, width);
+  }
+
+  glyph->mask = mask;
+  fontmap->mask_bytes += bytes;
+  return mask;
+}
+
 void draw_glyph(int x, int y, glyph_t * glyph, context_t * context) {
-  draw_array(x, y, glyph->width, glyph->height, glyph->data, context);
+  if(glyph->data != NULL) {
+    draw_array(x, y, glyph->width, glyph->height, glyph->data, context);
+  }
+}
+
+static glyph_t * fontmap_glyph(const fontmap_t * fontmap, uint32_t c) {
+  return &fontmap->map[fontmap_lookup(fontmap, c)];
+}
+
+// Glyphs per render_glyphs() call, strings are decoded this many at a time.
+#define RENDER_CHUNK 64
+
+// Where a glyph lands on a row: count pixels at offset from the row's start,
+// skip columns into the glyph when the clip cuts off its left side.
+typedef struct {
+  int offset, skip, count;
+  const unsigned char * bits;
+  const unsigned char * mask;
+} glyph_span_t;
+
+// Render a row of glyphs from the atlas: for every glyph row we walk across
+// the string, so writes go out left to right instead of jumping between
+// cells. At scale 1 the 1-bit rows are expanded directly and with opaque set,
+// unset glyph pixels are painted bg. Scaled glyphs are blended from their
+// masks and leave the background alone, draw_string_bg has filled it already.
+static void render_glyphs(int x, int y, glyph_t ** glyphs, int length, fontmap_t * fontmap,
+                          context_t * context, int fg, int bg, int opaque) {
+  int scale = fontmap->scale;
+  int cell = fontmap->max_width * scale;
+  int advance = (fontmap->max_width + fontmap->spacing) * scale;
+  int row_bytes = fontmap->row_bytes;
+
+  // Clip the glyphs' box once, rows and glyphs are picked from what's left.
+  rect_t box = {x, y, length * advance, fontmap->max_height * scale};
+  if(!context_clip_rect(context, &box)) return;
+
+  int row_start = box.y - y;
+  int row_end = row_start + box.h;
+  int left = box.x;
+  int right = box.x + box.w;
+
+  // Only glyphs from first to last are visible.
+  int first = (left - x) / advance;
+  int last = (right - x + advance - 1) / advance;
+  context_damage(context, left, box.y, right - left, box.h);
+
+  if(scale > 1) {
+    // Make room before taking any mask, dropping them later would pull them
+    // from under the glyphs before.
+    size_t needed = 0;
+    for(int i = first; i < last; i++) {
+      if(glyphs[i]->mask == NULL) needed += glyph_mask_bytes(fontmap, glyphs[i]);
+    }
+    if(fontmap->mask_bytes + needed > FONT_MASK_BUDGET) fontmap_drop_masks(fontmap);
+    fg |= 0xFF000000;
+  }
+
+  // Lay the visible glyphs out once, only glyphs on the clip edges need
+  // trimming. The row loops below are left with very little to keep track of.
+  glyph_span_t spans[RENDER_CHUNK];
+  int count = 0;
+  for(int i = first; i < last; i++) {
+    int gx = x + i * advance;
+    int c0 = gx < left ? left - gx : 0;
+    int c1 = gx + cell > right ? right - gx : cell;
+    const unsigned char * mask = scale > 1 ? glyph_mask(fontmap, glyphs[i]) : NULL;
+
+    if(c0 >= c1 || (scale > 1 && mask == NULL)) continue;
+    spans[count++] = (glyph_span_t){gx + c0, c0, c1 - c0, glyphs[i]->bits, mask};
+  }
+
+  for(int row = row_start; row < row_end; row++) {
+    int * line = &context->data[(y + row) * context->stride];
+
+    if(scale > 1) {
+      for(const glyph_span_t * span = spans; span < spans + count; span++) {
+        span_blend_color_mask(line + span->offset, fg, span->mask + row * cell + span->skip,
+                              span->count);
+      }
+    } else if(row_bytes == 1 && !opaque) {
+      for(const glyph_span_t * span = spans; span < spans + count; span++) {
+        span_expand_mask(line + span->offset, (span->bits[row] << span->skip) & 0xFF,
+                         span->count, fg);
+      }
+    } else if(row_bytes == 1) {
+      for(const glyph_span_t * span = spans; span < spans + count; span++) {
+        span_expand_mask_bg(line + span->offset, (span->bits[row] << span->skip) & 0xFF,
+                            span->count, fg, bg);
+      }
+    } else {
+      // Wider glyphs go 8 pixels, one atlas byte, at a time.
+      for(const glyph_span_t * span = spans; span < spans + count; span++) {
+        const unsigned char * bits = &span->bits[row * row_bytes];
+        int * dst = line + span->offset - span->skip;
+        int end = span->skip + span->count;
+
+        for(int c = span->skip; c < end; c = (c & ~7) + 8) {
+          int n = ((c & ~7) + 8 < end ? (c & ~7) + 8 : end) - c;
+          int byte = (bits[c / 8] << (c % 8)) & 0xFF;
+
+          if(opaque) {
+            span_expand_mask_bg(dst + c, byte, n, fg, bg);
+          } else {
+            span_expand_mask(dst + c, byte, n, fg);
+          }
+        }
+      }
+    }
+  }
+}
+
+static void render_string(int x, int y, const char * string, fontmap_t * fontmap,
+                          context_t * context, int fg, int bg, int opaque) {
+  rect_t clip = context->clip;
+  int advance = (fontmap->max_width + fontmap->spacing) * fontmap->scale;
+  glyph_t * glyphs[RENDER_CHUNK];
+
+  if(y >= clip.y + clip.h || y + fontmap->max_height * fontmap->scale <= clip.y) return;
+
+  // Nothing right of the clip is decoded.
+  while(*string && x < clip.x + clip.w) {
+    int count = 0;
+    while(*string && count < RENDER_CHUNK) {
+      // ASCII needs no decoding.
+      uint32_t c = (unsigned char) *string < 0x80 ? (unsigned char) *string++ : utf8_next(&string);
+      glyphs[count++] = fontmap_glyph(fontmap, c);
+    }
+    render_glyphs(x, y, glyphs, count, fontmap, context, fg, bg, opaque);
+    x += count * advance;
+  }
+}
+
+// Number of code points draw_string draws for string.
+static int string_glyphs(const char * string) {
+  int count = 0;
+  while(*string) {
+    utf8_next(&string);
+    count++;
+  }
+  return count;
+}
+
+void measure_string(const char * string, fontmap_t * fontmap, int * width, int * height) {
+  // Every glyph advances by its width plus the spacing, and rows start that
+  // far below y, all of it scaled.
+  int advance = (fontmap->max_width + fontmap->spacing) * fontmap->scale;
+  *width = string_glyphs(string) * advance;
+  *height = (fontmap->max_height + fontmap->spacing) * fontmap->scale;
+}
+
+void draw_string_bg(int x, int y, char * string, fontmap_t * fontmap, context_t * context, int fg, int bg) {
+  int width, height;
+  measure_string(string, fontmap, &width, &height);
+  draw_rect(x, y, width, height, context, bg);
+
+  uint64_t start = stats_begin(context->stats);
+  render_string(x, y + fontmap->spacing * fontmap->scale, string, fontmap, context, fg, bg, 1);
+  stats_end(context->stats, STATS_DRAW_STRING, start);
 }
 
 void draw_string(int x, int y, char * string, fontmap_t * fontmap, context_t * context) {
-  int length = strlen(string);
-  draw_rect(0, 0, length * fontmap->max_width + 2, fontmap->max_height + 4, context, 0x0);
-  for(int i = 0; i < length; i++) {
-    glyph_t * charPtr = &fontmap->map[(int) string[i]];
-    if(charPtr == NULL) continue;
-    draw_glyph(x + 9 * i, y + 1, charPtr, context);
-  }
-}
\ No newline at end of file
+  draw_string_bg(x, y, string, fontmap, context, X, 0x0);
+}
+
+void draw_string_color(int x, int y, char * string, fontmap_t * fontmap, context_t * context, int color) {
+  uint64_t start = stats_begin(context->stats);
+  render_string(x, y + fontmap->spacing * fontmap->scale, string, fontmap, context, color, 0x0, 0);
+  stats_end(context->stats, STATS_DRAW_STRING, start);
+}
+
+// Lay the glyphs out in the run's image the way render_string() would put
+// them on screen, pixels outside the glyphs are the background. The pixel
+// buffer already holds the text, see text_run_set_text().
+static void text_run_render(text_run_t * run) {
+  int width, height;
+  measure_string(run->text, run->fontmap, &width, &height);
+
+  int * data = run->image.data;
+  int bg = run->opaque ? run->bg | 0xFF000000 : 0;
+  for(int i = 0; i < width * height; i++) data[i] = bg;
+
+  // A context over the image, just for render_string()'s clipping.
+  context_t context;
+  memset(&context, 0, sizeof(context));
+  context.data = data;
+  context.width = width;
+  context.height = height;
+  context.stride = width;
+  context.clip = context.clip_limit = (rect_t){0, 0, width, height};
+
+  fontmap_t * fontmap = run->fontmap;
+  render_string(0, fontmap->spacing * fontmap->scale, run->text, fontmap, &context,
+                run->fg | 0xFF000000, 0, 0);
+
+  run->image.width = width;
+  run->image.height = height;
+  run->image.stride = width;
+}
+
+text_run_t * text_run_create(const char * string, fontmap_t * fontmap, int fg, int bg, int opaque) {
+  text_run_t * run = malloc(sizeof(text_run_t));
+  if(run == NULL) return NULL;
+
+  memset(run, 0, sizeof(*run));
+  run->fontmap = fontmap;
+  run->fg = fg;
+  run->bg = bg;
+  run->opaque = opaque;
+
+  if(text_run_set_text(run, string) < 0) {
+    text_run_free(run);
+    return NULL;
+  }
+  return run;
+}
+
+int text_run_set_text(text_run_t * run, const char * string) {
+  if(run->text != NULL && strcmp(run->text, string) == 0) return 0;
+
+  // Grow the buffers first, so running out of memory leaves the old text.
+  int width, height;
+  measure_string(string, run->fontmap, &width, &height);
+  int pixels = width > 0 ? width * height : 1;
+  size_t len = strlen(string);
+  int * data = run->image.data;
+  char * text = run->text;
+
+  if(data == NULL || pixels > run->pixels) {
+    data = malloc(sizeof(int) * pixels);
+    if(data == NULL) return -1;
+  }
+  if(text == NULL || len >= run->chars) {
+    text = malloc(len + 1);
+    if(text == NULL) {
+      if(data != run->image.data) free(data);
+      return -1;
+    }
+  }
+
+  if(data != run->image.data) {
+    free(run->image.data);
+    run->image.data = data;
+    run->pixels = pixels;
+  }
+  if(text != run->text) {
+    free(run->text);
+    run->text = text;
+    run->chars = len + 1;
+  }
+  memcpy(run->text, string, len + 1);
+  text_run_render(run);
+  return 1;
+}
+
+void text_run_free(text_run_t * run) {
+  if(run == NULL) return;
+  free(run->image.data);
+  free(run->text);
+  free(run);
+}
+
+void draw_text_run(int x, int y, text_run_t * run, context_t * context) {
+  if(run->opaque) {
+    draw_image(x, y, &run->image, context);
+  } else {
+    draw_image_blend(x, y, &run->image, context);
+  }
+}
@@ -1,26 +1,110 @@
 #ifndef __FONT_H__
 #define __FONT_H__
 
+#include <stddef.h>
+
 #include "draw.h"
 
+// Strings are UTF-8. Code points the font has no glyph for (and broken
+// sequences) are drawn as its replacement glyph: U+FFFD or '?' when a loaded
+// font has one, glyph 0 otherwise (blank in the built-in font).
+
+// Glyph rows are packed row_bytes bytes per row into the fontmap's atlas, most
+// significant bit is the leftmost pixel. mask is the glyph scaled to the
+// fontmap's scale, one coverage byte per pixel, NULL until first drawn that
+// way. data is the built-in font's source array, NULL for loaded fonts.
 typedef struct {
   int* data;
+  const unsigned char* bits;
+  unsigned char* mask;
   int width;
   int height;
   int baseline_offset;
   int centerline_offset;
 } glyph_t;
 
+// Code points per page of the Unicode lookup table.
+#define FONT_PAGE_SIZE 256
+#define FONT_PAGES (0x110000 / FONT_PAGE_SIZE)
+
+// Bytes of scaled glyph masks a fontmap keeps, past this they are all dropped
+// and rebuilt as drawn.
+#define FONT_MASK_BUDGET (4 << 20)
+
 typedef struct {
   glyph_t * map;
+  unsigned char * atlas;
   int size;
   int max_height;
   int max_width;
+  int row_bytes;
+
+  // Blank columns right of and rows above every glyph: 1 for the built-in
+  // font, whose glyphs fill their cell, 0 for loaded ones.
+  int spacing;
+
+  // Every font pixel is drawn as a scale x scale square.
+  int scale;
+
+  // Glyph index of each code point, pages[c / FONT_PAGE_SIZE][c %
+  // FONT_PAGE_SIZE]. Missing pages and -1 entries get the fallback glyph.
+  int ** pages;
+  int fallback;
+
+  size_t mask_bytes;
 } fontmap_t;
 
 void fontmap_free(fontmap_t* fontmap);
+// The built-in 8x8 ASCII font. NULL without memory.
 fontmap_t * fontmap_default();
 
+// Load a PSF1 or PSF2 console font (not gzipped, e.g. from
+// /usr/share/consolefonts after gunzip) with its Unicode table. Fonts without
+// one map glyph i to code point i. Returns NULL when the file is missing or
+// not a PSF font.
+fontmap_t * fontmap_load_psf(const char * path);
+
+// Draw text from fontmap scale times as large in each direction (1 or more),
+// for readable text on large panels. Scale 1 expands the 1-bit glyph rows
+// directly; larger scales draw coverage masks cached per glyph.
+void fontmap_set_scale(fontmap_t * fontmap, int scale);
+
+// The box draw_string and friends cover at x, y.
+void measure_string(const char * string, fontmap_t * fontmap, int * width, int * height);
+
+// White on black, the whole measure_string box is painted.
 void draw_string(int x, int y, char * strint, fontmap_t * fontmap, context_t * context);
 
+// Draw string in fg over its measure_string box filled with bg.
+void draw_string_bg(int x, int y, char * string, fontmap_t * fontmap, context_t * context, int fg, int bg);
+
+// Draw string in color, leaving the background between glyph pixels alone.
+void draw_string_color(int x, int y, char * string, fontmap_t * fontmap, context_t * context, int color);
+
+// A string rendered once into an image, for labels that rarely change:
+// drawing it is one draw_image (opaque) or draw_image_blend instead of
+// rendering every glyph again. Looks the same as draw_string_bg (opaque) or
+// draw_string_color.
+typedef struct {
+  image_t image;
+  char * text;
+  fontmap_t * fontmap;
+  int fg;
+  int bg;
+  int opaque;
+  // Pixels and chars the buffers hold. Text that fits is rendered in place,
+  // so a counter updated every frame allocates nothing.
+  int pixels;
+  size_t chars;
+} text_run_t;
+
+text_run_t * text_run_create(const char * string, fontmap_t * fontmap, int fg, int bg, int opaque);
+void text_run_free(text_run_t * run);
+
+// Re-render only when string differs from the current text. Returns 1 when
+// it did, 0 when nothing changed and -1 without memory (the old text stays).
+int text_run_set_text(text_run_t * run, const char * string);
+
+void draw_text_run(int x, int y, text_run_t * run, context_t * context);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "format.h"
+
+#include <drm_fourcc.h>
+#include <stddef.h>
+#include <string.h>
+
+// One pair of conversion loops per format, expanded from the channel
+// macros so each loop is specialized for its format and nothing branches on
+// the format per pixel.
+#define PIXEL_KERNELS(name, type, PACK, UNPACK)                                \
+  static void pack_##name(void *dst, const int *src, int count) {             \
+    type *out = dst;                                                           \
+    for (int i = 0; i < count; i++) {                                          \
+      uint32_t p = (uint32_t)src[i];                                           \
+      out[i] = (type)(PACK);                                                   \
+    }                                                                          \
+  }                                                                            \
+  static void unpack_##name(int *dst, const void *src, int count) {           \
+    const type *in = src;                                                      \
+    for (int i = 0; i < count; i++) {                                          \
+      uint32_t v = in[i];                                                      \
+      dst[i] = (int)(UNPACK);                                                  \
+    }                                                                          \
+  }
+
+// Narrow channels are widened by repeating their top bits, so white stays
+// 0xFFFFFF both ways.
+#define RGB565_PACK                                                            \
+  ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F)
+#define RGB565_UNPACK                                                          \
+  ((v & 0xF800) << 8 | (v & 0xE000) << 3 | (v & 0x07E0) << 5 |                 \
+   (v & 0x0600) >> 1 | (v & 0x001F) << 3 | (v & 0x001C) >> 2)
+
+#define XRGB2101010_PACK                                                       \
+  ((p & 0xFF0000) << 6 | (p & 0xC00000) >> 2 | (p & 0x00FF00) << 4 |           \
+   (p & 0x00C000) >> 4 | (p & 0x0000FF) << 2 | (p & 0x0000C0) >> 6)
+#define XRGB2101010_UNPACK                                                     \
+  ((v >> 6) & 0xFF0000) | ((v >> 4) & 0x00FF00) | ((v >> 2) & 0x0000FF)
+
+PIXEL_KERNELS(rgb565, uint16_t, RGB565_PACK, RGB565_UNPACK)
+PIXEL_KERNELS(xrgb2101010, uint32_t, XRGB2101010_PACK, XRGB2101010_UNPACK)
+
+// Our own format, only ever used to read the screen back.
+static void copy_xrgb8888(void *dst, const int *src, int count) {
+  memcpy(dst, src, sizeof(int) * count);
+}
+
+static void uncopy_xrgb8888(int *dst, const void *src, int count) {
+  memcpy(dst, src, sizeof(int) * count);
+}
+
+static const pixel_format_t pixel_formats[PIXEL_FORMATS] = {
+    {"XRGB8888", DRM_FORMAT_XRGB8888, 32, copy_xrgb8888, uncopy_xrgb8888},
+    {"RGB565", DRM_FORMAT_RGB565, 16, pack_rgb565, unpack_rgb565},
+    {"XRGB2101010", DRM_FORMAT_XRGB2101010, 32, pack_xrgb2101010,
+     unpack_xrgb2101010},
+};
+
+const pixel_format_t *pixel_format(int format) {
+  if (format < 0 || format >= PIXEL_FORMATS) {
+    return NULL;
+  }
+  return &pixel_formats[format];
+}
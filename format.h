@@ -0,0 +1,27 @@
+#ifndef __FORMAT_H_
+#define __FORMAT_H_
+
+#include <stdint.h>
+
+// Pixel formats a context can scan out. Drawing always happens in 32-bit
+// XRGB8888 ints; contexts in other formats draw into a shadow buffer that is
+// converted when it reaches the framebuffer, so RGB565 halves the size of the
+// framebuffers and the bytes each present writes to them.
+enum { PIXEL_XRGB8888, PIXEL_RGB565, PIXEL_XRGB2101010, PIXEL_FORMATS };
+
+// Convert count pixels between XRGB8888 and a format.
+typedef void (*pixel_pack_fn)(void* dst, const int* src, int count);
+typedef void (*pixel_unpack_fn)(int* dst, const void* src, int count);
+
+typedef struct {
+  const char* name;
+  uint32_t fourcc;
+  int bpp;
+  pixel_pack_fn pack;
+  pixel_unpack_fn unpack;
+} pixel_format_t;
+
+// NULL for formats we don't know.
+const pixel_format_t* pixel_format(int format);
+
+#endif
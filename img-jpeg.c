@@ -14,11 +14,14 @@
  */
 
 #include "img-jpeg.h"
-#include "jpeglib.h"
+#include <errno.h>
 #include <setjmp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+/* jpeglib.h needs FILE and size_t declared first */
+#include "jpeglib.h"
 
 // Adapted libjpeg demo to write to our image_t struct.
 
@@ -35,7 +38,6 @@ typedef struct my_error_mgr *my_error_ptr;
  */
 
 void my_error_exit(j_common_ptr cinfo) {
-  printf("Error!\n");
   /* cinfo->err really points to a my_error_mgr struct, so coerce pointer */
   my_error_ptr myerr = (my_error_ptr)cinfo->err;
 
@@ -47,8 +49,19 @@ void my_error_exit(j_common_ptr cinfo) {
   longjmp(myerr->setjmp_buffer, 1);
 }
 
-image_t *read_jpeg_file(char *filename) {
-  printf("Read JPEG %s\n", filename);
+// Rows handed to jpeg_read_scanlines() per call. libjpeg-turbo fills up to
+// one iMCU row (8 or 16 lines) at once when given room for it.
+#define JPEG_BATCH_ROWS 16
+
+// Decode filename with its top left corner at x, y of target, dropping what
+// falls outside. Without a target, allocate one of the image's size from
+// allocator and return it in *out. A fit_w x fit_h other than 0 x 0 lets the IDCT shrink
+// the image to the smallest size still covering it. area, if any, gets the
+// part of target the image covers once the header is read, also when decoding
+// fails later. Returns 0 or a negative errno.
+static int decode_jpeg(char *filename, image_t *target, int x, int y,
+                       int fit_w, int fit_h, allocator_t *allocator,
+                       image_t **out, rect_t *area) {
   /* This struct contains the JPEG decompression parameters and pointers to
    * working space (which is allocated as needed by the JPEG library).
    */
@@ -59,9 +72,10 @@ image_t *read_jpeg_file(char *filename) {
    */
   struct my_error_mgr jerr;
   /* More stuff */
-  FILE *infile;      /* source file */
-  JSAMPARRAY buffer; /* Output row buffer */
-  int row_stride;    /* physical row width in output buffer */
+  FILE *infile;            /* source file */
+  JSAMPARRAY scratch = 0;  /* Row buffer for partly visible rows */
+  /* Written after setjmp(), so it must be volatile to survive longjmp() */
+  image_t *volatile image = target;
 
   /* In this example we want to open the input file before doing anything else,
    * so that the setjmp() error recovery below can assume the file is open.
@@ -69,9 +83,12 @@ image_t *read_jpeg_file(char *filename) {
    * requires it in order to read binary files.
    */
 
+  if (area)
+    *area = (rect_t){0, 0, 0, 0};
+
   if ((infile = fopen(filename, "rb")) == NULL) {
     fprintf(stderr, "can't open %s\n", filename);
-    return 0;
+    return -errno;
   }
 
   /* Step 1: allocate and initialize JPEG decompression object */
@@ -86,54 +103,97 @@ image_t *read_jpeg_file(char *filename) {
      */
     jpeg_destroy_decompress(&cinfo);
     fclose(infile);
-    return 0;
+    if (image != target)
+      image_free(image);
+    return -EINVAL;
   }
 
   jpeg_create_decompress(&cinfo);
   jpeg_stdio_src(&cinfo, infile);
   (void)jpeg_read_header(&cinfo, TRUE);
-  cinfo.out_color_space = JCS_EXT_BGRX;
+
+  /* libjpeg-turbo converts to our pixel layout itself: B, G, R, A in memory is
+   * XRGB8888 on little endian machines. Unlike BGRX, BGRA guarantees an alpha
+   * of 0xFF, which keeps the pixels valid premultiplied ARGB for blending. */
+  cinfo.out_color_space = JCS_EXT_BGRA;
+
+  /* Scaling in the IDCT skips most of the decode work: at 1/8 only the DC
+   * coefficient of each block is used. libjpeg-turbo supports every N/8. */
+  if (fit_w > 0 && fit_h > 0) {
+    for (int num = 1; num <= 8; num++) {
+      cinfo.scale_num = num;
+      cinfo.scale_denom = 8;
+      jpeg_calc_output_dimensions(&cinfo);
+      if ((int)cinfo.output_width >= fit_w &&
+          (int)cinfo.output_height >= fit_h)
+        break;
+    }
+  }
   (void)jpeg_start_decompress(&cinfo);
 
-  row_stride = cinfo.output_width * cinfo.output_components;
-  /* Make a one-row-high sample array that will go away when done with image */
-  buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
-                                      row_stride, 1);
+  int width = cinfo.output_width;
+  int height = cinfo.output_height;
 
-  image_t *image = malloc(sizeof(image_t));
-  image->data = malloc(sizeof(int) * cinfo.output_width * cinfo.output_height);
-  image->width = cinfo.output_width;
-  image->height = cinfo.output_height;
+  if (image == NULL) {
+    image = image_create(width, height, allocator);
+    if (image == NULL) {
+      jpeg_destroy_decompress(&cinfo);
+      fclose(infile);
+      return -ENOMEM;
+    }
+  }
 
 #if DEBUG
-  printf("JPEG %dx%d\n", image->width, image->height);
-  printf("output components: %d, stride: %d\n", cinfo.output_components,
-         row_stride);
+  printf("JPEG %dx%d\n", width, height);
 #endif
-  int row = 0;
 
-  while (cinfo.output_scanline < cinfo.output_height) {
-    /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
-     */
-    (void)jpeg_read_scanlines(&cinfo, buffer, 1);
-
-    // for(int i = 0; i < row_stride; i+=3) {
-    //   int hexval = ((buffer[0][i] << 16) & 0xFF0000) | ((buffer[0][i+1] << 8)
-    //   & 0x00FF00) | (buffer[0][i+2] & 0x0000FF); image->data[row *
-    //   image->width + (i / cinfo.output_components)] = hexval;
-    // }
-    memcpy(&image->data[row * image->width], buffer[0], row_stride);
-    row += 1;
+  /* The part of the JPEG that lands inside the target */
+  int x0 = x < 0 ? -x : 0;
+  int y0 = y < 0 ? -y : 0;
+  int x1 = x + width > image->width ? image->width - x : width;
+  int y1 = y + height > image->height ? image->height - y : height;
+
+  if (area && x0 < x1 && y0 < y1)
+    *area = (rect_t){x + x0, y + y0, x1 - x0, y1 - y0};
+
+  if (x0 < x1 && y0 < y1) {
+    /* Rows that fit completely are decoded in place, others go through one
+     * scratch row and only their visible part is copied. */
+    bool direct = x0 == 0 && x1 == width;
+    if (!direct)
+      scratch = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+                                           width * 4, 1);
+
+    if (y0 > 0)
+      jpeg_skip_scanlines(&cinfo, y0);
+
+    while ((int)cinfo.output_scanline < y1) {
+      int row = cinfo.output_scanline;
+      int count = y1 - row;
+      JSAMPROW rows[JPEG_BATCH_ROWS];
+
+      if (count > JPEG_BATCH_ROWS)
+        count = JPEG_BATCH_ROWS;
+
+      if (direct) {
+        for (int i = 0; i < count; i++)
+          rows[i] = (JSAMPROW)&image->data[(y + row + i) * image->stride + x];
+        (void)jpeg_read_scanlines(&cinfo, rows, count);
+      } else {
+        (void)jpeg_read_scanlines(&cinfo, scratch, 1);
+        memcpy(&image->data[(y + row) * image->stride + x + x0],
+               scratch[0] + x0 * 4, (x1 - x0) * 4);
+      }
+    }
   }
 
-  /* Step 7: Finish decompression */
+  /* Step 7: Finish decompression. Rows below the target are never decoded,
+   * aborting instead of finishing skips them. */
 
-  (void)jpeg_finish_decompress(&cinfo);
-  /* We can ignore the return value since suspension is not possible
-   * with the stdio data source.
-   */
+  if (cinfo.output_scanline < cinfo.output_height)
+    jpeg_abort_decompress(&cinfo);
+  else
+    (void)jpeg_finish_decompress(&cinfo);
 
   /* Step 8: Release JPEG decompression object */
 
@@ -155,23 +215,140 @@ image_t *read_jpeg_file(char *filename) {
   printf("JPEG done.\n");
 #endif
   /* And we're done! */
+  if (out)
+    *out = image;
+  return 0;
+}
+
+image_t *read_jpeg_file_alloc(char *filename, allocator_t *allocator) {
+  image_t *image = NULL;
+
+  if (decode_jpeg(filename, NULL, 0, 0, 0, 0, allocator, &image, NULL))
+    return NULL;
   return image;
 }
 
+image_t *read_jpeg_file(char *filename) {
+  return read_jpeg_file_alloc(filename, NULL);
+}
+
+image_t *read_jpeg_file_fit_alloc(char *filename, int w, int h,
+                                  allocator_t *allocator) {
+  image_t *image = NULL;
+  image_t *fit;
+
+  if (w <= 0 || h <= 0)
+    return NULL;
+  if (decode_jpeg(filename, NULL, 0, 0, w, h, allocator, &image, NULL))
+    return NULL;
+  if (image->width == w && image->height == h)
+    return image;
+
+  /* What's left is less than 2x, or an upscale of a small JPEG */
+  fit = scale_filtered_alloc(image, w, h, SCALE_BILINEAR, allocator);
+  image_free(image);
+  return fit;
+}
+
+image_t *read_jpeg_file_fit(char *filename, int w, int h) {
+  return read_jpeg_file_fit_alloc(filename, w, h, NULL);
+}
+
+int read_jpeg_into(char *filename, image_t *target, int x, int y) {
+  int ret = decode_jpeg(filename, target, x, y, 0, 0, NULL, NULL, NULL);
+
+  /* Failed decodes may have written some rows already */
+  image_touch(target);
+  return ret;
+}
+
+int draw_jpeg_file(int x, int y, char *filename, context_t *context) {
+  rect_t clip = context->clip;
+  image_t target = {&context->data[clip.y * context->stride + clip.x], clip.w,
+                    clip.h, context->stride, NULL, 0};
+  rect_t area;
+  int ret;
+
+  if (clip.w <= 0 || clip.h <= 0)
+    return 0;
+
+  /* Failed decodes may have written some rows already */
+  ret = decode_jpeg(filename, &target, x - clip.x, y - clip.y, 0, 0, NULL,
+                    NULL, &area);
+  context_damage(context, clip.x + area.x, clip.y + area.y, area.w, area.h);
+  return ret;
+}
+
+// The compression half of the demo: XRGB8888 rows go to the encoder as they
+// are, libjpeg-turbo reads B, G, R, X itself. Returns 0 or a negative errno.
+int write_jpeg_file(char *filename, image_t *image, int quality) {
+  struct jpeg_compress_struct cinfo;
+  struct my_error_mgr jerr;
+  /* Written after setjmp(), so it must be volatile to survive longjmp() */
+  FILE *volatile outfile;
+  JSAMPROW row_pointer[1];
+
+  if ((outfile = fopen(filename, "wb")) == NULL) {
+    fprintf(stderr, "can't create %s\n", filename);
+    return -errno;
+  }
+
+  /* Step 1: allocate and initialize JPEG compression object */
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = my_error_exit;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_compress(&cinfo);
+    fclose(outfile);
+    return -EIO;
+  }
+  jpeg_create_compress(&cinfo);
+
+  /* Step 2: specify data destination (eg, a file) */
+  jpeg_stdio_dest(&cinfo, outfile);
+
+  /* Step 3: set parameters for compression */
+  cinfo.image_width = image->width;
+  cinfo.image_height = image->height;
+  cinfo.input_components = 4;
+  cinfo.in_color_space = JCS_EXT_BGRX;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  /* Step 4: Start compressor */
+  jpeg_start_compress(&cinfo, TRUE);
+
+  /* Step 5: while (scan lines remain to be written) */
+  while (cinfo.next_scanline < cinfo.image_height) {
+    row_pointer[0] =
+        (JSAMPROW)&image->data[cinfo.next_scanline * image->stride];
+    (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
+  }
+
+  /* Step 6: Finish compression */
+  jpeg_finish_compress(&cinfo);
+
+  /* Step 7: release JPEG compression object */
+  jpeg_destroy_compress(&cinfo);
+
+  if (fclose(outfile))
+    return -errno;
+  return 0;
+}
+
 /*
  * SOME FINE POINTS:
  *
- * In the above code, we ignored the return value of jpeg_read_scanlines,
- * which is the number of scanlines actually read.  We could get away with
- * this because we asked for only one line at a time and we weren't using
- * a suspending data source.  See libjpeg.doc for more info.
+ * In decode_jpeg, we ignore the return value of jpeg_read_scanlines, which
+ * is the number of scanlines actually read.  libjpeg may return fewer than
+ * the JPEG_BATCH_ROWS we ask for, so every batch starts again from
+ * cinfo.output_scanline rather than from a count of our own.  With a
+ * suspending data source a call could also return 0; we don't use one.
  *
- * We cheated a bit by calling alloc_sarray() after jpeg_start_decompress();
- * we should have done it beforehand to ensure that the space would be
- * counted against the JPEG max_memory setting.  In some systems the above
- * code would risk an out-of-memory error.  However, in general we don't
- * know the output image dimensions before jpeg_start_decompress(), unless we
- * call jpeg_calc_output_dimensions().  See libjpeg.doc for more about this.
+ * Rows that fit the target completely are decoded straight into it, so no
+ * row buffer is needed.  Only the clipped path allocates a single scratch row
+ * with alloc_sarray() after jpeg_start_decompress(), once the output width
+ * is known.  It is small enough that not counting it against the
+ * max_memory setting doesn't matter.
  *
  * Scanlines are returned in the same order as they appear in the JPEG file,
  * which is standardly top-to-bottom.  If you must emit data bottom-to-top,
@@ -4,5 +4,28 @@
 #define __JPEG_H_
 
 image_t* read_jpeg_file (char * filename);
+// Same, the image comes from allocator (see alloc.h).
+image_t* read_jpeg_file_alloc (char * filename, allocator_t * allocator);
 
-#endif
\ No newline at end of file
+// Decode filename to exactly w x h, cropped to that aspect ratio like scale().
+// The decoder shrinks by the largest 1/8 step that keeps the image at least
+// w x h, so only the remainder is left for scale_filtered(). Much faster than
+// scale(read_jpeg_file()) for thumbnails.
+image_t* read_jpeg_file_fit (char * filename, int w, int h);
+image_t* read_jpeg_file_fit_alloc (char * filename, int w, int h, allocator_t * allocator);
+
+// Decode straight into target with the JPEG's top left corner at x, y, e.g. a
+// view of a framebuffer, without an intermediate image. The part outside the
+// target is dropped; rows below it aren't even decoded. Returns 0 or a
+// negative errno.
+int read_jpeg_into (char * filename, image_t * target, int x, int y);
+
+// read_jpeg_into the context's clip rect, damaging the part the image
+// covers. Failed decodes damage it too, they may have drawn some rows.
+int draw_jpeg_file (int x, int y, char * filename, context_t * context);
+
+// Encode XRGB8888 pixels (a context's, or a copy of them) at quality 1 to 100.
+// The filler byte is ignored. Returns 0 or a negative errno.
+int write_jpeg_file (char * filename, image_t * image, int quality);
+
+#endif
@@ -17,30 +17,70 @@
  */
 
 #include "img-png.h"
+#include "span.h"
+#include <errno.h>
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
-
-// Adapted libpng demo to write to our image_t struct.
-image_t *read_png_file(char *filename) {
+#include <string.h>
+
+// Called after each interlace pass of a progressive draw, once the pass is
+// on the context and recorded as damage. area is the part of the context the
+// image covers, empty until the header is read; x, y is where the target
+// starts on the context.
+typedef struct {
+  context_t *context;
+  int x;
+  int y;
+  rect_t area;
+  read_png_pass_fn fn;
+  void *user;
+} png_progress_t;
+
+// Adapted libpng demo to write to our image_t struct. Decode filename with its
+// top left corner at x, y of target, dropping what falls outside. Without a
+// target, allocate one of the image's size from allocator and return it in
+// *out. Returns 0 or a negative errno.
+static int decode_png(char *filename, image_t *target, int x, int y,
+                      png_progress_t *progress, allocator_t *allocator,
+                      image_t **out) {
   int width, height;
   png_byte color_type;
   png_byte bit_depth;
-  png_bytep *row_pointers;
+  int passes;
+  int has_alpha;
+  /* Written after setjmp(), so they must be volatile to survive longjmp() */
+  image_t *volatile image = target;
+  png_bytep volatile scratch = NULL;
 
   FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "can't open %s\n", filename);
+    return -errno;
+  }
 
   png_structp png =
       png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png)
-    abort();
+  if (!png) {
+    fclose(fp);
+    return -ENOMEM;
+  }
 
   png_infop info = png_create_info_struct(png);
-  if (!info)
-    abort();
+  if (!info) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    fclose(fp);
+    return -ENOMEM;
+  }
 
-  if (setjmp(png_jmpbuf(png)))
-    abort();
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+    free(scratch);
+    if (image != target)
+      image_free(image);
+    return -EINVAL;
+  }
 
   png_init_io(png, fp);
 
@@ -50,8 +90,11 @@ image_t *read_png_file(char *filename) {
   height = png_get_image_height(png, info);
   color_type = png_get_color_type(png, info);
   bit_depth = png_get_bit_depth(png, info);
+  has_alpha = (color_type & PNG_COLOR_MASK_ALPHA) ||
+              png_get_valid(png, info, PNG_INFO_tRNS);
 
-  // Read any color_type into 8bit depth, RGBA format.
+  // Read any color_type into 8bit depth, BGRA byte order, which is ARGB8888
+  // in a little endian int. Rows then land in image_t as they are.
   // See http://www.libpng.org/pub/png/libpng-manual.txt
 
   if (bit_depth == 16)
@@ -76,90 +119,192 @@ image_t *read_png_file(char *filename) {
       color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
     png_set_gray_to_rgb(png);
 
-  png_read_update_info(png, info);
+  png_set_bgr(png);
 
-  row_pointers = (png_bytep *)malloc(sizeof(png_bytep) * height);
-  for (int y = 0; y < height; y++) {
-    row_pointers[y] = (png_byte *)malloc(png_get_rowbytes(png, info));
-  }
+  // 1 for plain PNGs, 7 for Adam7. Each pass delivers every row again.
+  passes = png_set_interlace_handling(png);
 
-  png_read_image(png, row_pointers);
+  png_read_update_info(png, info);
 
-  image_t *image_array = malloc(sizeof(image_t));
-  image_array->data = malloc(width * height * sizeof(int));
-  image_array->width = width;
-  image_array->height = height;
+  if (image == NULL) {
+    image = image_create(width, height, allocator);
+    if (image == NULL)
+      png_error(png, "out of memory");
+  }
 
-  for (int y = 0; y < height; y++) {
-    png_bytep row = row_pointers[y];
-    for (int x = 0; x < width; x++) {
-      png_bytep px = &(row[x * 4]);
-      int hexval = ((px[0] << 16) & 0xFF0000) | ((px[1] << 8) & 0x00FF00) |
-                   ((px[2]) & 0x0000FF);
+  // The part of the PNG that lands inside the target
+  int x0 = x < 0 ? -x : 0;
+  int y0 = y < 0 ? -y : 0;
+  int x1 = x + width > image->width ? image->width - x : width;
+  int y1 = y + height > image->height ? image->height - y : height;
+  int visible = x0 < x1 && y0 < y1;
+
+  if (progress != NULL && visible)
+    progress->area = (rect_t){progress->x + x + x0, progress->y + y + y0,
+                              x1 - x0, y1 - y0};
+
+  // Visible rows that fit completely are decoded in place. Everything else
+  // goes through one scratch row: rows above or below the target are thrown
+  // away, partly visible ones are copied.
+  if (!visible || x0 > 0 || x1 < width || y0 > 0 || y1 < height) {
+    scratch = malloc(png_get_rowbytes(png, info));
+    if (scratch == NULL)
+      png_error(png, "out of memory");
+  }
 
-      // Save to the thing. todo: take image background param.
-      image_array->data[y * width + x] = hexval;
+  for (int pass = 0; pass < passes; pass++) {
+    for (int row = 0; row < height; row++) {
+      int inside = visible && row >= y0 && row < y1;
+      int *dst = inside ? &image->data[(y + row) * image->stride + x] : NULL;
+      png_bytep buf = scratch;
+
+      if (inside && x0 == 0 && x1 == width) {
+        buf = (png_bytep)dst;
+      } else if (inside && passes > 1) {
+        // Later passes fill in between the pixels of earlier ones.
+        memcpy(scratch + x0 * 4, dst + x0, (x1 - x0) * 4);
+      }
+
+      // Progressive draws replicate each pass's pixels over the gaps
+      // ("rectangle" mode), later passes overwrite them.
+      if (progress != NULL && passes > 1)
+        png_read_row(png, NULL, buf);
+      else
+        png_read_row(png, buf, NULL);
+
+      if (inside && buf == scratch)
+        memcpy(dst + x0, scratch + x0 * 4, (x1 - x0) * 4);
+
+      // Premultiply rows once they are final, interlaced ones after the
+      // last pass.
+      if (inside && has_alpha && passes == 1)
+        span_premultiply(dst + x0, x1 - x0);
+    }
 
-      // printf("%4d, %4d = RGBA(%x, %x, %x, %x) #%x\n", x, y, px[0], px[1],
-      // px[2], px[3], hexval);
+    if (visible && has_alpha && passes > 1 && pass == passes - 1) {
+      for (int row = y0; row < y1; row++)
+        span_premultiply(&image->data[(y + row) * image->stride + x + x0],
+                         x1 - x0);
     }
-  }
 
-  // Free the roes,
-  for (int y = 0; y < height; y++) {
-    free(row_pointers[y]);
+    if (progress != NULL) {
+      context_damage(progress->context, progress->area.x, progress->area.y,
+                     progress->area.w, progress->area.h);
+      if (progress->fn != NULL)
+        progress->fn(pass, passes, progress->user);
+    }
   }
 
-  free(row_pointers);
+  png_read_end(png, NULL);
+  png_destroy_read_struct(&png, &info, NULL);
+  free(scratch);
 
   fclose(fp);
 
-  return image_array;
+  if (out)
+    *out = image;
+  return 0;
 }
 
-//  void write_png_file(char *filename) {
-//    int y;
+image_t *read_png_file_alloc(char *filename, allocator_t *allocator) {
+  image_t *image = NULL;
 
-//    FILE *fp = fopen(filename, "wb");
-//    if(!fp) abort();
+  if (decode_png(filename, NULL, 0, 0, NULL, allocator, &image))
+    return NULL;
+  return image;
+}
 
-//    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
-//    NULL, NULL); if (!png) abort();
+image_t *read_png_file(char *filename) {
+  return read_png_file_alloc(filename, NULL);
+}
 
-//    png_infop info = png_create_info_struct(png);
-//    if (!info) abort();
+int read_png_into(char *filename, image_t *target, int x, int y) {
+  int ret = decode_png(filename, target, x, y, NULL, NULL, NULL);
 
-//    if (setjmp(png_jmpbuf(png))) abort();
+  /* Failed decodes may have written some rows already */
+  image_touch(target);
+  return ret;
+}
 
-//    png_init_io(png, fp);
+int draw_png_file_progressive(int x, int y, char *filename,
+                              context_t *context, read_png_pass_fn fn,
+                              void *user) {
+  rect_t clip = context->clip;
+  image_t target = {&context->data[clip.y * context->stride + clip.x], clip.w,
+                    clip.h, context->stride, NULL, 0};
+  png_progress_t progress = {context, clip.x, clip.y, {0, 0, 0, 0}, fn, user};
+  int ret;
+
+  if (clip.w <= 0 || clip.h <= 0)
+    return 0;
+
+  ret = decode_png(filename, &target, x - clip.x, y - clip.y, &progress, NULL,
+                   NULL);
+  /* Failed decodes may have written some rows already */
+  if (ret != 0)
+    context_damage(context, progress.area.x, progress.area.y, progress.area.w,
+                   progress.area.h);
+  return ret;
+}
 
-//    // Output is 8bit depth, RGBA format.
-//    png_set_IHDR(
-//      png,
-//      info,
-//      width, height,
-//      8,
-//      PNG_COLOR_TYPE_RGBA,
-//      PNG_INTERLACE_NONE,
-//      PNG_COMPRESSION_TYPE_DEFAULT,
-//      PNG_FILTER_TYPE_DEFAULT
-//    );
-//    png_write_info(png, info);
+int draw_png_file(int x, int y, char *filename, context_t *context) {
+  return draw_png_file_progressive(x, y, filename, context, NULL, NULL);
+}
 
-//    // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-//    // Use png_set_filler().
-//    //png_set_filler(png, 0, PNG_FILLER_AFTER);
+// The libpng demo's writer, row by row straight from the image. XRGB8888 is
+// B, G, R, X in memory, which libpng takes as RGB with the filler dropped.
+int write_png_file(char *filename, image_t *image) {
+  /* Written after setjmp(), so it must be volatile to survive longjmp() */
+  FILE *volatile fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "can't create %s\n", filename);
+    return -errno;
+  }
 
-//    png_write_image(png, row_pointers);
-//    png_write_end(png, NULL);
+  png_structp png =
+      png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!png) {
+    fclose(fp);
+    return -ENOMEM;
+  }
 
-//    for(int y = 0; y < height; y++) {
-//      free(row_pointers[y]);
-//    }
-//    free(row_pointers);
+  png_infop info = png_create_info_struct(png);
+  if (!info) {
+    png_destroy_write_struct(&png, NULL);
+    fclose(fp);
+    return -ENOMEM;
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    fclose(fp);
+    return -EIO;
+  }
 
-//    fclose(fp);
-//  }
+  png_init_io(png, fp);
+
+  // Output is 8bit depth, RGB format.
+  png_set_IHDR(png, info, image->width, image->height, 8, PNG_COLOR_TYPE_RGB,
+               PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+  // Screens compress well anyway, the fastest level keeps encoding cheap.
+  png_set_compression_level(png, 1);
+  png_write_info(png, info);
+
+  png_set_bgr(png);
+  png_set_filler(png, 0, PNG_FILLER_AFTER);
+
+  for (int y = 0; y < image->height; y++) {
+    png_write_row(png, (png_const_bytep)&image->data[y * image->stride]);
+  }
+  png_write_end(png, NULL);
+  png_destroy_write_struct(&png, &info);
+
+  if (fclose(fp)) {
+    return -errno;
+  }
+  return 0;
+}
 
 //  int main(int argc, char *argv[]) {
 //   // if(argc != 3) abort();
@@ -3,6 +3,32 @@
 
 #include "draw.h"
 
+// Returns premultiplied ARGB8888, opaque PNGs come out with alpha 0xFF.
 image_t* read_png_file (char * filename);
+// Same, the image comes from allocator (see alloc.h).
+image_t* read_png_file_alloc (char * filename, allocator_t * allocator);
+
+// Decode straight into target with the PNG's top left corner at x, y, one row
+// at a time and without an intermediate image. The part outside the target
+// is dropped. Returns 0 or a negative errno.
+int read_png_into (char * filename, image_t * target, int x, int y);
+
+// read_png_into the context's clip rect, damaging the part the image covers,
+// also when decoding fails part way. The pixels are copied, not blended.
+int draw_png_file (int x, int y, char * filename, context_t * context);
+
+// Called after each of the passes of a progressive draw. Present the context
+// here to show the image sharpening; plain PNGs have a single pass.
+typedef void (*read_png_pass_fn)(int pass, int passes, void * user);
+
+// draw_png_file, showing interlaced PNGs coarse first: each pass fills the
+// gaps to the next one. Translucent pixels are premultiplied after the last
+// pass, earlier passes show them too bright.
+int draw_png_file_progressive (int x, int y, char * filename, context_t * context,
+                               read_png_pass_fn fn, void * user);
+
+// Write XRGB8888 pixels (a context's, or a copy of them) as an RGB PNG, the
+// filler byte is dropped. Returns 0 or a negative errno.
+int write_png_file (char * filename, image_t * image);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,477 @@
+#include "loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "img-jpeg.h"
+#include "img-png.h"
+
+// Queued and decoding entries are both LOADER_PENDING to callers.
+#define ENTRY_QUEUED -1
+#define ENTRY_DECODING -2
+
+typedef struct loader_entry loader_entry_t;
+
+struct loader_request {
+  loader_entry_t *entry;
+  loader_fn fn;
+  void *user;
+  int notified;
+  unsigned long generation;
+  loader_request_t *next;
+};
+
+// One file at one size. Entries stay in the LRU list from loader_load until
+// they are evicted; only the decode queue and the result fields are shared
+// with the workers.
+struct loader_entry {
+  char *path;
+  int width;
+  int height;
+  loader_request_t *requests;
+  loader_entry_t *prev;
+  loader_entry_t *next;
+
+  // Under the lock.
+  int state;
+  image_t *image;
+  loader_entry_t *queue_next;
+};
+
+struct loader {
+  pthread_t *threads;
+  int count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t finished;
+  loader_entry_t *queue_head;
+  loader_entry_t *queue_tail;
+  size_t bytes;
+  int quit;
+
+  // Workers write a byte for every finished entry.
+  int pipe[2];
+
+  // Most recently used first.
+  loader_entry_t *lru_head;
+  loader_entry_t *lru_tail;
+  size_t budget;
+
+  // Entries must not go away under loader_dispatch, and requests made by its
+  // callbacks wait for the next one.
+  int dispatching;
+  unsigned long generation;
+};
+
+static int is_png(const char *path) {
+  size_t len = strlen(path);
+  return len > 4 && strcmp(path + len - 4, ".png") == 0;
+}
+
+static image_t *loader_decode(const char *path, int w, int h) {
+  int fit = w > 0 && h > 0;
+  image_t *image;
+
+  // JPEGs shrink while decoding, PNGs have to be scaled afterwards.
+  if (!is_png(path) && fit) {
+    return read_jpeg_file_fit((char *)path, w, h);
+  }
+
+  image = is_png(path) ? read_png_file((char *)path)
+                       : read_jpeg_file((char *)path);
+  if (image != NULL && fit && (image->width != w || image->height != h)) {
+    image_t *scaled = scale_filtered(image, w, h, SCALE_BILINEAR);
+    image_free(image);
+    image = scaled;
+  }
+  return image;
+}
+
+static size_t image_bytes(const image_t *image) {
+  return image ? sizeof(int) * image->stride * image->height : 0;
+}
+
+static void *loader_worker(void *data) {
+  loader_t *loader = data;
+
+  pthread_mutex_lock(&loader->lock);
+  for (;;) {
+    while (!loader->quit && loader->queue_head == NULL) {
+      pthread_cond_wait(&loader->work, &loader->lock);
+    }
+    if (loader->quit) {
+      break;
+    }
+
+    loader_entry_t *entry = loader->queue_head;
+    loader->queue_head = entry->queue_next;
+    if (loader->queue_head == NULL) {
+      loader->queue_tail = NULL;
+    }
+    entry->state = ENTRY_DECODING;
+    pthread_mutex_unlock(&loader->lock);
+
+    // Decoding entries are never freed, path stays valid.
+    image_t *image = loader_decode(entry->path, entry->width, entry->height);
+
+    pthread_mutex_lock(&loader->lock);
+    entry->image = image;
+    entry->state = image ? LOADER_DONE : LOADER_FAILED;
+    loader->bytes += image_bytes(image);
+    pthread_cond_broadcast(&loader->finished);
+
+    // A full pipe already wakes the loop up.
+    char byte = 0;
+    if (write(loader->pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+      fprintf(stderr, "loader: cannot signal completion (%d): %m\n", errno);
+    }
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  return NULL;
+}
+
+loader_t *loader_create(int threads, size_t budget) {
+  loader_t *loader = malloc(sizeof(loader_t));
+  if (loader == NULL) {
+    return NULL;
+  }
+
+  memset(loader, 0, sizeof(*loader));
+  loader->budget = budget;
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  if (pipe(loader->pipe) < 0) {
+    fprintf(stderr, "loader: cannot create pipe (%d): %m\n", errno);
+    free(loader);
+    return NULL;
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(loader->pipe[i], F_SETFL,
+          fcntl(loader->pipe[i], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(loader->pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  pthread_mutex_init(&loader->lock, NULL);
+  pthread_cond_init(&loader->work, NULL);
+  pthread_cond_init(&loader->finished, NULL);
+
+  loader->threads = malloc(sizeof(pthread_t) * threads);
+  if (loader->threads == NULL) {
+    loader_free(loader);
+    return NULL;
+  }
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&loader->threads[i], NULL, loader_worker, loader) !=
+        0) {
+      fprintf(stderr, "loader: cannot start thread %d\n", i);
+      loader_free(loader);
+      return NULL;
+    }
+    loader->count++;
+  }
+
+  return loader;
+}
+
+static void lru_unlink(loader_t *loader, loader_entry_t *entry) {
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    loader->lru_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    loader->lru_tail = entry->prev;
+  }
+  entry->prev = entry->next = NULL;
+}
+
+static void lru_push(loader_t *loader, loader_entry_t *entry) {
+  entry->next = loader->lru_head;
+  if (loader->lru_head) {
+    loader->lru_head->prev = entry;
+  } else {
+    loader->lru_tail = entry;
+  }
+  loader->lru_head = entry;
+}
+
+static void entry_free(loader_entry_t *entry) {
+  while (entry->requests) {
+    loader_request_t *next = entry->requests->next;
+    free(entry->requests);
+    entry->requests = next;
+  }
+  if (entry->image) {
+    image_free(entry->image);
+  }
+  free(entry->path);
+  free(entry);
+}
+
+void loader_free(loader_t *loader) {
+  if (loader == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&loader->lock);
+  loader->quit = 1;
+  pthread_cond_broadcast(&loader->work);
+  pthread_mutex_unlock(&loader->lock);
+
+  for (int i = 0; i < loader->count; i++) {
+    pthread_join(loader->threads[i], NULL);
+  }
+
+  while (loader->lru_head) {
+    loader_entry_t *entry = loader->lru_head;
+    lru_unlink(loader, entry);
+    entry_free(entry);
+  }
+
+  pthread_cond_destroy(&loader->finished);
+  pthread_cond_destroy(&loader->work);
+  pthread_mutex_destroy(&loader->lock);
+  close(loader->pipe[0]);
+  close(loader->pipe[1]);
+  free(loader->threads);
+  free(loader);
+}
+
+// Drop unused entries, failed ones always, finished ones from the least
+// recently used end while those nobody holds are over budget. Held images
+// don't count, they can't go anyway.
+static void loader_evict(loader_t *loader) {
+  if (loader->dispatching) {
+    return;
+  }
+
+  pthread_mutex_lock(&loader->lock);
+  size_t unheld = 0;
+  for (loader_entry_t *entry = loader->lru_head; entry; entry = entry->next) {
+    if (entry->requests == NULL && entry->state == LOADER_DONE) {
+      unheld += image_bytes(entry->image);
+    }
+  }
+
+  loader_entry_t *entry = loader->lru_tail;
+  while (entry) {
+    loader_entry_t *prev = entry->prev;
+
+    if (entry->requests == NULL &&
+        (entry->state == LOADER_FAILED ||
+         (entry->state == LOADER_DONE && unheld > loader->budget))) {
+      if (entry->state == LOADER_DONE) {
+        unheld -= image_bytes(entry->image);
+      }
+      loader->bytes -= image_bytes(entry->image);
+      lru_unlink(loader, entry);
+      entry_free(entry);
+    }
+    entry = prev;
+  }
+  pthread_mutex_unlock(&loader->lock);
+}
+
+static loader_entry_t *loader_find(loader_t *loader, const char *path, int w,
+                                   int h) {
+  for (loader_entry_t *entry = loader->lru_head; entry; entry = entry->next) {
+    if (entry->width == w && entry->height == h &&
+        strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+loader_request_t *loader_load(loader_t *loader, const char *path, int w,
+                              int h, loader_fn fn, void *user) {
+  loader_request_t *request = malloc(sizeof(loader_request_t));
+  if (request == NULL) {
+    return NULL;
+  }
+
+  if (w <= 0 || h <= 0) {
+    w = h = 0;
+  }
+
+  loader_entry_t *entry = loader_find(loader, path, w, h);
+  if (entry != NULL) {
+    lru_unlink(loader, entry);
+  } else {
+    entry = malloc(sizeof(loader_entry_t));
+    char *copy = malloc(strlen(path) + 1);
+    if (entry == NULL || copy == NULL) {
+      free(entry);
+      free(copy);
+      free(request);
+      return NULL;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    strcpy(copy, path);
+    entry->path = copy;
+    entry->width = w;
+    entry->height = h;
+    entry->state = ENTRY_QUEUED;
+
+    pthread_mutex_lock(&loader->lock);
+    if (loader->queue_tail) {
+      loader->queue_tail->queue_next = entry;
+    } else {
+      loader->queue_head = entry;
+    }
+    loader->queue_tail = entry;
+    pthread_cond_signal(&loader->work);
+    pthread_mutex_unlock(&loader->lock);
+  }
+  lru_push(loader, entry);
+
+  request->entry = entry;
+  request->fn = fn;
+  request->user = user;
+  request->notified = 0;
+  request->generation = loader->generation;
+  request->next = entry->requests;
+  entry->requests = request;
+
+  // Cached already: the callback still comes from loader_dispatch.
+  if (loader_state(loader, request) != LOADER_PENDING) {
+    char byte = 0;
+    if (write(loader->pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+      fprintf(stderr, "loader: cannot signal completion (%d): %m\n", errno);
+    }
+  }
+
+  loader_evict(loader);
+  return request;
+}
+
+int loader_state(loader_t *loader, loader_request_t *request) {
+  pthread_mutex_lock(&loader->lock);
+  int state = request->entry->state;
+  pthread_mutex_unlock(&loader->lock);
+
+  return state < 0 ? LOADER_PENDING : state;
+}
+
+image_t *loader_image(loader_t *loader, loader_request_t *request) {
+  pthread_mutex_lock(&loader->lock);
+  image_t *image = request->entry->image;
+  pthread_mutex_unlock(&loader->lock);
+
+  return image;
+}
+
+int loader_wait(loader_t *loader, loader_request_t *request) {
+  pthread_mutex_lock(&loader->lock);
+  while (request->entry->state < 0) {
+    pthread_cond_wait(&loader->finished, &loader->lock);
+  }
+  int state = request->entry->state;
+  pthread_mutex_unlock(&loader->lock);
+
+  return state;
+}
+
+void loader_release(loader_t *loader, loader_request_t *request) {
+  loader_entry_t *entry = request->entry;
+  loader_request_t **link = &entry->requests;
+
+  while (*link != request) {
+    link = &(*link)->next;
+  }
+  *link = request->next;
+  free(request);
+
+  if (entry->requests != NULL) {
+    return;
+  }
+
+  // Nobody waits for it any more, take it off the queue if no worker has.
+  int cancelled = 0;
+  pthread_mutex_lock(&loader->lock);
+  if (entry->state == ENTRY_QUEUED) {
+    loader_entry_t **queue = &loader->queue_head;
+    loader_entry_t *prev = NULL;
+
+    while (*queue != entry) {
+      prev = *queue;
+      queue = &(*queue)->queue_next;
+    }
+    *queue = entry->queue_next;
+    if (loader->queue_tail == entry) {
+      loader->queue_tail = prev;
+    }
+    cancelled = 1;
+  }
+  pthread_mutex_unlock(&loader->lock);
+
+  if (cancelled) {
+    lru_unlink(loader, entry);
+    entry_free(entry);
+  }
+
+  loader_evict(loader);
+}
+
+int loader_event_fd(loader_t *loader) { return loader->pipe[0]; }
+
+int loader_dispatch(loader_t *loader) {
+  char bytes[64];
+  int ran = 0;
+
+  while (read(loader->pipe[0], bytes, sizeof(bytes)) > 0) {
+  }
+
+  // Callbacks may load and release requests. Nothing is evicted until we are
+  // done; a release only frees entries still queued, and those have no
+  // callbacks to run. We look again for requests after every call.
+  loader->dispatching = 1;
+  unsigned long generation = ++loader->generation;
+  for (loader_entry_t *entry = loader->lru_head; entry; entry = entry->next) {
+    for (;;) {
+      loader_request_t *request = entry->requests;
+
+      if (request == NULL || loader_state(loader, request) == LOADER_PENDING) {
+        break;
+      }
+      while (request != NULL &&
+             (request->notified || request->generation == generation)) {
+        request = request->next;
+      }
+      if (request == NULL) {
+        break;
+      }
+
+      request->notified = 1;
+      if (request->fn) {
+        request->fn(loader, request, request->user);
+        ran++;
+      }
+    }
+  }
+  loader->dispatching = 0;
+
+  loader_evict(loader);
+  return ran;
+}
+
+size_t loader_cached_bytes(loader_t *loader) {
+  pthread_mutex_lock(&loader->lock);
+  size_t bytes = loader->bytes;
+  pthread_mutex_unlock(&loader->lock);
+
+  return bytes;
+}
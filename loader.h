@@ -0,0 +1,69 @@
+#ifndef __LOADER_H_
+#define __LOADER_H_
+
+#include <stddef.h>
+
+#include "draw.h"
+
+// Decodes PNG and JPEG files on background threads and keeps the results in
+// an LRU cache, so the render loop never waits for a decode. loader_load()
+// returns a request at once; draw a placeholder until loader_image() returns
+// the image. Requests for the same file and size share one decode and one
+// cached image.
+//
+// Completion is signalled on loader_event_fd(). Hand it to loop_add_fd() and
+// call loader_dispatch() from the callback: it runs the request callbacks on
+// the loop thread, where they can mark the loop dirty.
+//
+// Everything except the decoding happens on the thread calling the loader
+// functions, one thread per loader.
+
+// Default cache budget for decoded pixels.
+#define LOADER_DEFAULT_BUDGET (64 << 20)
+
+enum { LOADER_PENDING, LOADER_DONE, LOADER_FAILED };
+
+typedef struct loader loader_t;
+typedef struct loader_request loader_request_t;
+
+typedef void (*loader_fn)(loader_t* loader, loader_request_t* request, void* user);
+
+// threads decode in parallel, < 1 picks 1. budget is how many bytes of
+// decoded images may stay cached while no request holds them, 0 keeps
+// nothing. Returns NULL on failure.
+loader_t* loader_create(int threads, size_t budget);
+// Also frees all requests and cached images.
+void loader_free(loader_t* loader);
+
+// Decode path to w x h, cropped to that aspect ratio like scale(). 0 x 0
+// keeps the file's size. Files ending in .png are read as PNG, others as
+// JPEG. fn, if any, is called from loader_dispatch() once the image is ready
+// or failed, even when it was already cached. Returns NULL without memory.
+loader_request_t* loader_load(loader_t* loader, const char* path, int w, int h,
+                              loader_fn fn, void* user);
+
+// LOADER_PENDING, LOADER_DONE or LOADER_FAILED.
+int loader_state(loader_t* loader, loader_request_t* request);
+
+// The decoded image once LOADER_DONE, NULL before. It belongs to the cache
+// and stays valid until the request is released.
+image_t* loader_image(loader_t* loader, loader_request_t* request);
+
+// Block until the request is done or failed, returns its state.
+int loader_wait(loader_t* loader, loader_request_t* request);
+
+// Drop a request, it must not be used afterwards. A decode nobody else waits
+// for is cancelled unless it already started; a started one finishes into
+// the cache.
+void loader_release(loader_t* loader, loader_request_t* request);
+
+// Readable when requests finished.
+int loader_event_fd(loader_t* loader);
+
+// Run the callbacks of finished requests. Returns how many ran.
+int loader_dispatch(loader_t* loader);
+
+// Bytes of decoded images held by the cache, in use or not.
+size_t loader_cached_bytes(loader_t* loader);
+
+#endif
@@ -0,0 +1,236 @@
+#include "loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+typedef struct {
+  int fd;
+  loop_fd_fn fn;
+  void *user;
+} loop_watch_t;
+
+typedef struct {
+  int id;
+  int repeat;
+  uint64_t interval;
+  uint64_t due;
+  loop_timer_fn fn;
+  void *user;
+} loop_timer_t;
+
+struct loop {
+  context_t *context;
+  loop_render_fn render;
+  void *user;
+
+  // Removed entries keep fn == NULL until the next sweep, so callbacks can
+  // remove anything while we iterate.
+  loop_watch_t watches[LOOP_MAX_FDS];
+  int watch_count;
+  loop_timer_t timers[LOOP_MAX_TIMERS];
+  int timer_count;
+  int next_timer;
+
+  bool dirty;
+  volatile sig_atomic_t quit;
+};
+
+loop_t *loop_create(context_t *context, loop_render_fn render, void *user) {
+  loop_t *loop = malloc(sizeof(loop_t));
+  if (loop == NULL) {
+    return NULL;
+  }
+
+  memset(loop, 0, sizeof(*loop));
+  loop->context = context;
+  loop->render = render;
+  loop->user = user;
+  loop->next_timer = 1;
+  loop->dirty = true;
+  return loop;
+}
+
+void loop_free(loop_t *loop) { free(loop); }
+
+int loop_add_fd(loop_t *loop, int fd, loop_fd_fn fn, void *user) {
+  if (fd < 0 || fn == NULL) {
+    return -EINVAL;
+  }
+  if (loop->watch_count == LOOP_MAX_FDS) {
+    return -ENOSPC;
+  }
+
+  loop->watches[loop->watch_count++] = (loop_watch_t){fd, fn, user};
+  return 0;
+}
+
+void loop_remove_fd(loop_t *loop, int fd) {
+  for (int i = 0; i < loop->watch_count; i++) {
+    if (loop->watches[i].fd == fd) {
+      loop->watches[i].fn = NULL;
+    }
+  }
+}
+
+int loop_add_timer(loop_t *loop, int ms, int repeat, loop_timer_fn fn,
+                   void *user) {
+  if (ms < 0 || fn == NULL) {
+    return -EINVAL;
+  }
+  if (loop->timer_count == LOOP_MAX_TIMERS) {
+    return -ENOSPC;
+  }
+
+  loop_timer_t *timer = &loop->timers[loop->timer_count++];
+  timer->id = loop->next_timer++;
+  timer->repeat = repeat;
+  timer->interval = (uint64_t)ms * 1000000;
+  timer->due = stats_now() + timer->interval;
+  timer->fn = fn;
+  timer->user = user;
+  return timer->id;
+}
+
+void loop_remove_timer(loop_t *loop, int timer) {
+  for (int i = 0; i < loop->timer_count; i++) {
+    if (loop->timers[i].id == timer) {
+      loop->timers[i].fn = NULL;
+    }
+  }
+}
+
+void loop_dirty(loop_t *loop) { loop->dirty = true; }
+
+void loop_quit(loop_t *loop) { loop->quit = 1; }
+
+// Drop removed entries, keeping the order of the rest.
+static void loop_sweep(loop_t *loop) {
+  int n = 0;
+  for (int i = 0; i < loop->watch_count; i++) {
+    if (loop->watches[i].fn != NULL) {
+      loop->watches[n++] = loop->watches[i];
+    }
+  }
+  loop->watch_count = n;
+
+  n = 0;
+  for (int i = 0; i < loop->timer_count; i++) {
+    if (loop->timers[i].fn != NULL) {
+      loop->timers[n++] = loop->timers[i];
+    }
+  }
+  loop->timer_count = n;
+}
+
+// Fire expired timers and return the poll() timeout until the next one.
+static int loop_fire_timers(loop_t *loop) {
+  uint64_t now = stats_now();
+  int count = loop->timer_count;
+
+  // Timers added by callbacks wait for the next round.
+  for (int i = 0; i < count; i++) {
+    loop_timer_t *timer = &loop->timers[i];
+    if (timer->fn == NULL || timer->due > now) {
+      continue;
+    }
+
+    loop_timer_fn fn = timer->fn;
+    void *user = timer->user;
+    int id = timer->id;
+
+    if (timer->repeat && timer->interval > 0) {
+      // Skip missed periods instead of firing them all at once.
+      do {
+        timer->due += timer->interval;
+      } while (timer->due <= now);
+    } else {
+      timer->fn = NULL;
+    }
+
+    fn(loop, id, user);
+  }
+
+  loop_sweep(loop);
+
+  int timeout = -1;
+  now = stats_now();
+  for (int i = 0; i < loop->timer_count; i++) {
+    uint64_t due = loop->timers[i].due;
+    int ms = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+    if (timeout < 0 || ms < timeout) {
+      timeout = ms;
+    }
+  }
+  return timeout;
+}
+
+int loop_run(loop_t *loop) {
+  struct pollfd pfds[LOOP_MAX_FDS + 1];
+  int drm_fd = context_event_fd(loop->context);
+
+  loop->quit = 0;
+
+  while (!loop->quit) {
+    int timeout = loop_fire_timers(loop);
+
+    if (loop->dirty && !context_flip_pending(loop->context)) {
+      loop->dirty = false;
+      loop->render(loop, loop->context, loop->user);
+      context_present_async(loop->context);
+    }
+
+    if (loop->quit) {
+      break;
+    }
+
+    // Something is still dirty and nothing to wait for: go round again.
+    if (loop->dirty && !context_flip_pending(loop->context)) {
+      timeout = 0;
+    }
+
+    int n = 0;
+    if (drm_fd >= 0) {
+      pfds[n++] = (struct pollfd){drm_fd, POLLIN, 0};
+    }
+    int first_watch = n;
+    for (int i = 0; i < loop->watch_count; i++) {
+      pfds[n++] = (struct pollfd){loop->watches[i].fd, POLLIN, 0};
+    }
+
+    int ret = poll(pfds, n, timeout);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "loop: poll failed (%d): %m\n", errno);
+      return -errno;
+    }
+    if (ret == 0) {
+      continue;
+    }
+
+    if (drm_fd >= 0 && (pfds[0].revents & POLLIN)) {
+      context_dispatch(loop->context);
+    }
+
+    int count = loop->watch_count;
+    for (int i = 0; i < count; i++) {
+      loop_watch_t *watch = &loop->watches[i];
+      if (watch->fn != NULL &&
+          (pfds[first_watch + i].revents &
+           (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+        watch->fn(loop, watch->fd, watch->user);
+      }
+    }
+    loop_sweep(loop);
+  }
+
+  return 0;
+}
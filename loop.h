@@ -0,0 +1,46 @@
+#ifndef __LOOP_H_
+#define __LOOP_H_
+
+#include "draw.h"
+
+// A poll() based main loop for one context. It sleeps until a page-flip
+// completes, a watched fd becomes readable or a timer expires, and only calls
+// the render callback when something marked the loop dirty and the previous
+// frame is on screen. An idle loop uses no CPU.
+//
+// Callbacks run on the thread inside loop_run() and may add or remove fds and
+// timers, mark the loop dirty or quit it.
+
+#define LOOP_MAX_FDS 16
+#define LOOP_MAX_TIMERS 16
+
+typedef struct loop loop_t;
+
+typedef void (*loop_render_fn)(loop_t* loop, context_t* context, void* user);
+typedef void (*loop_fd_fn)(loop_t* loop, int fd, void* user);
+typedef void (*loop_timer_fn)(loop_t* loop, int timer, void* user);
+
+// The first frame is rendered as soon as loop_run() starts.
+loop_t* loop_create(context_t* context, loop_render_fn render, void* user);
+void loop_free(loop_t* loop);
+
+// Call fn whenever fd is readable, hung up or closed. stdin and evdev devices
+// work the same way. Returns 0 or a negative errno.
+int loop_add_fd(loop_t* loop, int fd, loop_fd_fn fn, void* user);
+void loop_remove_fd(loop_t* loop, int fd);
+
+// Call fn after ms milliseconds, again every ms milliseconds when repeat is
+// set. Returns a timer id > 0 or a negative errno.
+int loop_add_timer(loop_t* loop, int ms, int repeat, loop_timer_fn fn, void* user);
+void loop_remove_timer(loop_t* loop, int timer);
+
+// Render a new frame as soon as the display can take one.
+void loop_dirty(loop_t* loop);
+
+// Make loop_run() return. Safe to call from a signal handler.
+void loop_quit(loop_t* loop);
+
+// Returns 0 after loop_quit() or a negative errno when waiting failed.
+int loop_run(loop_t* loop);
+
+#endif
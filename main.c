@@ -20,10 +20,11 @@
 
 #include "draw.h"
 #include "font.h"
+#include "loop.h"
 // #include "img-png.h"
 // #include "img-jpeg.h"
 
-int runflag = 1;
+loop_t *loop = NULL;
 int fd = -1;
 
 context_t *context;
@@ -52,7 +53,8 @@ void restore_terminal_mode(struct termios *old_tio) {
 void sig_handler(int signo) {
   if (signo == SIGINT) {
     printf("SIGINT\n");
-    runflag = 0;
+    if (loop != NULL)
+      loop_quit(loop);
   }
 
   // If we segfault in graphics mode, we can't get out.
@@ -67,6 +69,84 @@ void sig_handler(int signo) {
   }
 }
 
+typedef struct {
+  fontmap_t *fontmap;
+  text_run_t *full;
+  char buf[256];
+  int count;
+} demo_t;
+
+const int colors[] = {0xFFFF00, 0xFF0000, 0x00FF00, 0x0000FF, 0x00FFFF};
+const int color_size = 5;
+
+void render(loop_t *loop, context_t *context, void *user) {
+  demo_t *demo = user;
+  int count = demo->count;
+
+  clear_context(context);
+  draw_rect(-100, -100, 200, 200, context, colors[count]);
+  set_pixel(5, 5, context, colors[count]);
+  draw_rect(context->width - 100, context->height - 100, 200, 200, context,
+            colors[(count + 1) % color_size]);
+  draw_rect(context->width - 100, -100, 200, 200, context,
+            colors[(count + 2) % color_size]);
+  draw_rect(-100, context->height - 100, 200, 200, context,
+            colors[(count + 3) % color_size]);
+  draw_rect(context->width / 2 - 200, context->height / 2 - 200, 400, 400,
+            context, colors[(count + 4) % color_size]);
+
+  if (strlen(demo->buf) == 255 && demo->full != NULL)
+    draw_text_run(200, 170, demo->full, context);
+
+  // draw the text, break it into line strings.
+  char bufcpy[256];
+  strcpy(bufcpy, demo->buf);
+
+  char *line = strtok(bufcpy, "\n");
+  int idx = 0;
+
+  while (line != NULL) {
+    draw_string(200, 200 + idx * 30, line, demo->fontmap, context);
+    line = strtok(NULL, "\n");
+    idx++;
+  }
+}
+
+// stdin is readable, take every key that arrived.
+void on_key(loop_t *loop, int fd, void *user) {
+  demo_t *demo = user;
+  char keys[64];
+  ssize_t n = read(fd, keys, sizeof(keys));
+
+  // stdin went away, stop watching it or poll keeps waking us up.
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+    loop_remove_fd(loop, fd);
+    return;
+  }
+
+  for (ssize_t i = 0; i < n; i++) {
+    const int val = keys[i];
+    const char concstr[2] = {val, 0};
+    size_t len = strlen(demo->buf);
+
+    if (val == 127 || val == 8) {
+      if (len > 0)
+        demo->buf[len - 1] = 0;
+    } else if (len < 255)
+      strcat(demo->buf, concstr);
+  }
+
+  loop_dirty(loop);
+}
+
+// Next color once per second.
+void on_tick(loop_t *loop, int timer, void *user) {
+  demo_t *demo = user;
+
+  demo->count = (demo->count + 1) % color_size;
+  loop_dirty(loop);
+}
+
 int main() {
   // Intercept SIGINT so we can shut down graphics loops.
   if (signal(SIGINT, sig_handler) == SIG_ERR) {
@@ -82,7 +162,15 @@ int main() {
   tcgetattr(STDIN_FILENO, &old_tio);
   set_noncanonical_nonblocking_mode(&old_tio);
 
-  context = context_create();
+  // FBDEMO_FORMAT=RGB565 or XRGB2101010 picks the scanout pixel format.
+  int format = PIXEL_XRGB8888;
+  const char *format_name = getenv("FBDEMO_FORMAT");
+  for (int i = 0; format_name != NULL && i < PIXEL_FORMATS; i++) {
+    if (strcmp(format_name, pixel_format(i)->name) == 0)
+      format = i;
+  }
+
+  context = context_create_format(2, format);
   fontmap_t *fontmap = fontmap_default();
   printf("[+] Graphics Context: 0x%x\n", context);
 
@@ -93,65 +181,29 @@ int main() {
   //        return 1;
   //    }
 
-  int count = 0;
-  const int colors[] = {0xFFFF00, 0xFF0000, 0x00FF00, 0x0000FF, 0x00FFFF};
-  const int color_size = 5;
+  // FBDEMO_STATS=1 prints frame and primitive counters on exit.
+  if (context != NULL && getenv("FBDEMO_STATS") != NULL)
+    context_enable_stats(context);
 
   if (context != NULL) {
-    char buf[256] = "Ego in the houseee gimme the musicc";
-
-    int time_ms = 0;
-
-    while (runflag) {
-      clear_context(context);
-      draw_rect(-100, -100, 200, 200, context, colors[count]);
-      set_pixel(5, 5, context, colors[count]);
-      draw_rect(context->width - 100, context->height - 100, 200, 200, context,
-                colors[(count + 1) % color_size]);
-      draw_rect(context->width - 100, -100, 200, 200, context,
-                colors[(count + 2) % color_size]);
-      draw_rect(-100, context->height - 100, 200, 200, context,
-                colors[(count + 3) % color_size]);
-      draw_rect(context->width / 2 - 200, context->height / 2 - 200, 400, 400,
-                context, colors[(count + 4) % color_size]);
-      //            draw_string(200, 200, buf, fontmap, context);
-      const int val = getchar();
-      const char concstr[2] = {val, 0};
-
-      // we got a keypress
-      if (val != -1) {
-        //				printf("%d\n", val);
-        if (val == 127 || val == 8)
-          buf[strlen(buf) - 1] = 0;
-        else if (strlen(buf) < 255)
-          strcat(buf, concstr);
-      }
-
-      if (strlen(buf) == 255)
-        draw_string(200, 170, "Buffer full!", fontmap, context);
-
-      // draw the text, break it into line strings.
-      char bufcpy[256];
-      strcpy(bufcpy, buf);
-
-      char *line = strtok(bufcpy, "\n");
-      int idx = 0;
-
-      while (line != NULL) {
-        draw_string(200, 200 + idx * 30, line, fontmap, context);
-        line = strtok(NULL, "\n");
-        idx++;
-      }
-
-      usleep(20 * 1000);
-      time_ms += 20;
-      time_ms = time_ms % 1000;
-
-      if (time_ms == 0) {
-        ++count;
-        count = count % color_size;
-      }
+    demo_t demo = {fontmap, NULL, "Ego in the houseee gimme the musicc", 0};
+
+    // The same label every time, rendered once.
+    demo.full = text_run_create("Buffer full!", fontmap, 0xFFFFFF, 0x0, 1);
+
+    // Nothing is drawn unless a key arrives or the color changes.
+    loop = loop_create(context, render, &demo);
+    if (loop != NULL) {
+      loop_add_fd(loop, STDIN_FILENO, on_key, &demo);
+      loop_add_timer(loop, 1000, 1, on_tick, &demo);
+      loop_run(loop);
+      loop_free(loop);
+      loop = NULL;
     }
+    text_run_free(demo.full);
+
+    if (context_get_stats(context) != NULL)
+      stats_dump(context_get_stats(context), stderr);
 
     fontmap_free(fontmap);
     context_release(context);
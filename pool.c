@@ -0,0 +1,166 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  worker_pool_t *pool;
+  int index;
+} worker_t;
+
+struct worker_pool {
+  pthread_t *threads;
+  worker_t *workers;
+  int count;
+  int threshold;
+
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  unsigned long generation;
+  int pending;
+  int quit;
+
+  // The job of the current generation.
+  pool_band_fn fn;
+  void *arg;
+  int rows;
+};
+
+// Band index out of count + 1, the caller always takes band 0.
+static void pool_band(worker_pool_t *pool, int index) {
+  int bands = pool->count + 1;
+  int y0 = (int)((long long)pool->rows * index / bands);
+  int y1 = (int)((long long)pool->rows * (index + 1) / bands);
+
+  if (y0 < y1) {
+    pool->fn(pool->arg, y0, y1);
+  }
+}
+
+static void *pool_worker(void *data) {
+  worker_t *worker = data;
+  worker_pool_t *pool = worker->pool;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->quit && pool->generation == seen) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->quit) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_band(pool, worker->index);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
+
+worker_pool_t *pool_create(int threads, int threshold) {
+  worker_pool_t *pool;
+
+  if (threads < 2) {
+    return NULL;
+  }
+
+  pool = malloc(sizeof(worker_pool_t));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->count = 0;
+  pool->threshold = threshold > 0 ? threshold : POOL_DEFAULT_THRESHOLD;
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->quit = 0;
+  pool->threads = malloc(sizeof(pthread_t) * (threads - 1));
+  pool->workers = malloc(sizeof(worker_t) * (threads - 1));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  if (pool->threads == NULL || pool->workers == NULL) {
+    pool_free(pool);
+    return NULL;
+  }
+
+  for (int i = 0; i < threads - 1; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i + 1;
+    if (pthread_create(&pool->threads[i], NULL, pool_worker,
+                       &pool->workers[i])) {
+      fprintf(stderr, "cannot start worker thread %d\n", i);
+      break;
+    }
+    pool->count++;
+  }
+
+  if (pool->count == 0) {
+    pool_free(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void pool_free(worker_pool_t *pool) {
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool->threads);
+  free(pool);
+}
+
+int pool_threads(worker_pool_t *pool) {
+  return pool == NULL ? 1 : pool->count + 1;
+}
+
+void pool_run(worker_pool_t *pool, pool_band_fn fn, void *arg, int rows,
+              int pixels) {
+  if (pool == NULL || pixels < pool->threshold || rows < 2) {
+    fn(arg, 0, rows);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->rows = rows;
+  pool->pending = pool->count;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_band(pool, 0);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
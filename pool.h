@@ -0,0 +1,27 @@
+#ifndef __POOL_H_
+#define __POOL_H_
+
+// A fixed set of worker threads that split row ranges into horizontal bands.
+// pool_run() hands one band to every worker, does one itself on the calling
+// thread and returns once all of them are done, so callers never see a
+// half-finished primitive. A pool serves one calling thread at a time.
+
+// Primitives touching fewer pixels than this stay on the calling thread.
+#define POOL_DEFAULT_THRESHOLD (256 * 256)
+
+typedef struct worker_pool worker_pool_t;
+
+// Draw rows y0 (inclusive) to y1 (exclusive) of the job in arg.
+typedef void (*pool_band_fn)(void* arg, int y0, int y1);
+
+// threads counts the calling thread, so 4 starts three workers. threshold <= 0
+// picks POOL_DEFAULT_THRESHOLD. Returns NULL on failure.
+worker_pool_t* pool_create(int threads, int threshold);
+void pool_free(worker_pool_t* pool);
+int pool_threads(worker_pool_t* pool);
+
+// Run fn over rows [0, rows). pixels is the size of the job, compared against
+// the threshold. A NULL pool runs everything inline.
+void pool_run(worker_pool_t* pool, pool_band_fn fn, void* arg, int rows, int pixels);
+
+#endif
@@ -0,0 +1,607 @@
+#include "raster.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "span.h"
+#include "stats.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// An edge from top to bottom, x relative to the clip's left side. dir is +1
+// for edges that went down in the path and -1 for those that went up.
+typedef struct {
+  float x0, y0, x1, y1;
+  float dxdy;
+  int dir;
+} raster_edge_t;
+
+// Most shapes fit without touching the heap.
+#define RASTER_LOCAL_EDGES 256
+
+// How far approximated curves may stray from the real one, in pixels.
+#define RASTER_TOLERANCE 0.2f
+
+typedef struct {
+  context_t *context;
+  rect_t clip;
+
+  // active holds the edges crossing the current row, spans the pixels each
+  // of them touches in it as start, end pairs.
+  raster_edge_t *edges;
+  int *active;
+  int *spans;
+  int count;
+  int capacity;
+  int failed;
+  raster_edge_t local_edges[RASTER_LOCAL_EDGES];
+  int local_active[RASTER_LOCAL_EDGES];
+  int local_spans[2 * RASTER_LOCAL_EDGES];
+
+  // Bounds of the edges, x local like the edges.
+  float min_x, min_y, max_x, max_y;
+
+  // The pen: start of the current contour and where it is now. With reverse
+  // set every edge is added backwards, which flips the contour's winding.
+  float start_x, start_y, pen_x, pen_y;
+  int reverse;
+} raster_t;
+
+static void raster_init(raster_t *r, context_t *context) {
+  r->context = context;
+  r->clip = context->clip;
+  r->edges = r->local_edges;
+  r->active = r->local_active;
+  r->spans = r->local_spans;
+  r->count = 0;
+  r->capacity = RASTER_LOCAL_EDGES;
+  r->failed = 0;
+  r->min_x = r->min_y = INFINITY;
+  r->max_x = r->max_y = -INFINITY;
+  r->reverse = 0;
+}
+
+static void raster_release(raster_t *r) {
+  if (r->edges != r->local_edges) {
+    free(r->edges);
+    free(r->active);
+    free(r->spans);
+  }
+}
+
+static int raster_grow(raster_t *r) {
+  int capacity = r->capacity * 2;
+  raster_edge_t *edges = malloc(sizeof(raster_edge_t) * capacity);
+  int *active = malloc(sizeof(int) * capacity);
+  int *spans = malloc(sizeof(int) * 2 * capacity);
+
+  if (edges == NULL || active == NULL || spans == NULL) {
+    free(edges);
+    free(active);
+    free(spans);
+    r->failed = 1;
+    return -1;
+  }
+  memcpy(edges, r->edges, sizeof(raster_edge_t) * r->count);
+  raster_release(r);
+  r->edges = edges;
+  r->active = active;
+  r->spans = spans;
+  r->capacity = capacity;
+  return 0;
+}
+
+// Store an edge that is already inside the clip horizontally.
+static void raster_push(raster_t *r, float x0, float y0, float x1, float y1) {
+  int dir = 1;
+
+  // Also drops the NaNs clipping far outside coordinates can produce.
+  if (!(y0 < y1 || y0 > y1) || r->failed) {
+    return;
+  }
+  if (y0 > y1) {
+    float t = x0;
+    x0 = x1;
+    x1 = t;
+    t = y0;
+    y0 = y1;
+    y1 = t;
+    dir = -1;
+  }
+  if (r->reverse) {
+    dir = -dir;
+  }
+  if (r->count == r->capacity && raster_grow(r) < 0) {
+    return;
+  }
+
+  raster_edge_t *edge = &r->edges[r->count++];
+  edge->x0 = x0;
+  edge->y0 = y0;
+  edge->x1 = x1;
+  edge->y1 = y1;
+  edge->dxdy = (x1 - x0) / (y1 - y0);
+  edge->dir = dir;
+  if (!isfinite(edge->dxdy)) {
+    r->count--;
+    return;
+  }
+
+  r->min_x = fminf(r->min_x, fminf(x0, x1));
+  r->max_x = fmaxf(r->max_x, fmaxf(x0, x1));
+  r->min_y = fminf(r->min_y, y0);
+  r->max_y = fmaxf(r->max_y, y1);
+}
+
+// Clip against x = 0 (pass 0), then x = clip.w (pass 1). What lies beyond is
+// moved onto the line: it still changes the winding of everything inside, it
+// just covers nothing.
+static void raster_clip_x(raster_t *r, float x0, float y0, float x1, float y1,
+                          int pass);
+
+static void raster_clipped(raster_t *r, float x0, float y0, float x1,
+                           float y1, int pass) {
+  if (pass == 0) {
+    raster_clip_x(r, x0, y0, x1, y1, 1);
+  } else {
+    raster_push(r, x0, y0, x1, y1);
+  }
+}
+
+static void raster_clip_x(raster_t *r, float x0, float y0, float x1, float y1,
+                          int pass) {
+  float edge = pass == 0 ? 0.0f : (float)r->clip.w;
+  int out0 = pass == 0 ? x0 < edge : x0 > edge;
+  int out1 = pass == 0 ? x1 < edge : x1 > edge;
+
+  if (!out0 && !out1) {
+    raster_clipped(r, x0, y0, x1, y1, pass);
+  } else if (out0 && out1) {
+    raster_clipped(r, edge, y0, edge, y1, pass);
+  } else {
+    float y = y0 + (edge - x0) * (y1 - y0) / (x1 - x0);
+    if (out0) {
+      raster_clipped(r, edge, y0, edge, y, pass);
+      raster_clipped(r, edge, y, x1, y1, pass);
+    } else {
+      raster_clipped(r, x0, y0, edge, y, pass);
+      raster_clipped(r, edge, y, edge, y1, pass);
+    }
+  }
+}
+
+// One edge of the path in context coordinates.
+static void raster_edge(raster_t *r, float x0, float y0, float x1, float y1) {
+  float top = (float)r->clip.y;
+  float bottom = (float)(r->clip.y + r->clip.h);
+
+  // Rows are independent, edges above or below the clip change nothing.
+  if ((y0 <= top && y1 <= top) || (y0 >= bottom && y1 >= bottom) ||
+      !isfinite(x0) || !isfinite(y0) || !isfinite(x1) || !isfinite(y1)) {
+    return;
+  }
+  x0 -= r->clip.x;
+  x1 -= r->clip.x;
+  raster_clip_x(r, x0, y0, x1, y1, 0);
+}
+
+static void raster_move_to(raster_t *r, float x, float y) {
+  r->start_x = r->pen_x = x;
+  r->start_y = r->pen_y = y;
+}
+
+static void raster_line_to(raster_t *r, float x, float y) {
+  raster_edge(r, r->pen_x, r->pen_y, x, y);
+  r->pen_x = x;
+  r->pen_y = y;
+}
+
+static void raster_close(raster_t *r) {
+  raster_line_to(r, r->start_x, r->start_y);
+}
+
+// Segments for an arc of radius and angle so the chords stay within
+// RASTER_TOLERANCE of it.
+static int raster_arc_steps(float radius, float angle) {
+  float step = radius > RASTER_TOLERANCE
+                   ? 2.0f * acosf(1.0f - RASTER_TOLERANCE / radius)
+                   : (float)M_PI / 2;
+  float steps = ceilf(fabsf(angle) / step);
+
+  // Huge radii round step down to 0.
+  if (!(steps <= 1024)) {
+    return 1024;
+  }
+  return steps < 2 ? 2 : (int)steps;
+}
+
+// Continue the contour along an arc around cx, cy from angle a0 to a1.
+// The first point starts a new contour when first is set.
+static void raster_arc(raster_t *r, float cx, float cy, float radius, float a0,
+                       float a1, int first) {
+  int steps = raster_arc_steps(radius, a1 - a0);
+  // Chords cut inside the arc. Moving the points in between out until the
+  // chord middles are as far inside as the points are outside keeps the area
+  // right. The ends stay put, they meet straight edges.
+  float outer = radius * 2.0f / (1.0f + cosf((a1 - a0) / steps / 2));
+
+  for (int i = 0; i <= steps; i++) {
+    float a = a0 + (a1 - a0) * i / steps;
+    float d = i == 0 || i == steps ? radius : outer;
+    float x = cx + d * cosf(a);
+    float y = cy + d * sinf(a);
+    if (i == 0 && first) {
+      raster_move_to(r, x, y);
+    } else {
+      raster_line_to(r, x, y);
+    }
+  }
+}
+
+static void raster_circle(raster_t *r, float cx, float cy, float radius) {
+  if (!(radius > 0)) {
+    return;
+  }
+  raster_arc(r, cx, cy, radius, 0.0f, 2.0f * (float)M_PI, 1);
+  raster_close(r);
+}
+
+static void raster_round_rect(raster_t *r, float x, float y, float w, float h,
+                              float radius) {
+  float half = (float)M_PI / 2;
+
+  if (radius > w / 2) {
+    radius = w / 2;
+  }
+  if (radius > h / 2) {
+    radius = h / 2;
+  }
+  if (radius < 0) {
+    radius = 0;
+  }
+
+  // Clockwise on screen, the same way raster_circle goes.
+  raster_arc(r, x + w - radius, y + h - radius, radius, 0, half, 1);
+  raster_arc(r, x + radius, y + h - radius, radius, half, 2 * half, 0);
+  raster_arc(r, x + radius, y + radius, radius, 2 * half, 3 * half, 0);
+  raster_arc(r, x + w - radius, y + radius, radius, 3 * half, 4 * half, 0);
+  raster_close(r);
+}
+
+// A w wide bar from x0, y0 to x1, y1, wound like raster_circle.
+static void raster_segment(raster_t *r, float x0, float y0, float x1, float y1,
+                           float width) {
+  float dx = x1 - x0;
+  float dy = y1 - y0;
+  float length = sqrtf(dx * dx + dy * dy);
+
+  if (length == 0) {
+    return;
+  }
+  float nx = -dy / length * width / 2;
+  float ny = dx / length * width / 2;
+
+  raster_move_to(r, x0 - nx, y0 - ny);
+  raster_line_to(r, x1 - nx, y1 - ny);
+  raster_line_to(r, x1 + nx, y1 + ny);
+  raster_line_to(r, x0 + nx, y0 + ny);
+  raster_close(r);
+}
+
+static int raster_compare(const void *a, const void *b) {
+  float ya = ((const raster_edge_t *)a)->y0;
+  float yb = ((const raster_edge_t *)b)->y0;
+  return ya < yb ? -1 : ya > yb;
+}
+
+// Add the signed area the part of edge between rows y and y + 1 covers to
+// each pixel of acc, shifted left by left. Summing acc from the left then
+// gives each pixel's winding number weighted by coverage. acc holds width + 2
+// slots. span receives the first slot touched and the one after the last.
+static inline void raster_accumulate(float *acc, const raster_edge_t *edge,
+                                     int y, float left, float width,
+                                     int *span) {
+  float ya = edge->y0 > y ? edge->y0 : (float)y;
+  float yb = edge->y1 < y + 1 ? edge->y1 : (float)(y + 1);
+  float xa = edge->x0 + (ya - edge->y0) * edge->dxdy - left;
+  float xb = edge->x0 + (yb - edge->y0) * edge->dxdy - left;
+  float d = (yb - ya) * edge->dir;
+
+  // Interpolating may round past the bounds the edges were clipped to, or
+  // give NaN for edges spanning most of the float range; those end up at 0.
+  xa = xa > 0 ? (xa < width ? xa : width) : 0;
+  xb = xb > 0 ? (xb < width ? xb : width) : 0;
+
+  // Both are >= 0, truncating is floor.
+  float x0 = xa < xb ? xa : xb;
+  float x1 = xa < xb ? xb : xa;
+  int x0i = (int)x0;
+  int x1i = (int)x1;
+  float x0floor = (float)x0i;
+  if (x1i < x1) {
+    x1i++;
+  }
+
+  span[0] = x0i;
+  span[1] = x1i + 2;
+
+  if (x1i <= x0i + 1) {
+    // Inside one pixel: split by where the edge crosses it on average.
+    float xmf = 0.5f * (xa + xb) - x0floor;
+    acc[x0i] += d - d * xmf;
+    acc[x0i + 1] += d * xmf;
+    return;
+  }
+
+  float s = 1.0f / (x1 - x0);
+  float x0f = x0 - x0floor;
+  float a0 = 0.5f * s * (1.0f - x0f) * (1.0f - x0f);
+  float x1f = x1 - x1i + 1.0f;
+  float am = 0.5f * s * x1f * x1f;
+
+  acc[x0i] += d * a0;
+  if (x1i == x0i + 2) {
+    acc[x0i + 1] += d * (1.0f - a0 - am);
+  } else {
+    float a1 = s * (1.5f - x0f);
+    acc[x0i + 1] += d * (a1 - a0);
+    for (int x = x0i + 2; x < x1i - 1; x++) {
+      acc[x] += d * s;
+    }
+    float a2 = a1 + (x1i - x0i - 3) * s;
+    acc[x1i - 1] += d * (1.0f - a2 - am);
+  }
+  acc[x1i] += d * am;
+}
+
+static inline unsigned char raster_coverage(float winding, int flags) {
+  float c = fabsf(winding);
+
+  if (flags & RASTER_AA) {
+    return c >= 1.0f ? 255 : (unsigned char)(c * 255.0f + 0.5f);
+  }
+  return c >= 0.5f ? 255 : 0;
+}
+
+// Paint one row from its coverage: full runs as spans, edges by coverage.
+static void raster_emit(int *row, const unsigned char *cover, int x0, int x1,
+                        int color) {
+  int x = x0;
+
+  while (x < x1) {
+    int start = x;
+    unsigned char c = cover[x];
+
+    if (c == 0) {
+      while (x < x1 && cover[x] == 0) {
+        x++;
+      }
+    } else if (c == 255) {
+      while (x < x1 && cover[x] == 255) {
+        x++;
+      }
+      span_blend_color(row + start, color, x - start);
+    } else {
+      while (x < x1 && cover[x] != 0 && cover[x] != 255) {
+        x++;
+      }
+      span_blend_color_mask(row + start, color, cover + start, x - start);
+    }
+  }
+}
+
+// Scan convert the collected edges with the nonzero rule and draw them.
+static void raster_fill(raster_t *r, int color, int flags) {
+  context_t *context = r->context;
+  rect_t clip = r->clip;
+
+  if (r->count == 0 || r->failed || clip.w <= 0 || clip.h <= 0) {
+    return;
+  }
+
+  // Clamped to the clip while still floats, the bounds may be far outside
+  // what an int holds.
+  float top = fmaxf(floorf(r->min_y), (float)clip.y);
+  float bottom = fminf(ceilf(r->max_y), (float)(clip.y + clip.h));
+  float left = fmaxf(floorf(r->min_x), 0.0f);
+  float right = fminf(ceilf(r->max_x), (float)clip.w);
+  if (!(top < bottom) || !(left < right)) {
+    return;
+  }
+  int y0 = (int)top;
+  int y1 = (int)bottom;
+  int x0 = (int)left;
+  int x1 = (int)right;
+
+  // Straight alpha 0 means opaque, see raster.h.
+  int pixel = (unsigned)color >> 24 ? color : (int)(color | 0xFF000000u);
+  span_premultiply(&pixel, 1);
+
+  // Two spare slots: edges on the right border spill into acc[width] and
+  // acc[width + 1]. Rows clear the slots they used as they sum them.
+  int width = x1 - x0;
+  float acc[width + 2];
+  unsigned char cover[width + 1];
+  int next = 0, active = 0;
+
+  memset(acc, 0, sizeof(acc));
+  qsort(r->edges, r->count, sizeof(raster_edge_t), raster_compare);
+
+  for (int y = y0; y < y1; y++) {
+    // Retire edges above the row, take in the ones starting in it.
+    int kept = 0;
+    for (int i = 0; i < active; i++) {
+      if (r->edges[r->active[i]].y1 > y) {
+        r->active[kept++] = r->active[i];
+      }
+    }
+    active = kept;
+    while (next < r->count && r->edges[next].y0 < y + 1) {
+      if (r->edges[next].y1 > y) {
+        r->active[active++] = next;
+      }
+      next++;
+    }
+    if (active == 0) {
+      continue;
+    }
+
+    // Sorted by start. Edges move little from row to row, so insertion sort
+    // on the previous order is close to linear.
+    int *spans = r->spans;
+    for (int i = 0; i < active; i++) {
+      int edge = r->active[i], span[2];
+      raster_accumulate(acc, &r->edges[edge], y, (float)x0, (float)width,
+                        span);
+      int j = i;
+      while (j > 0 && spans[2 * j - 2] > span[0]) {
+        spans[2 * j] = spans[2 * j - 2];
+        spans[2 * j + 1] = spans[2 * j - 1];
+        r->active[j] = r->active[j - 1];
+        j--;
+      }
+      spans[2 * j] = span[0];
+      spans[2 * j + 1] = span[1];
+      r->active[j] = edge;
+    }
+
+    // Between the spans the winding stays what it was: fill with it. Inside
+    // them each pixel needs its own coverage.
+    int *row = &context->data[y * context->stride + clip.x + x0];
+    float sum = 0;
+    int x = spans[0];
+
+    for (int i = 0; i < active; i++) {
+      int start = spans[2 * i] > x ? spans[2 * i] : x;
+      int end = spans[2 * i + 1] < width ? spans[2 * i + 1] : width;
+
+      if (start > x) {
+        unsigned char c = raster_coverage(sum, flags);
+        if (c == 255) {
+          span_blend_color(row + x, pixel, start - x);
+        } else if (c != 0) {
+          memset(&cover[x], c, start - x);
+          span_blend_color_mask(row + x, pixel, &cover[x], start - x);
+        }
+      }
+      if (end > start) {
+        for (int p = start; p < end; p++) {
+          sum += acc[p];
+          acc[p] = 0;
+          cover[p] = raster_coverage(sum, flags);
+        }
+        raster_emit(row, cover, start, end, pixel);
+        x = end;
+      }
+    }
+
+    // What spilled past the right border.
+    acc[width] = acc[width + 1] = 0;
+  }
+
+  context_damage(context, clip.x + x0, y0, x1 - x0, y1 - y0);
+}
+
+static void raster_draw(raster_t *r, int color, int flags, uint64_t start) {
+  raster_fill(r, color, flags);
+  raster_release(r);
+  stats_end(r->context->stats, STATS_RASTER, start);
+}
+
+void draw_line(float x0, float y0, float x1, float y1, float width,
+               context_t *context, int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  raster_segment(&r, x0, y0, x1, y1, width);
+  raster_draw(&r, color, flags, start);
+}
+
+void draw_polyline(const float *points, int count, float width,
+                   context_t *context, int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  for (int i = 0; i + 1 < count; i++) {
+    raster_segment(&r, points[2 * i], points[2 * i + 1], points[2 * i + 2],
+                   points[2 * i + 3], width);
+    // Fill the notch on the outside of the bend. All pieces wind the same
+    // way, so overlaps count once.
+    if (i > 0) {
+      raster_circle(&r, points[2 * i], points[2 * i + 1], width / 2);
+    }
+  }
+  raster_draw(&r, color, flags, start);
+}
+
+void fill_polygon(const float *points, int count, context_t *context,
+                  int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  if (count >= 3) {
+    raster_move_to(&r, points[0], points[1]);
+    for (int i = 1; i < count; i++) {
+      raster_line_to(&r, points[2 * i], points[2 * i + 1]);
+    }
+    raster_close(&r);
+  }
+  raster_draw(&r, color, flags, start);
+}
+
+void draw_circle(float cx, float cy, float radius, float width,
+                 context_t *context, int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  raster_circle(&r, cx, cy, radius + width / 2);
+  if (radius > width / 2) {
+    r.reverse = 1;
+    raster_circle(&r, cx, cy, radius - width / 2);
+  }
+  raster_draw(&r, color, flags, start);
+}
+
+void fill_circle(float cx, float cy, float radius, context_t *context,
+                 int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  raster_circle(&r, cx, cy, radius);
+  raster_draw(&r, color, flags, start);
+}
+
+void draw_round_rect(float x, float y, float w, float h, float radius,
+                     float width, context_t *context, int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  float half = width / 2;
+  raster_t r;
+
+  raster_init(&r, context);
+  raster_round_rect(&r, x - half, y - half, w + width, h + width,
+                    radius + half);
+  if (w > width && h > width) {
+    r.reverse = 1;
+    raster_round_rect(&r, x + half, y + half, w - width, h - width,
+                      radius - half);
+  }
+  raster_draw(&r, color, flags, start);
+}
+
+void fill_round_rect(float x, float y, float w, float h, float radius,
+                     context_t *context, int color, int flags) {
+  uint64_t start = stats_begin(context->stats);
+  raster_t r;
+
+  raster_init(&r, context);
+  raster_round_rect(&r, x, y, w, h, radius);
+  raster_draw(&r, color, flags, start);
+}
@@ -0,0 +1,43 @@
+#ifndef __RASTER_H_
+#define __RASTER_H_
+
+#include "draw.h"
+
+// Lines, polygons, circles and rounded rects for gauges and charts. Shapes are
+// turned into edges, clipped to the context's clip and scan converted one row
+// at a time into horizontal spans: fully covered runs go to span_fill (or
+// span_blend_color when translucent), the partly covered pixels along the
+// edges are blended by their coverage.
+//
+// Coordinates are in pixels and may be fractional. Pixel x, y covers x to
+// x + 1 and y to y + 1, so a 1 pixel wide horizontal line through the middle
+// of row 10 runs along y = 10.5. Strokes are centered on the path.
+//
+// color is straight 0xAARRGGBB, except that an alpha of 0 means opaque: the
+// 0xRRGGBB colors of draw_rect work as they are.
+
+// Blend the edges by coverage. Without it a pixel is drawn when at least half
+// of it is covered, which is cheaper and keeps the colors exact.
+#define RASTER_AA 1
+
+void draw_line(float x0, float y0, float x1, float y1, float width, context_t* context, int color,
+               int flags);
+
+// count points, as x, y pairs. Segments meet in round joins and end flat.
+void draw_polyline(const float* points, int count, float width, context_t* context, int color,
+                   int flags);
+
+// Closed polygon of count x, y pairs, filled with the nonzero winding rule.
+void fill_polygon(const float* points, int count, context_t* context, int color, int flags);
+
+void draw_circle(float cx, float cy, float r, float width, context_t* context, int color,
+                 int flags);
+void fill_circle(float cx, float cy, float r, context_t* context, int color, int flags);
+
+// Corner radius r, clamped to half the shorter side.
+void draw_round_rect(float x, float y, float w, float h, float r, float width, context_t* context,
+                     int color, int flags);
+void fill_round_rect(float x, float y, float w, float h, float r, context_t* context, int color,
+                     int flags);
+
+#endif
@@ -0,0 +1,372 @@
+#include "scene.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct scene_node {
+  int kind;
+  int z;
+  int x;
+  int y;
+  int w;
+  int h;
+  int color;
+  int visible;
+  image_t *image;
+  int blend;
+  char *text;
+  fontmap_t *fontmap;
+};
+
+struct scene {
+  // Sorted by z, painted back to front.
+  scene_node_t **nodes;
+  int count;
+  int capacity;
+  int background;
+
+  // Changes since the last scene_render, and what the previous frames
+  // repainted, newest first, for contexts without a shadow buffer.
+  damage_t pending;
+  damage_t history[CONTEXT_MAX_BUFFERS];
+  int full;
+  int width;
+  int height;
+};
+
+static rect_t node_bounds(const scene_node_t *node) {
+  rect_t rect = {node->x, node->y, node->w, node->h};
+  return rect;
+}
+
+static void node_damage(scene_t *scene, const scene_node_t *node) {
+  if (node->visible && node->w > 0 && node->h > 0) {
+    damage_add(&scene->pending, node->x, node->y, node->w, node->h);
+  }
+}
+
+static char *copy_text(const char *text) {
+  size_t len = strlen(text);
+  char *copy = malloc(len + 1);
+  if (copy != NULL) {
+    memcpy(copy, text, len + 1);
+  }
+  return copy;
+}
+
+scene_t *scene_create(int background) {
+  scene_t *scene = malloc(sizeof(scene_t));
+  if (scene == NULL) {
+    return NULL;
+  }
+
+  memset(scene, 0, sizeof(*scene));
+  scene->background = background;
+  scene->full = 1;
+  return scene;
+}
+
+void scene_free(scene_t *scene) {
+  if (scene == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < scene->count; i++) {
+    free(scene->nodes[i]->text);
+    free(scene->nodes[i]);
+  }
+  free(scene->nodes);
+  free(scene);
+}
+
+// Put node behind the first node with a higher z.
+static int scene_insert(scene_t *scene, scene_node_t *node) {
+  if (scene->count == scene->capacity) {
+    int capacity = scene->capacity ? scene->capacity * 2 : 16;
+    scene_node_t **nodes =
+        realloc(scene->nodes, sizeof(scene_node_t *) * capacity);
+    if (nodes == NULL) {
+      return -1;
+    }
+    scene->nodes = nodes;
+    scene->capacity = capacity;
+  }
+
+  int at = scene->count;
+  while (at > 0 && scene->nodes[at - 1]->z > node->z) {
+    at--;
+  }
+  memmove(&scene->nodes[at + 1], &scene->nodes[at],
+          sizeof(scene_node_t *) * (scene->count - at));
+  scene->nodes[at] = node;
+  scene->count++;
+  return 0;
+}
+
+static void scene_unlink(scene_t *scene, scene_node_t *node) {
+  for (int i = 0; i < scene->count; i++) {
+    if (scene->nodes[i] == node) {
+      memmove(&scene->nodes[i], &scene->nodes[i + 1],
+              sizeof(scene_node_t *) * (scene->count - i - 1));
+      scene->count--;
+      return;
+    }
+  }
+}
+
+static scene_node_t *scene_add(scene_t *scene, int kind, int x, int y, int w,
+                               int h, int z) {
+  scene_node_t *node = malloc(sizeof(scene_node_t));
+  if (node == NULL) {
+    return NULL;
+  }
+
+  memset(node, 0, sizeof(*node));
+  node->kind = kind;
+  node->x = x;
+  node->y = y;
+  node->w = w;
+  node->h = h;
+  node->z = z;
+  node->visible = 1;
+
+  if (scene_insert(scene, node) < 0) {
+    free(node);
+    return NULL;
+  }
+  return node;
+}
+
+scene_node_t *scene_add_rect(scene_t *scene, int x, int y, int w, int h,
+                             int color, int z) {
+  scene_node_t *node = scene_add(scene, SCENE_RECT, x, y, w, h, z);
+  if (node != NULL) {
+    node->color = color;
+    node_damage(scene, node);
+  }
+  return node;
+}
+
+scene_node_t *scene_add_image(scene_t *scene, int x, int y, image_t *image,
+                              int blend, int z) {
+  scene_node_t *node =
+      scene_add(scene, SCENE_IMAGE, x, y, image->width, image->height, z);
+  if (node != NULL) {
+    node->image = image;
+    node->blend = blend;
+    node_damage(scene, node);
+  }
+  return node;
+}
+
+scene_node_t *scene_add_string(scene_t *scene, int x, int y, const char *text,
+                               fontmap_t *fontmap, int color, int z) {
+  char *copy = copy_text(text);
+  if (copy == NULL) {
+    return NULL;
+  }
+
+  int w, h;
+  measure_string(text, fontmap, &w, &h);
+
+  scene_node_t *node = scene_add(scene, SCENE_STRING, x, y, w, h, z);
+  if (node == NULL) {
+    free(copy);
+    return NULL;
+  }
+
+  node->text = copy;
+  node->fontmap = fontmap;
+  node->color = color;
+  node_damage(scene, node);
+  return node;
+}
+
+void scene_remove(scene_t *scene, scene_node_t *node) {
+  node_damage(scene, node);
+  scene_unlink(scene, node);
+  free(node->text);
+  free(node);
+}
+
+void scene_move(scene_t *scene, scene_node_t *node, int x, int y) {
+  if (node->x == x && node->y == y) {
+    return;
+  }
+
+  node_damage(scene, node);
+  node->x = x;
+  node->y = y;
+  node_damage(scene, node);
+}
+
+void scene_resize(scene_t *scene, scene_node_t *node, int w, int h) {
+  if (node->kind != SCENE_RECT || (node->w == w && node->h == h)) {
+    return;
+  }
+
+  node_damage(scene, node);
+  node->w = w;
+  node->h = h;
+  node_damage(scene, node);
+}
+
+void scene_set_color(scene_t *scene, scene_node_t *node, int color) {
+  if (node->kind == SCENE_IMAGE || node->color == color) {
+    return;
+  }
+
+  node->color = color;
+  node_damage(scene, node);
+}
+
+void scene_set_text(scene_t *scene, scene_node_t *node, const char *text) {
+  if (node->kind != SCENE_STRING || strcmp(node->text, text) == 0) {
+    return;
+  }
+
+  char *copy = copy_text(text);
+  if (copy == NULL) {
+    return;
+  }
+
+  node_damage(scene, node);
+  free(node->text);
+  node->text = copy;
+  measure_string(text, node->fontmap, &node->w, &node->h);
+  node_damage(scene, node);
+}
+
+void scene_set_visible(scene_t *scene, scene_node_t *node, int visible) {
+  visible = visible != 0;
+  if (node->visible == visible) {
+    return;
+  }
+
+  // Damage while visible, before hiding or after showing.
+  node_damage(scene, node);
+  node->visible = visible;
+  node_damage(scene, node);
+}
+
+void scene_set_z(scene_t *scene, scene_node_t *node, int z) {
+  if (node->z == z) {
+    return;
+  }
+
+  scene_unlink(scene, node);
+  node->z = z;
+  // The node has been counted, so inserting can't run out of room.
+  scene_insert(scene, node);
+  node_damage(scene, node);
+}
+
+void scene_touch(scene_t *scene, scene_node_t *node) {
+  node_damage(scene, node);
+  if (node->kind == SCENE_IMAGE) {
+    node->w = node->image->width;
+    node->h = node->image->height;
+    node_damage(scene, node);
+  }
+}
+
+void scene_invalidate(scene_t *scene) { scene->full = 1; }
+
+static void node_paint(scene_node_t *node, context_t *context) {
+  switch (node->kind) {
+  case SCENE_RECT:
+    draw_rect(node->x, node->y, node->w, node->h, context, node->color);
+    break;
+  case SCENE_IMAGE:
+    if (node->blend) {
+      draw_image_blend(node->x, node->y, node->image, context);
+    } else {
+      draw_image(node->x, node->y, node->image, context);
+    }
+    break;
+  case SCENE_STRING:
+    draw_string_color(node->x, node->y, node->text, node->fontmap, context,
+                      node->color);
+    break;
+  }
+}
+
+static int rects_overlap(rect_t a, rect_t b) {
+  return a.x < b.x + b.w && b.x < a.x + a.w && a.y < b.y + b.h &&
+         b.y < a.y + a.h;
+}
+
+// Background and every node touching area, back to front. Nodes aren't
+// clipped to area here, the caller's clip does that.
+static void paint_area(scene_t *scene, context_t *context, rect_t area) {
+  if (area.w <= 0 || area.h <= 0) {
+    return;
+  }
+
+  draw_rect(area.x, area.y, area.w, area.h, context, scene->background);
+  for (int n = 0; n < scene->count; n++) {
+    scene_node_t *node = scene->nodes[n];
+    if (node->visible && rects_overlap(node_bounds(node), area)) {
+      node_paint(node, context);
+    }
+  }
+}
+
+int scene_render(scene_t *scene, context_t *context) {
+  damage_t frame;
+  damage_t repaint;
+  int painted = 0;
+
+  if (scene->width != context->width || scene->height != context->height) {
+    scene->width = context->width;
+    scene->height = context->height;
+    scene->full = 1;
+  }
+
+  damage_clear(&frame);
+  if (scene->full) {
+    damage_add(&frame, 0, 0, context->width, context->height);
+  } else {
+    frame = scene->pending;
+  }
+
+  // Without a shadow we draw straight into the back buffer, which last saw
+  // the frame buffer_count - 1 presents ago.
+  repaint = frame;
+  if (context->shadow == NULL && context->buffer_count > 1) {
+    int history = context->buffer_count - 1;
+
+    for (int i = 0; i < history; i++) {
+      damage_merge(&repaint, &scene->history[i]);
+    }
+    for (int i = history - 1; i > 0; i--) {
+      scene->history[i] = scene->history[i - 1];
+    }
+    scene->history[0] = frame;
+  }
+
+  for (int i = 0; i < repaint.count; i++) {
+    rect_t area = repaint.rects[i];
+
+    // The caller filled the clip stack. Repaint everything the current clip
+    // allows rather than leave the remaining rects stale.
+    if (context_push_clip(context, area.x, area.y, area.w, area.h)) {
+      paint_area(scene, context, context->clip);
+      painted += repaint.count - i;
+      break;
+    }
+    area = context->clip;
+    if (area.w <= 0 || area.h <= 0) {
+      context_pop_clip(context);
+      continue;
+    }
+
+    paint_area(scene, context, area);
+    context_pop_clip(context);
+    painted++;
+  }
+
+  damage_clear(&scene->pending);
+  scene->full = 0;
+  return painted;
+}
@@ -0,0 +1,58 @@
+#ifndef __SCENE_H_
+#define __SCENE_H_
+
+#include "damage.h"
+#include "draw.h"
+#include "font.h"
+
+// A retained display list. Instead of redrawing everything every frame,
+// applications keep rect, image and string nodes in a scene and change them
+// through the setters below. scene_render() repaints only the areas where
+// something changed since the last frame, back to front in z order, clipped to
+// those areas. Setters that don't change anything don't cause a repaint, so
+// setting a clock label to the same text every frame costs nothing.
+//
+// This works best with context_enable_shadow(): the repaint lands in cached
+// memory and context_present() only copies the damaged rects. Without a
+// shadow, every back buffer has to catch up on the frames it missed, so
+// scene_render() repaints the damage of the last buffer_count frames.
+
+enum { SCENE_RECT, SCENE_IMAGE, SCENE_STRING };
+
+typedef struct scene scene_t;
+typedef struct scene_node scene_node_t;
+
+// background fills everything no node covers.
+scene_t* scene_create(int background);
+void scene_free(scene_t* scene);
+
+// Nodes belong to the scene and are freed by scene_remove or scene_free. Nodes
+// with a higher z are painted on top, equal z keeps insertion order. Images
+// and fonts are borrowed and must outlive their nodes; strings are copied.
+scene_node_t* scene_add_rect(scene_t* scene, int x, int y, int w, int h, int color, int z);
+scene_node_t* scene_add_image(scene_t* scene, int x, int y, image_t* image, int blend, int z);
+scene_node_t* scene_add_string(scene_t* scene, int x, int y, const char* text, fontmap_t* fontmap,
+                               int color, int z);
+void scene_remove(scene_t* scene, scene_node_t* node);
+
+// Setters only repaint what they change. Resizing applies to rect nodes, image
+// and string nodes take their size from the image and text.
+void scene_move(scene_t* scene, scene_node_t* node, int x, int y);
+void scene_resize(scene_t* scene, scene_node_t* node, int w, int h);
+void scene_set_color(scene_t* scene, scene_node_t* node, int color);
+void scene_set_text(scene_t* scene, scene_node_t* node, const char* text);
+void scene_set_visible(scene_t* scene, scene_node_t* node, int visible);
+void scene_set_z(scene_t* scene, scene_node_t* node, int z);
+
+// The pixels of an image node changed, repaint it.
+void scene_touch(scene_t* scene, scene_node_t* node);
+
+// Repaint everything on the next scene_render, e.g. after drawing over the
+// scene by hand.
+void scene_invalidate(scene_t* scene);
+
+// Repaint what changed into context and record it as damage for
+// context_present(). Returns the number of rects repainted.
+int scene_render(scene_t* scene, context_t* context);
+
+#endif
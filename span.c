@@ -0,0 +1,771 @@
+#include "span.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPAN_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SPAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+static void span_fill_scalar(int *dst, int color, int count) {
+  // Unrolled so compilers without a vectorizer still get wide stores.
+  while (count >= 4) {
+    dst[0] = color;
+    dst[1] = color;
+    dst[2] = color;
+    dst[3] = color;
+    dst += 4;
+    count -= 4;
+  }
+  while (count-- > 0) {
+    *dst++ = color;
+  }
+}
+
+// x * a / 255 for two 8-bit channels packed at bits 0 and 16, rounded.
+static inline uint32_t span_mul2(uint32_t x, uint32_t a) {
+  x = (x & 0x00FF00FF) * a + 0x00800080;
+  return ((x + ((x >> 8) & 0x00FF00FF)) >> 8) & 0x00FF00FF;
+}
+
+// Scale all four channels of a pixel by a / 255.
+static inline uint32_t span_mul4(uint32_t pixel, uint32_t a) {
+  return span_mul2(pixel, a) | (span_mul2(pixel >> 8, a) << 8);
+}
+
+static inline uint32_t span_over(uint32_t dst, uint32_t src) {
+  return src + span_mul4(dst, 255 - (src >> 24));
+}
+
+static void span_blend_scalar(int *dst, const int *src, int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t pixel = (uint32_t)src[i];
+    uint32_t alpha = pixel >> 24;
+
+    if (alpha == 0) {
+      continue;
+    }
+    if (alpha == 255) {
+      dst[i] = (int)pixel;
+    } else {
+      dst[i] = (int)span_over((uint32_t)dst[i], pixel);
+    }
+  }
+}
+
+static void span_blend_color_scalar(int *dst, int color, int count) {
+  uint32_t ia = 255 - ((uint32_t)color >> 24);
+
+  for (int i = 0; i < count; i++) {
+    dst[i] = (int)((uint32_t)color + span_mul4((uint32_t)dst[i], ia));
+  }
+}
+
+static void span_blend_color_mask_scalar(int *dst, int color,
+                                         const unsigned char *coverage,
+                                         int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t pixel = span_mul4((uint32_t)color, coverage[i]);
+    if (pixel >> 24) {
+      dst[i] = (int)span_over((uint32_t)dst[i], pixel);
+    }
+  }
+}
+
+static void span_expand_scalar(int *dst, int bits, int count, int fg) {
+  for (int i = 0; i < count; i++) {
+    if (bits & (0x80 >> i)) {
+      dst[i] = fg;
+    }
+  }
+}
+
+static void span_expand_bg_scalar(int *dst, int bits, int count, int fg,
+                                  int bg) {
+  for (int i = 0; i < count; i++) {
+    dst[i] = (bits & (0x80 >> i)) ? fg : bg;
+  }
+}
+
+static void span_transpose_scalar(int *dst, int dst_stride, const int *src,
+                                  int src_stride, int w, int h) {
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      dst[y * dst_stride + x] = src[x * src_stride + y];
+    }
+  }
+}
+
+static void span_reverse_scalar(int *dst, const int *src, int count) {
+  for (int i = 0; i < count; i++) {
+    dst[i] = src[count - 1 - i];
+  }
+}
+
+// The scalar loops over the right and bottom edges that don't fill a 4 x 4
+// tile.
+static void span_transpose_edges(int *dst, int dst_stride, const int *src,
+                                 int src_stride, int w, int h) {
+  int w4 = w & ~3;
+  int h4 = h & ~3;
+
+  if (w4 < w) {
+    span_transpose_scalar(dst + w4, dst_stride, src + w4 * src_stride,
+                          src_stride, w - w4, h);
+  }
+  if (h4 < h) {
+    span_transpose_scalar(dst + h4 * dst_stride, dst_stride, src + h4,
+                          src_stride, w4, h - h4);
+  }
+}
+
+static void span_scale_nearest_scalar(int *dst, const int *src, int count,
+                                      int fx, int step) {
+  while (count >= 4) {
+    dst[0] = src[fx >> 16];
+    dst[1] = src[(fx + step) >> 16];
+    dst[2] = src[(fx + 2 * step) >> 16];
+    dst[3] = src[(fx + 3 * step) >> 16];
+    fx += 4 * step;
+    dst += 4;
+    count -= 4;
+  }
+  while (count-- > 0) {
+    *dst++ = src[fx >> 16];
+    fx += step;
+  }
+}
+
+#ifdef SPAN_X86
+__attribute__((target("sse2"))) static void span_fill_sse2(int *dst, int color,
+                                                           int count) {
+  __m128i value = _mm_set1_epi32(color);
+
+  // Align to 16 bytes one pixel at a time, pixels are always 4-aligned.
+  while (count > 0 && ((uintptr_t)dst & 15)) {
+    *dst++ = color;
+    count--;
+  }
+  while (count >= 16) {
+    _mm_store_si128((__m128i *)dst, value);
+    _mm_store_si128((__m128i *)(dst + 4), value);
+    _mm_store_si128((__m128i *)(dst + 8), value);
+    _mm_store_si128((__m128i *)(dst + 12), value);
+    dst += 16;
+    count -= 16;
+  }
+  while (count >= 4) {
+    _mm_store_si128((__m128i *)dst, value);
+    dst += 4;
+    count -= 4;
+  }
+  while (count-- > 0) {
+    *dst++ = color;
+  }
+}
+
+__attribute__((target("avx2"))) static void span_fill_avx2(int *dst, int color,
+                                                           int count) {
+  __m256i value = _mm256_set1_epi32(color);
+
+  while (count > 0 && ((uintptr_t)dst & 31)) {
+    *dst++ = color;
+    count--;
+  }
+  while (count >= 32) {
+    _mm256_store_si256((__m256i *)dst, value);
+    _mm256_store_si256((__m256i *)(dst + 8), value);
+    _mm256_store_si256((__m256i *)(dst + 16), value);
+    _mm256_store_si256((__m256i *)(dst + 24), value);
+    dst += 32;
+    count -= 32;
+  }
+  while (count >= 8) {
+    _mm256_store_si256((__m256i *)dst, value);
+    dst += 8;
+    count -= 8;
+  }
+  while (count-- > 0) {
+    *dst++ = color;
+  }
+}
+
+// Blend four pixels at once. Whole blocks that are transparent or opaque take
+// the shortcut, mixed blocks do (dst * (255 - a) + 127) / 255 + src in 16 bit.
+__attribute__((target("sse2"))) static void
+span_blend_sse2(int *dst, const int *src, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi32(255);
+  const __m128i round = _mm_set1_epi16(128);
+
+  for (; count >= 4; count -= 4, dst += 4, src += 4) {
+    __m128i s = _mm_loadu_si128((const __m128i *)src);
+    __m128i a = _mm_srli_epi32(s, 24);
+
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, zero)) == 0xFFFF) {
+      continue;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, full)) == 0xFFFF) {
+      _mm_storeu_si128((__m128i *)dst, s);
+      continue;
+    }
+
+    __m128i d = _mm_loadu_si128((const __m128i *)dst);
+    __m128i ia = _mm_sub_epi32(full, a);
+    ia = _mm_or_si128(ia, _mm_slli_epi32(ia, 16));
+
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+                                 _mm_unpacklo_epi32(ia, ia));
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+                                 _mm_unpackhi_epi32(ia, ia));
+    lo = _mm_add_epi16(lo, round);
+    hi = _mm_add_epi16(hi, round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    _mm_storeu_si128((__m128i *)dst,
+                     _mm_add_epi8(_mm_packus_epi16(lo, hi), s));
+  }
+  span_blend_scalar(dst, src, count);
+}
+
+// span_blend_sse2's mixed case with one source pixel for the whole span.
+__attribute__((target("sse2"))) static void
+span_blend_color_sse2(int *dst, int color, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi16(128);
+  const __m128i s = _mm_set1_epi32(color);
+  const __m128i ia = _mm_set1_epi16((short)(255 - ((uint32_t)color >> 24)));
+
+  for (; count >= 4; count -= 4, dst += 4) {
+    __m128i d = _mm_loadu_si128((const __m128i *)dst);
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), ia);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), ia);
+    lo = _mm_add_epi16(lo, round);
+    hi = _mm_add_epi16(hi, round);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+    _mm_storeu_si128((__m128i *)dst,
+                     _mm_add_epi8(_mm_packus_epi16(lo, hi), s));
+  }
+  span_blend_color_scalar(dst, color, count);
+}
+
+// x * y / 255 in 16-bit lanes, rounded like span_mul2.
+__attribute__((target("sse2"))) static inline __m128i span_mul_sse2(__m128i x,
+                                                                    __m128i y) {
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Four pixels at a time: scale the color by each pixel's coverage, then
+// composite it like span_blend_sse2 does.
+__attribute__((target("sse2"))) static void
+span_blend_color_mask_sse2(int *dst, int color, const unsigned char *coverage,
+                           int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+
+  for (; count >= 4; count -= 4, dst += 4, coverage += 4) {
+    uint32_t bytes = (uint32_t)coverage[0] | (uint32_t)coverage[1] << 8 |
+                     (uint32_t)coverage[2] << 16 |
+                     (uint32_t)coverage[3] << 24;
+    if (bytes == 0) {
+      continue;
+    }
+
+    // Coverage of pixel i in all four of its channels.
+    __m128i cv = _mm_cvtsi32_si128((int)bytes);
+    cv = _mm_unpacklo_epi8(cv, cv);
+    cv = _mm_unpacklo_epi16(cv, cv);
+    __m128i slo = span_mul_sse2(c, _mm_unpacklo_epi8(cv, zero));
+    __m128i shi = span_mul_sse2(c, _mm_unpackhi_epi8(cv, zero));
+    __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(slo, 0xFF), 0xFF);
+    __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(shi, 0xFF), 0xFF);
+
+    __m128i d = _mm_loadu_si128((const __m128i *)dst);
+    __m128i dlo = span_mul_sse2(_mm_unpacklo_epi8(d, zero),
+                                _mm_sub_epi16(full, alo));
+    __m128i dhi = span_mul_sse2(_mm_unpackhi_epi8(d, zero),
+                                _mm_sub_epi16(full, ahi));
+
+    _mm_storeu_si128((__m128i *)dst,
+                     _mm_packus_epi16(_mm_add_epi16(dlo, slo),
+                                      _mm_add_epi16(dhi, shi)));
+  }
+  span_blend_color_mask_scalar(dst, color, coverage, count);
+}
+
+// 4 x 4 tiles: four rows of src in registers, transposed, four rows of dst.
+__attribute__((target("sse2"))) static void
+span_transpose_sse2(int *dst, int dst_stride, const int *src, int src_stride,
+                    int w, int h) {
+  for (int y = 0; y + 4 <= h; y += 4) {
+    for (int x = 0; x + 4 <= w; x += 4) {
+      const int *s = src + x * src_stride + y;
+      int *d = dst + y * dst_stride + x;
+      __m128i r0 = _mm_loadu_si128((const __m128i *)s);
+      __m128i r1 = _mm_loadu_si128((const __m128i *)(s + src_stride));
+      __m128i r2 = _mm_loadu_si128((const __m128i *)(s + 2 * src_stride));
+      __m128i r3 = _mm_loadu_si128((const __m128i *)(s + 3 * src_stride));
+      __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+      __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+      __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+      __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+      _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(d + dst_stride), _mm_unpackhi_epi64(t0, t1));
+      _mm_storeu_si128((__m128i *)(d + 2 * dst_stride),
+                       _mm_unpacklo_epi64(t2, t3));
+      _mm_storeu_si128((__m128i *)(d + 3 * dst_stride),
+                       _mm_unpackhi_epi64(t2, t3));
+    }
+  }
+  span_transpose_edges(dst, dst_stride, src, src_stride, w, h);
+}
+
+__attribute__((target("sse2"))) static void
+span_reverse_sse2(int *dst, const int *src, int count) {
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + count - 4 - i));
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+  }
+  span_reverse_scalar(dst + i, src, count - i);
+}
+
+__attribute__((target("avx2"))) static void
+span_blend_avx2(int *dst, const int *src, int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i full = _mm256_set1_epi32(255);
+  const __m256i round = _mm256_set1_epi16(128);
+
+  for (; count >= 8; count -= 8, dst += 8, src += 8) {
+    __m256i s = _mm256_loadu_si256((const __m256i *)src);
+    __m256i a = _mm256_srli_epi32(s, 24);
+
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, zero)) == -1) {
+      continue;
+    }
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(a, full)) == -1) {
+      _mm256_storeu_si256((__m256i *)dst, s);
+      continue;
+    }
+
+    // The unpacks work per 128-bit lane, which keeps pixels and their
+    // alphas lined up.
+    __m256i d = _mm256_loadu_si256((const __m256i *)dst);
+    __m256i ia = _mm256_sub_epi32(full, a);
+    ia = _mm256_or_si256(ia, _mm256_slli_epi32(ia, 16));
+
+    __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+                                    _mm256_unpacklo_epi32(ia, ia));
+    __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+                                    _mm256_unpackhi_epi32(ia, ia));
+    lo = _mm256_add_epi16(lo, round);
+    hi = _mm256_add_epi16(hi, round);
+    lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+    hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+
+    _mm256_storeu_si256((__m256i *)dst,
+                        _mm256_add_epi8(_mm256_packus_epi16(lo, hi), s));
+  }
+  span_blend_sse2(dst, src, count);
+}
+
+// Turn the 8 mask bits into two 4-lane select masks, one lane per pixel.
+#define SPAN_SSE2_MASKS(bits, lo, hi)                                         \
+  do {                                                                        \
+    const __m128i bit_lo = _mm_set_epi32(0x10, 0x20, 0x40, 0x80);             \
+    const __m128i bit_hi = _mm_set_epi32(0x01, 0x02, 0x04, 0x08);             \
+    __m128i b = _mm_set1_epi32(bits);                                         \
+    lo = _mm_cmpeq_epi32(_mm_and_si128(b, bit_lo), bit_lo);                   \
+    hi = _mm_cmpeq_epi32(_mm_and_si128(b, bit_hi), bit_hi);                   \
+  } while (0)
+
+__attribute__((target("sse2"))) static void
+span_expand_sse2(int *dst, int bits, int count, int fg) {
+  if (count != 8) {
+    span_expand_scalar(dst, bits, count, fg);
+    return;
+  }
+
+  __m128i lo, hi;
+  __m128i color = _mm_set1_epi32(fg);
+  SPAN_SSE2_MASKS(bits, lo, hi);
+
+  __m128i d0 = _mm_loadu_si128((const __m128i *)dst);
+  __m128i d1 = _mm_loadu_si128((const __m128i *)(dst + 4));
+  _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(lo, color),
+                                                _mm_andnot_si128(lo, d0)));
+  _mm_storeu_si128((__m128i *)(dst + 4),
+                   _mm_or_si128(_mm_and_si128(hi, color),
+                                _mm_andnot_si128(hi, d1)));
+}
+
+__attribute__((target("sse2"))) static void
+span_expand_bg_sse2(int *dst, int bits, int count, int fg, int bg) {
+  if (count != 8) {
+    span_expand_bg_scalar(dst, bits, count, fg, bg);
+    return;
+  }
+
+  __m128i lo, hi;
+  __m128i color = _mm_set1_epi32(fg);
+  __m128i back = _mm_set1_epi32(bg);
+  SPAN_SSE2_MASKS(bits, lo, hi);
+
+  // No reads from dst, which may well be uncached.
+  _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(lo, color),
+                                                _mm_andnot_si128(lo, back)));
+  _mm_storeu_si128((__m128i *)(dst + 4),
+                   _mm_or_si128(_mm_and_si128(hi, color),
+                                _mm_andnot_si128(hi, back)));
+}
+
+__attribute__((target("avx2"))) static void
+span_expand_avx2(int *dst, int bits, int count, int fg) {
+  if (count != 8) {
+    span_expand_scalar(dst, bits, count, fg);
+    return;
+  }
+
+  const __m256i bit = _mm256_set_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20,
+                                       0x40, 0x80);
+  __m256i mask = _mm256_cmpeq_epi32(
+      _mm256_and_si256(_mm256_set1_epi32(bits), bit), bit);
+
+  // Masked store, the background is never read.
+  _mm256_maskstore_epi32(dst, mask, _mm256_set1_epi32(fg));
+}
+
+__attribute__((target("avx2"))) static void
+span_scale_nearest_avx2(int *dst, const int *src, int count, int fx,
+                        int step) {
+  __m256i pos = _mm256_add_epi32(
+      _mm256_set1_epi32(fx),
+      _mm256_mullo_epi32(_mm256_set1_epi32(step),
+                         _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0)));
+  __m256i advance = _mm256_set1_epi32(8 * step);
+
+  for (; count >= 8; count -= 8, dst += 8) {
+    __m256i index = _mm256_srli_epi32(pos, 16);
+    _mm256_storeu_si256((__m256i *)dst, _mm256_i32gather_epi32(src, index, 4));
+    pos = _mm256_add_epi32(pos, advance);
+    fx += 8 * step;
+  }
+  span_scale_nearest_scalar(dst, src, count, fx, step);
+}
+#endif
+
+#ifdef SPAN_NEON
+static void span_fill_neon(int *dst, int color, int count) {
+  int32x4_t value = vdupq_n_s32(color);
+
+  while (count >= 16) {
+    vst1q_s32(dst, value);
+    vst1q_s32(dst + 4, value);
+    vst1q_s32(dst + 8, value);
+    vst1q_s32(dst + 12, value);
+    dst += 16;
+    count -= 16;
+  }
+  while (count >= 4) {
+    vst1q_s32(dst, value);
+    dst += 4;
+    count -= 4;
+  }
+  while (count-- > 0) {
+    *dst++ = color;
+  }
+}
+
+static void span_blend_neon(int *dst, const int *src, int count) {
+  const uint32x4_t opaque = vdupq_n_u32(0xFF000000);
+
+  for (; count >= 4; count -= 4, dst += 4, src += 4) {
+    uint32x4_t s = vld1q_u32((const uint32_t *)src);
+    uint32x4_t a = vandq_u32(s, opaque);
+    uint64x2_t any = vreinterpretq_u64_u32(a);
+
+    if ((vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)) == 0) {
+      continue;
+    }
+
+    uint64x2_t all = vreinterpretq_u64_u32(vceqq_u32(a, opaque));
+    if ((vgetq_lane_u64(all, 0) & vgetq_lane_u64(all, 1)) == ~0ULL) {
+      vst1q_u32((uint32_t *)dst, s);
+      continue;
+    }
+
+    // Spread 255 - alpha over all four bytes of each pixel.
+    uint8x16_t ia = vmvnq_u8(vreinterpretq_u8_u32(
+        vmulq_n_u32(vshrq_n_u32(s, 24), 0x01010101)));
+    uint8x16_t d = vld1q_u8((const uint8_t *)dst);
+
+    uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(ia));
+    uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(ia));
+    uint8x16_t scaled =
+        vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8),
+                    vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8));
+
+    vst1q_u8((uint8_t *)dst, vaddq_u8(scaled, vreinterpretq_u8_u32(s)));
+  }
+  span_blend_scalar(dst, src, count);
+}
+
+static void span_blend_color_neon(int *dst, int color, int count) {
+  const uint8x16_t s = vreinterpretq_u8_u32(vdupq_n_u32(color));
+  const uint8x8_t ia = vdup_n_u8(255 - ((uint32_t)color >> 24));
+
+  for (; count >= 4; count -= 4, dst += 4) {
+    uint8x16_t d = vld1q_u8((const uint8_t *)dst);
+    uint16x8_t lo = vmull_u8(vget_low_u8(d), ia);
+    uint16x8_t hi = vmull_u8(vget_high_u8(d), ia);
+    uint8x16_t scaled =
+        vcombine_u8(vrshrn_n_u16(vrsraq_n_u16(lo, lo, 8), 8),
+                    vrshrn_n_u16(vrsraq_n_u16(hi, hi, 8), 8));
+
+    vst1q_u8((uint8_t *)dst, vaddq_u8(scaled, s));
+  }
+  span_blend_color_scalar(dst, color, count);
+}
+
+static void span_transpose_neon(int *dst, int dst_stride, const int *src,
+                                int src_stride, int w, int h) {
+  for (int y = 0; y + 4 <= h; y += 4) {
+    for (int x = 0; x + 4 <= w; x += 4) {
+      const int *s = src + x * src_stride + y;
+      int *d = dst + y * dst_stride + x;
+      int32x4x2_t t0 = vtrnq_s32(vld1q_s32(s), vld1q_s32(s + src_stride));
+      int32x4x2_t t1 = vtrnq_s32(vld1q_s32(s + 2 * src_stride),
+                                 vld1q_s32(s + 3 * src_stride));
+
+      vst1q_s32(d, vcombine_s32(vget_low_s32(t0.val[0]),
+                                vget_low_s32(t1.val[0])));
+      vst1q_s32(d + dst_stride, vcombine_s32(vget_low_s32(t0.val[1]),
+                                             vget_low_s32(t1.val[1])));
+      vst1q_s32(d + 2 * dst_stride, vcombine_s32(vget_high_s32(t0.val[0]),
+                                                 vget_high_s32(t1.val[0])));
+      vst1q_s32(d + 3 * dst_stride, vcombine_s32(vget_high_s32(t0.val[1]),
+                                                 vget_high_s32(t1.val[1])));
+    }
+  }
+  span_transpose_edges(dst, dst_stride, src, src_stride, w, h);
+}
+
+static void span_reverse_neon(int *dst, const int *src, int count) {
+  int i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    int32x4_t v = vrev64q_s32(vld1q_s32(src + count - 4 - i));
+    vst1q_s32(dst + i, vextq_s32(v, v, 2));
+  }
+  span_reverse_scalar(dst + i, src, count - i);
+}
+
+static const uint32_t span_neon_bits[8] = {0x80, 0x40, 0x20, 0x10,
+                                           0x08, 0x04, 0x02, 0x01};
+
+static void span_expand_neon(int *dst, int bits, int count, int fg) {
+  if (count != 8) {
+    span_expand_scalar(dst, bits, count, fg);
+    return;
+  }
+
+  uint32x4_t b = vdupq_n_u32(bits);
+  uint32x4_t color = vdupq_n_u32(fg);
+  uint32x4_t lo = vtstq_u32(b, vld1q_u32(span_neon_bits));
+  uint32x4_t hi = vtstq_u32(b, vld1q_u32(span_neon_bits + 4));
+
+  vst1q_u32((uint32_t *)dst,
+            vbslq_u32(lo, color, vld1q_u32((const uint32_t *)dst)));
+  vst1q_u32((uint32_t *)(dst + 4),
+            vbslq_u32(hi, color, vld1q_u32((const uint32_t *)(dst + 4))));
+}
+
+static void span_expand_bg_neon(int *dst, int bits, int count, int fg, int bg) {
+  if (count != 8) {
+    span_expand_bg_scalar(dst, bits, count, fg, bg);
+    return;
+  }
+
+  uint32x4_t b = vdupq_n_u32(bits);
+  uint32x4_t color = vdupq_n_u32(fg);
+  uint32x4_t back = vdupq_n_u32(bg);
+  uint32x4_t lo = vtstq_u32(b, vld1q_u32(span_neon_bits));
+  uint32x4_t hi = vtstq_u32(b, vld1q_u32(span_neon_bits + 4));
+
+  vst1q_u32((uint32_t *)dst, vbslq_u32(lo, color, back));
+  vst1q_u32((uint32_t *)(dst + 4), vbslq_u32(hi, color, back));
+}
+#endif
+
+typedef struct {
+  const char *name;
+  void (*fill)(int *dst, int color, int count);
+  void (*blend)(int *dst, const int *src, int count);
+  void (*blend_color)(int *dst, int color, int count);
+  void (*blend_color_mask)(int *dst, int color, const unsigned char *coverage,
+                           int count);
+  void (*expand)(int *dst, int bits, int count, int fg);
+  void (*expand_bg)(int *dst, int bits, int count, int fg, int bg);
+  void (*scale_nearest)(int *dst, const int *src, int count, int fx, int step);
+  void (*transpose)(int *dst, int dst_stride, const int *src, int src_stride,
+                    int w, int h);
+  void (*reverse)(int *dst, const int *src, int count);
+} span_impl_t;
+
+static span_impl_t span_impl;
+static const span_impl_t *span_ready;
+static pthread_once_t span_once = PTHREAD_ONCE_INIT;
+
+// Pick the kernels, once: pool workers and loader threads may make the first
+// span call at the same time as the main thread.
+static void span_init(void) {
+  span_impl_t impl = {"scalar",
+                      span_fill_scalar,
+                      span_blend_scalar,
+                      span_blend_color_scalar,
+                      span_blend_color_mask_scalar,
+                      span_expand_scalar,
+                      span_expand_bg_scalar,
+                      span_scale_nearest_scalar,
+                      span_transpose_scalar,
+                      span_reverse_scalar};
+#if defined(SPAN_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl.name = "avx2";
+    impl.fill = span_fill_avx2;
+    impl.blend = span_blend_avx2;
+    impl.blend_color = span_blend_color_sse2;
+    impl.blend_color_mask = span_blend_color_mask_sse2;
+    impl.expand = span_expand_avx2;
+    impl.expand_bg = span_expand_bg_sse2;
+    impl.scale_nearest = span_scale_nearest_avx2;
+    impl.transpose = span_transpose_sse2;
+    impl.reverse = span_reverse_sse2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    impl.name = "sse2";
+    impl.fill = span_fill_sse2;
+    impl.blend = span_blend_sse2;
+    impl.blend_color = span_blend_color_sse2;
+    impl.blend_color_mask = span_blend_color_mask_sse2;
+    impl.expand = span_expand_sse2;
+    impl.expand_bg = span_expand_bg_sse2;
+    impl.transpose = span_transpose_sse2;
+    impl.reverse = span_reverse_sse2;
+  }
+#elif defined(SPAN_NEON)
+  impl.name = "neon";
+  impl.fill = span_fill_neon;
+  impl.blend = span_blend_neon;
+  impl.blend_color = span_blend_color_neon;
+  impl.expand = span_expand_neon;
+  impl.expand_bg = span_expand_bg_neon;
+  impl.transpose = span_transpose_neon;
+  impl.reverse = span_reverse_neon;
+#endif
+
+  // Published whole: whoever sees the pointer sees every entry.
+  span_impl = impl;
+  __atomic_store_n(&span_ready, &span_impl, __ATOMIC_RELEASE);
+}
+
+// One load once the table is built, pthread_once only until then.
+static const span_impl_t *span_get_impl() {
+  const span_impl_t *impl = __atomic_load_n(&span_ready, __ATOMIC_ACQUIRE);
+
+  if (impl == NULL) {
+    pthread_once(&span_once, span_init);
+    impl = __atomic_load_n(&span_ready, __ATOMIC_ACQUIRE);
+  }
+  return impl;
+}
+
+void span_fill(int *dst, int color, int count) {
+  span_get_impl()->fill(dst, color, count);
+}
+
+void span_blend(int *dst, const int *src, int count) {
+  span_get_impl()->blend(dst, src, count);
+}
+
+void span_blend_color(int *dst, int color, int count) {
+  uint32_t alpha = (uint32_t)color >> 24;
+
+  if (alpha == 255) {
+    span_get_impl()->fill(dst, color, count);
+  } else if (alpha != 0) {
+    span_get_impl()->blend_color(dst, color, count);
+  }
+}
+
+void span_blend_color_mask(int *dst, int color, const unsigned char *coverage,
+                           int count) {
+  span_get_impl()->blend_color_mask(dst, color, coverage, count);
+}
+
+void span_expand_mask(int *dst, int bits, int count, int fg) {
+  // Blank glyph rows are common, skip them before dispatching.
+  if (bits & (0xFF00 >> count)) {
+    span_get_impl()->expand(dst, bits, count, fg);
+  }
+}
+
+void span_expand_mask_bg(int *dst, int bits, int count, int fg, int bg) {
+  span_get_impl()->expand_bg(dst, bits, count, fg, bg);
+}
+
+void span_scale_nearest(int *dst, const int *src, int count, int fx,
+                        int step) {
+  span_get_impl()->scale_nearest(dst, src, count, fx, step);
+}
+
+void span_transpose(int *dst, int dst_stride, const int *src, int src_stride,
+                    int w, int h) {
+  span_get_impl()->transpose(dst, dst_stride, src, src_stride, w, h);
+}
+
+void span_reverse(int *dst, const int *src, int count) {
+  span_get_impl()->reverse(dst, src, count);
+}
+
+void span_blend_alpha(int *dst, const int *src, int count, int alpha) {
+  if (alpha >= 255) {
+    span_blend(dst, src, count);
+    return;
+  }
+  if (alpha <= 0) {
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    uint32_t pixel = span_mul4((uint32_t)src[i], alpha);
+    if (pixel >> 24) {
+      dst[i] = (int)span_over((uint32_t)dst[i], pixel);
+    }
+  }
+}
+
+void span_premultiply(int *pixels, int count) {
+  for (int i = 0; i < count; i++) {
+    uint32_t pixel = (uint32_t)pixels[i];
+    uint32_t alpha = pixel >> 24;
+
+    if (alpha != 255) {
+      pixels[i] = (int)((alpha << 24) | (span_mul4(pixel, alpha) & 0xFFFFFF));
+    }
+  }
+}
+
+const char *span_impl_name() { return span_get_impl()->name; }
@@ -0,0 +1,54 @@
+#ifndef __SPAN_H_
+#define __SPAN_H_
+
+// Horizontal span kernels shared by the draw primitives. They do no clipping,
+// callers pass spans that are already inside the destination. The fastest
+// implementation the CPU supports is picked on first use.
+
+// Set count pixels starting at dst to color.
+void span_fill(int* dst, int color, int count);
+
+// Composite count premultiplied ARGB8888 pixels from src over dst (Porter-Duff
+// "over"). Fully transparent source runs are skipped and fully opaque runs are
+// copied, so the cost tracks visible pixels.
+void span_blend(int* dst, const int* src, int count);
+
+// Composite the premultiplied color over count pixels. Opaque colors are a
+// span_fill.
+void span_blend_color(int* dst, int color, int count);
+
+// Same with the color scaled by coverage[i] / 255 for pixel i, e.g. the
+// anti-aliased edge of a shape.
+void span_blend_color_mask(int* dst, int color, const unsigned char* coverage, int count);
+
+// Like span_blend, with src additionally scaled by a global alpha (0-255).
+void span_blend_alpha(int* dst, const int* src, int count, int alpha);
+
+// Convert count straight-alpha ARGB8888 pixels to premultiplied in place.
+void span_premultiply(int* pixels, int count);
+
+// Expand up to 8 bits of a 1-bit-per-pixel mask, most significant bit first:
+// pixel i is set to fg when bit (7 - i) of bits is set. span_expand_mask leaves
+// the other pixels alone, span_expand_mask_bg sets them to bg.
+void span_expand_mask(int* dst, int bits, int count, int fg);
+void span_expand_mask_bg(int* dst, int bits, int count, int fg, int bg);
+
+// Nearest-neighbour resample one row: dst[i] = src[(fx + i * step) >> 16].
+// fx and step are 16.16 fixed point, fx + count * step must fit in an int.
+void span_scale_nearest(int* dst, const int* src, int count, int fx, int step);
+
+// Copy a w x h block turned on its side: dst[y * dst_stride + x] =
+// src[x * src_stride + y]. Strides are in pixels and may be negative to walk
+// rows upwards, which with the transpose covers every 90 degree rotation and
+// flip. Keep blocks small (32 x 32, say) so both sides stay in cache.
+void span_transpose(int* dst, int dst_stride, const int* src, int src_stride, int w, int h);
+
+// dst[i] = src[count - 1 - i], for horizontal flips. dst and src must not
+// overlap.
+void span_reverse(int* dst, const int* src, int count);
+
+// Name of the kernel set span_fill dispatched to ("avx2", "sse2", "neon" or
+// "scalar"), for logs and benchmarks.
+const char* span_impl_name();
+
+#endif
@@ -0,0 +1,93 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include "stats.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+static const char *stats_names[STATS_PRIMITIVES] = {
+    "draw_rect", "draw_array", "draw_string", "scale", "clear", "raster"};
+
+uint64_t stats_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void stats_reset(stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+// Close the frame at now. The first call only starts the clock.
+void stats_frame(stats_t *stats, uint64_t now) {
+  stats->bytes_last_frame = stats->bytes_frame;
+  stats->bytes_total += stats->bytes_frame;
+  stats->bytes_frame = 0;
+
+  if (stats->last_present_ns != 0) {
+    uint64_t ns = now - stats->last_present_ns;
+    uint64_t bucket = ns / 1000000;
+
+    if (bucket >= STATS_FRAME_BUCKETS) {
+      bucket = STATS_FRAME_BUCKETS - 1;
+    }
+    stats->frame_histogram[bucket]++;
+
+    if (stats->frames == 0 || ns < stats->frame_ns_min) {
+      stats->frame_ns_min = ns;
+    }
+    if (ns > stats->frame_ns_max) {
+      stats->frame_ns_max = ns;
+    }
+    stats->frame_ns_last = ns;
+    stats->frame_ns_total += ns;
+    stats->frames++;
+  }
+  stats->last_present_ns = now;
+}
+
+const char *stats_primitive_name(int primitive) {
+  if (primitive < 0 || primitive >= STATS_PRIMITIVES) {
+    return "unknown";
+  }
+  return stats_names[primitive];
+}
+
+int stats_frame_percentile(const stats_t *stats, int pct) {
+  uint64_t want = (stats->frames * pct + 99) / 100;
+  uint64_t seen = 0;
+
+  for (int i = 0; i < STATS_FRAME_BUCKETS; i++) {
+    seen += stats->frame_histogram[i];
+    if (seen >= want) {
+      return i;
+    }
+  }
+  return STATS_FRAME_BUCKETS - 1;
+}
+
+void stats_dump(const stats_t *stats, FILE *out) {
+  fprintf(out, "frames %" PRIu64 "\n", stats->frames);
+  if (stats->frames) {
+    fprintf(out, "frame_ns_avg %" PRIu64 "\n",
+            stats->frame_ns_total / stats->frames);
+  }
+  fprintf(out, "frame_ns_min %" PRIu64 "\n", stats->frame_ns_min);
+  fprintf(out, "frame_ns_max %" PRIu64 "\n", stats->frame_ns_max);
+  fprintf(out, "frame_ms_p50 %d\n", stats_frame_percentile(stats, 50));
+  fprintf(out, "frame_ms_p99 %d\n", stats_frame_percentile(stats, 99));
+  fprintf(out, "vblank_misses %" PRIu64 "\n", stats->vblank_misses);
+  fprintf(out, "bytes_last_frame %" PRIu64 "\n", stats->bytes_last_frame);
+  fprintf(out, "bytes_scanout %" PRIu64 "\n", stats->bytes_scanout);
+  fprintf(out, "bytes_total %" PRIu64 "\n", stats->bytes_total);
+  fprintf(out, "clipped_pixels %" PRIu64 "\n", stats->clipped_pixels);
+
+  for (int i = 0; i < STATS_PRIMITIVES; i++) {
+    fprintf(out, "%s_calls %" PRIu64 "\n", stats_names[i],
+            stats->primitives[i].calls);
+    fprintf(out, "%s_ns %" PRIu64 "\n", stats_names[i],
+            stats->primitives[i].ns);
+  }
+}
@@ -0,0 +1,82 @@
+#ifndef __STATS_H_
+#define __STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Opt-in counters for a context, see context_enable_stats(). Everything is
+// updated on the drawing thread, never from pool workers, so reading the
+// struct between frames needs no locking.
+
+enum {
+  STATS_DRAW_RECT,   // draw_rect, clear_context_color
+  STATS_DRAW_ARRAY,  // draw_array, draw_image and the blend variants
+  STATS_DRAW_STRING, // draw_string, draw_string_color
+  STATS_SCALE,       // scale_into_pool
+  STATS_CLEAR,       // clear_context
+  STATS_RASTER,      // lines, polygons, circles and rounded rects
+  STATS_PRIMITIVES
+};
+
+// Frame times in 1 ms buckets, the last one collects everything slower.
+#define STATS_FRAME_BUCKETS 64
+
+typedef struct {
+  uint64_t calls;
+  uint64_t ns;
+} stats_counter_t;
+
+typedef struct {
+  // Time between two context_present() calls.
+  uint64_t frames;
+  uint64_t frame_ns_last;
+  uint64_t frame_ns_min;
+  uint64_t frame_ns_max;
+  uint64_t frame_ns_total;
+  uint32_t frame_histogram[STATS_FRAME_BUCKETS];
+
+  // Refreshes that showed the previous frame again because the next one was
+  // not ready, counted from the page-flip sequence numbers.
+  uint64_t vblank_misses;
+
+  // Pixel bytes written by primitives. bytes_frame is the frame in progress,
+  // bytes_last_frame the one presented last. bytes_scanout counts what the
+  // shadow flush copied to the framebuffer in the last frame.
+  uint64_t bytes_frame;
+  uint64_t bytes_last_frame;
+  uint64_t bytes_scanout;
+  uint64_t bytes_total;
+
+  // set_pixel calls outside the context, dropped.
+  uint64_t clipped_pixels;
+
+  stats_counter_t primitives[STATS_PRIMITIVES];
+
+  uint64_t last_present_ns;
+} stats_t;
+
+uint64_t stats_now(void);
+void stats_reset(stats_t* stats);
+void stats_frame(stats_t* stats, uint64_t now);
+const char* stats_primitive_name(int primitive);
+
+// Smallest frame time in ms that pct percent of the frames stayed under,
+// STATS_FRAME_BUCKETS - 1 means "slower than the histogram covers".
+int stats_frame_percentile(const stats_t* stats, int pct);
+
+// One "name value" line per counter, for logs and exporters.
+void stats_dump(const stats_t* stats, FILE* out);
+
+// Primitives bracket their work with these, both are no-ops without stats.
+static inline uint64_t stats_begin(stats_t* stats) {
+  return stats ? stats_now() : 0;
+}
+
+static inline void stats_end(stats_t* stats, int primitive, uint64_t start) {
+  if (stats) {
+    stats->primitives[primitive].calls++;
+    stats->primitives[primitive].ns += stats_now() - start;
+  }
+}
+
+#endif